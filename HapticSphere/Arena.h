@@ -0,0 +1,118 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <stddef.h>
+#include <stdlib.h>
+using namespace std;
+
+// Counts heap allocations made by threads that have counting switched on. main.cpp replaces
+// the global operator new to call Note(); the step switches counting on for the threads it
+// runs on, so what is reported is the step's own allocations and not the display's.
+class AllocationCounter
+{
+public:
+	static atomic<long>& Count() { static atomic<long> count(0); return count; }
+	static bool& Enabled() { static thread_local bool enabled = false; return enabled; }
+	static void Note() { if (Enabled()) Count()++; }
+};
+// Counts allocations on this thread for as long as it is in scope
+class AllocationScope
+{
+public:
+	AllocationScope() : _was(AllocationCounter::Enabled()) { AllocationCounter::Enabled() = true; }
+	~AllocationScope() { AllocationCounter::Enabled() = _was; }
+private:
+	bool _was;
+};
+
+// Bump allocator for data that only lives for one step. Allocating is an atomic add, so any
+// task can use it; nothing is freed until Reset() at the start of the next step.
+// If a step needs more than the arena holds the rest comes off the heap, and the next Reset()
+// grows the arena to fit, so once the step has run at its largest it never touches the heap.
+// Both go to the AllocationCounter, so a step that spills doesn't show as allocation free.
+class FrameArena
+{
+public:
+	//members
+	FrameArena(size_t bytes = 1 << 20);
+	void* Allocate(size_t bytes); // 16 byte aligned
+	void Reset();
+	size_t Capacity() { return _capacity; }
+	size_t HighWater() { return _highWater; }
+	~FrameArena();
+
+private:
+	char* _base;
+	size_t _capacity;
+	atomic<size_t> _used;
+	size_t _highWater;
+	mutex _overflowLock;
+	vector<void*> _overflow; // heap blocks handed out once the arena was full
+};
+
+FrameArena::FrameArena(size_t bytes)
+{
+	_capacity = bytes;
+	_base = (char*)malloc(_capacity);
+	if (_base == NULL) _capacity = 0; // everything overflows until a Reset() can grow it
+	_used = 0;
+	_highWater = 0;
+}
+void* FrameArena::Allocate(size_t bytes)
+{
+	size_t padded = (bytes + 15) & ~(size_t)15;
+	size_t at = _used.fetch_add(padded);
+	if (at + padded <= _capacity)
+		return _base + at;
+	lock_guard<mutex> lock(_overflowLock);
+	AllocationCounter::Note();
+	void* p = malloc(padded);
+	if (p == NULL) throw bad_alloc();
+	_overflow.push_back(p);
+	return p;
+}
+void FrameArena::Reset()
+{
+	size_t used = _used.exchange(0);
+	if (used > _highWater) _highWater = used;
+	for (unsigned int i = 0; i < _overflow.size(); i++)
+		free(_overflow[i]);
+	_overflow.clear();
+	if (_highWater > _capacity)
+	{
+		// on failure the old block is kept and the overflow carries on covering the rest
+		AllocationCounter::Note();
+		size_t capacity = _highWater + _highWater / 2;
+		char* base = (char*)malloc(capacity);
+		if (base == NULL) return;
+		free(_base);
+		_base = base;
+		_capacity = capacity;
+	}
+}
+FrameArena::~FrameArena()
+{
+	Reset();
+	free(_base);
+}
+
+// Lets standard containers live in a FrameArena. Freeing does nothing; the memory comes back
+// when the arena is reset, so a container must not outlive the step it was made in.
+template <class T>
+class ArenaAllocator
+{
+public:
+	typedef T value_type;
+	FrameArena* arena;
+	ArenaAllocator(FrameArena* a) : arena(a) {}
+	template <class U> ArenaAllocator(const ArenaAllocator<U>& o) : arena(o.arena) {}
+	T* allocate(size_t n) { return (T*)arena->Allocate(n * sizeof(T)); }
+	void deallocate(T*, size_t) {}
+	template <class U> bool operator==(const ArenaAllocator<U>& o) const { return arena == o.arena; }
+	template <class U> bool operator!=(const ArenaAllocator<U>& o) const { return arena != o.arena; }
+};
+
+#endif _ARENA_H_
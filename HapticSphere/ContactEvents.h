@@ -0,0 +1,191 @@
+#ifndef _CONTACTEVENTS_H_
+#define _CONTACTEVENTS_H_
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <functional>
+using namespace std;
+
+// A change in whether two spheres touch, a < b. The impulse is how hard they pushed on each
+// other over the step (force times the time step); an END has none, they are apart.
+struct ContactEvent
+{
+	enum Kind { BEGIN, PERSIST, END };
+	int kind;
+	int a, b;
+	double impulse;
+};
+
+// The sphere to sphere contacts of every step, as begin, persist and end events. The force pass
+// reports each touching pair once, from the lower index sphere's task, into one flat buffer: a
+// slot is claimed with an atomic add and nothing else is shared. After the step the list is put
+// in (a, b) order with a counting sort on a (the lists for one a are only a few long), and
+// walked alongside the last step's list to find what began and ended. Every listener gets the
+// whole step's events in one call, so however many there are, the force pass never calls out.
+// Pairs that don't fit the buffer go on an overflow list (under a lock), and the buffer is grown
+// to fit them for the next step.
+// Pairs are sphere indices, so the stream starts over (with no END events) when they change.
+class ContactEvents
+{
+public:
+	typedef function<void(const ContactEvent* events, int count, unsigned int step)> Listener;
+	//properties
+	int begins, persists, ends; // last step
+	//members
+	ContactEvents(int capacity = 1024);
+	int Subscribe(const Listener& listener);
+	void Unsubscribe(int id);
+	bool Enabled() { return _enabled; } // anyone listening; the force pass only reports if so
+	void Begin(int count); // between steps: count spheres this step
+	void Touch(int a, int b, double impulse); // from a's force task, a < b
+	void End(unsigned int step); // between steps: work out the events and hand them out
+	void Clear();
+	int NumContacts() { return _previous.size(); }
+	~ContactEvents();
+
+private:
+	struct Pair
+	{
+		int a, b;
+		double impulse;
+	};
+	vector<Pair> _touched, _previous, _current;
+	atomic<unsigned int> _used;
+	mutex _overflowLock;
+	vector<Pair> _overflow;
+	vector<int> _start; // counting sort, by a
+	vector<ContactEvent> _events;
+	vector< pair<int, Listener> > _listeners;
+	int _nextId, _count;
+	bool _enabled;
+
+	void Emit(int kind, const Pair& p);
+};
+
+ContactEvents::ContactEvents(int capacity)
+{
+	_touched.resize(capacity);
+	_used = 0;
+	_nextId = 0;
+	_count = 0;
+	_enabled = false;
+	begins = persists = ends = 0;
+}
+int ContactEvents::Subscribe(const Listener& listener)
+{
+	_listeners.push_back(make_pair(_nextId, listener));
+	_enabled = true;
+	return _nextId++;
+}
+void ContactEvents::Unsubscribe(int id)
+{
+	for (unsigned int i = 0; i < _listeners.size(); i++)
+		if (_listeners[i].first == id)
+		{
+			_listeners.erase(_listeners.begin() + i);
+			break;
+		}
+	_enabled = !_listeners.empty();
+	if (!_enabled) Clear();
+}
+void ContactEvents::Begin(int count)
+{
+	_count = count;
+	_used = 0;
+}
+void ContactEvents::Touch(int a, int b, double impulse)
+{
+	unsigned int slot = _used.fetch_add(1, memory_order_relaxed);
+	Pair p = { a, b, impulse };
+	if (slot < _touched.size())
+	{
+		_touched[slot] = p;
+		return;
+	}
+	lock_guard<mutex> lock(_overflowLock);
+	_overflow.push_back(p);
+}
+void ContactEvents::End(unsigned int step)
+{
+	unsigned int used = min((unsigned int)_used, (unsigned int)_touched.size());
+	unsigned int n = used + _overflow.size();
+	// sort by a, then by b within each a
+	_start.assign(_count + 1, 0);
+	for (unsigned int i = 0; i < n; i++)
+		_start[(i < used ? _touched[i] : _overflow[i - used]).a + 1]++;
+	for (int a = 0; a < _count; a++)
+		_start[a + 1] += _start[a];
+	_current.resize(n);
+	for (unsigned int i = 0; i < n; i++)
+	{
+		const Pair& p = i < used ? _touched[i] : _overflow[i - used];
+		_current[_start[p.a]++] = p;
+	}
+	for (unsigned int i = 1; i < n; i++)
+	{
+		Pair p = _current[i];
+		unsigned int j = i;
+		for (; j > 0 && _current[j - 1].a == p.a && _current[j - 1].b > p.b; j--)
+			_current[j] = _current[j - 1];
+		_current[j] = p;
+	}
+	if (!_overflow.empty())
+	{
+		_touched.resize(2 * n);
+		_overflow.clear();
+	}
+
+	// both lists are in order, so one walk along them finds what is new and what has gone
+	_events.clear();
+	begins = persists = ends = 0;
+	unsigned int i = 0, j = 0;
+	while (i < _current.size() || j < _previous.size())
+	{
+		const Pair* now = i < _current.size() ? &_current[i] : NULL;
+		const Pair* was = j < _previous.size() ? &_previous[j] : NULL;
+		if (was == NULL || (now != NULL && (now->a < was->a || (now->a == was->a && now->b < was->b))))
+		{
+			Emit(ContactEvent::BEGIN, *now);
+			begins++;
+			i++;
+		}
+		else if (now == NULL || now->a != was->a || now->b != was->b)
+		{
+			Emit(ContactEvent::END, *was);
+			ends++;
+			j++;
+		}
+		else
+		{
+			Emit(ContactEvent::PERSIST, *now);
+			persists++;
+			i++;
+			j++;
+		}
+	}
+	_previous.swap(_current);
+	if (_events.empty()) return;
+	for (unsigned int l = 0; l < _listeners.size(); l++)
+		_listeners[l].second(_events.data(), _events.size(), step);
+}
+void ContactEvents::Emit(int kind, const Pair& p)
+{
+	ContactEvent e;
+	e.kind = kind;
+	e.a = p.a;
+	e.b = p.b;
+	e.impulse = kind == ContactEvent::END ? 0.0 : p.impulse;
+	_events.push_back(e);
+}
+void ContactEvents::Clear()
+{
+	_previous.clear();
+	_overflow.clear();
+	_used = 0;
+	begins = persists = ends = 0;
+}
+ContactEvents::~ContactEvents()
+{
+}
+
+#endif _CONTACTEVENTS_H_
@@ -0,0 +1,283 @@
+#ifndef _CONTACTTABLE_H_
+#define _CONTACTTABLE_H_
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <deque>
+#include <algorithm>
+#include <math.h>
+#include "objects.h"
+using namespace std;
+
+// How touching spheres push on each other when the contact table is in use
+struct ContactModel
+{
+	bool enabled; // off: the plain normal spring, with no memory from step to step
+	double damping; // fraction of critical damping along the normal
+	double friction; // Coulomb coefficient, caps the tangential force at friction * normal force
+	double shearStiffness; // tangential spring constant as a fraction of the normal one
+};
+
+// Contacts that persist from step to step, so a contact can be damped and can hold a
+// tangential (Cundall-Strack) spring that stretches while the spheres roll and slide over each
+// other. Without it a pile never comes to rest.
+// Entries are keyed by the ordered pair (sphere, other sphere): the force on a sphere is a
+// gather, so each sphere's task only ever writes its own entries and the contact workers never
+// contend on anything but claiming an empty slot, which is a compare and swap on the key.
+// Both entries of a pair are worked out the same way (from the lower id to the higher one) so
+// they stay equal and the forces stay equal and opposite.
+// An entry is live while it keeps getting touched; one that missed a step is a new contact.
+// The table only grows or sheds dead entries in BeginStep(), between steps. New contacts that
+// don't fit during a step go on an overflow list (under a lock) and join the table at the next
+// BeginStep(), so no contact ever loses its history to a full table.
+class ContactTable
+{
+public:
+	//properties
+	ContactModel model;
+	struct Contact
+	{
+		Vec3d shear; // tangential spring stretch, from the lower id sphere's side
+		double damping; // normal damping constant, worked out when the contact starts
+		unsigned int stamp; // step it was last touched in
+	};
+	// A contact as it travels with its sphere between domain processes
+	struct Record
+	{
+		int id, other;
+		unsigned int stamp;
+		double shear[3], damping;
+	};
+	//members
+	ContactTable(int capacity = 1024);
+	void BeginStep();
+	void Clear();
+	double Accumulate(sphere& s, int id, const sphere& other, int otherId, double deltat, Vec3d* torque = NULL);
+	int NumContacts();
+	void Collect(const vector<int>& ids, vector<Record>& records); // ids sorted
+	void Restore(const vector<Record>& records);
+	~ContactTable();
+
+private:
+	static const unsigned long long EMPTY = ~0ULL;
+	unique_ptr< atomic<unsigned long long>[] > _keys, _spareKeys;
+	vector<Contact> _contacts, _spareContacts;
+	unsigned int _capacity, _spareCapacity; // powers of two
+	atomic<unsigned int> _used; // slots with a key in them, live or dead
+	mutex _overflowLock;
+	deque< pair<unsigned long long, Contact> > _overflow; // deque, so entries never move
+	unsigned int _step;
+
+	static unsigned long long Key(int id, int other) { return ((unsigned long long)(unsigned int)id << 32) | (unsigned int)other; }
+	static unsigned int Hash(unsigned long long key, unsigned int mask) { return (unsigned int)((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask; }
+	Contact* Find(int id, int other, bool& fresh);
+	void Rebuild(unsigned int capacity);
+};
+
+ContactTable::ContactTable(int capacity)
+{
+	model.enabled = true;
+	model.damping = 0.3;
+	model.friction = 0.5;
+	model.shearStiffness = 2.0 / 7.0;
+	_capacity = 16;
+	while (_capacity < (unsigned int)capacity) _capacity <<= 1;
+	_keys.reset(new atomic<unsigned long long>[_capacity]);
+	_contacts.resize(_capacity);
+	_spareCapacity = 0;
+	_step = 0;
+	Clear();
+}
+void ContactTable::Clear()
+{
+	for (unsigned int i = 0; i < _capacity; i++)
+		_keys[i] = EMPTY;
+	_used = 0;
+	_overflow.clear();
+}
+// Entry (id, other) for the step in progress, made if it isn't there.
+// Only the task working on sphere id may call this for it.
+ContactTable::Contact* ContactTable::Find(int id, int other, bool& fresh)
+{
+	unsigned long long key = Key(id, other);
+	unsigned int mask = _capacity - 1;
+	for (unsigned int h = Hash(key, mask), probes = 0; probes < _capacity; h = (h + 1) & mask, probes++)
+	{
+		unsigned long long k = _keys[h].load(memory_order_acquire);
+		if (k == key)
+		{
+			fresh = _contacts[h].stamp + 1 != _step;
+			return &_contacts[h];
+		}
+		if (k != EMPTY) continue;
+		// keep the table at most 7/8 full so probes stay short
+		if (_used >= _capacity - _capacity / 8) break;
+		if (!_keys[h].compare_exchange_strong(k, key)) continue; // someone else's key took it
+		_used++;
+		fresh = true;
+		return &_contacts[h];
+	}
+	// a key is only ever looked for once a step, so a new one can't be on the list already
+	lock_guard<mutex> lock(_overflowLock);
+	_overflow.push_back(make_pair(key, Contact()));
+	fresh = true;
+	return &_overflow.back().second;
+}
+// Moves the table on a step. Called between steps only: throws out the dead entries once
+// they fill half the table, and grows it if there are too many live ones.
+void ContactTable::BeginStep()
+{
+	_step++;
+	if (_used <= _capacity / 2 && _overflow.empty()) return;
+	unsigned int live = _overflow.size();
+	for (unsigned int i = 0; i < _capacity; i++)
+		if (_keys[i] != EMPTY && _contacts[i].stamp + 1 == _step) live++;
+	unsigned int capacity = _capacity;
+	while (capacity < 4 * live) capacity <<= 1;
+	Rebuild(capacity);
+}
+void ContactTable::Rebuild(unsigned int capacity)
+{
+	if (_spareCapacity < capacity)
+	{
+		_spareKeys.reset(new atomic<unsigned long long>[capacity]);
+		_spareContacts.resize(capacity);
+		_spareCapacity = capacity;
+	}
+	for (unsigned int i = 0; i < capacity; i++)
+		_spareKeys[i] = EMPTY;
+	unsigned int mask = capacity - 1, used = 0;
+	for (unsigned int i = 0; i < _capacity; i++)
+	{
+		unsigned long long key = _keys[i];
+		if (key == EMPTY || _contacts[i].stamp + 1 != _step) continue;
+		unsigned int h = Hash(key, mask);
+		while (_spareKeys[h] != EMPTY) h = (h + 1) & mask;
+		_spareKeys[h] = key;
+		_spareContacts[h] = _contacts[i];
+		used++;
+	}
+	for (unsigned int i = 0; i < _overflow.size(); i++)
+	{
+		unsigned int h = Hash(_overflow[i].first, mask);
+		while (_spareKeys[h] != EMPTY) h = (h + 1) & mask;
+		_spareKeys[h] = _overflow[i].first;
+		_spareContacts[h] = _overflow[i].second;
+		used++;
+	}
+	_overflow.clear();
+	_keys.swap(_spareKeys);
+	_contacts.swap(_spareContacts);
+	unsigned int old = _capacity;
+	_capacity = capacity;
+	_spareCapacity = old;
+	_used = used;
+}
+
+// Adds the force other puts on s. The spring-dashpot along the normal only ever pushes. The
+// tangential spring is carried over from the last step, turned into the current tangent plane
+// and stretched by the sliding velocity; past the Coulomb limit the contact slides and the
+// spring is cut back to the limit. Spheres don't spin here, so it's the centers' velocities
+// that slide. Everything is worked out from the lower id sphere and flipped for the other one,
+// so the pair sees exactly opposite forces. If torque is given, the torque about s's center is
+// added to it (only friction makes any). Returns how hard the pair pushes, or -1 if they
+// aren't touching.
+double ContactTable::Accumulate(sphere& s, int id, const sphere& other, int otherId, double deltat, Vec3d* torque)
+{
+	bool flip = otherId < id;
+	const sphere& a = flip ? other : s;
+	const sphere& b = flip ? s : other;
+	Vec3d N = a.p - b.p;
+	double len = length(N);
+	double dist = len - a.r - b.r;
+	if (dist >= 0.0 || len == 0.0) return -1.0;
+	N /= len;
+	double k = 0.5 * (a.K + b.K);
+
+	bool fresh;
+	Contact* contact = Find(id, otherId, fresh);
+	if (fresh)
+	{
+		contact->shear.set(0.0, 0.0, 0.0);
+		contact->damping = 2.0 * model.damping * sqrt(k * a.mass * b.mass / (a.mass + b.mass));
+	}
+	contact->stamp = _step;
+
+	Vec3d vRel = a.v - b.v;
+	double vN = dot(vRel, N);
+	Vec3d vT = vRel - N * vN;
+	double fN = -dist * k - contact->damping * vN;
+	if (fN < 0.0) fN = 0.0;
+
+	Vec3d shear = contact->shear - N * dot(contact->shear, N);
+	double before = length(contact->shear), after = length(shear);
+	if (after > 0.0) shear *= before / after;
+	shear += vT * deltat;
+	double kT = model.shearStiffness * k;
+	Vec3d fT = shear * -kT;
+	double limit = model.friction * fN, fTMag = length(fT);
+	if (fTMag > limit)
+	{
+		fT *= limit / fTMag;
+		shear = fT / -kT;
+	}
+	contact->shear = shear;
+
+	Vec3d force = N * fN + fT;
+	if (flip) force = -force;
+	s.f += force;
+	if (torque != NULL)
+	{
+		// the contact point is s.r in from s's center, towards other
+		Vec3d arm = flip ? N * s.r : N * -s.r, moment;
+		cross(moment, arm, force);
+		*torque += moment;
+	}
+	return length(force);
+}
+int ContactTable::NumContacts()
+{
+	int n = 0;
+	for (unsigned int i = 0; i < _capacity; i++)
+		if (_keys[i] != EMPTY && _contacts[i].stamp == _step) n++;
+	return n + _overflow.size();
+}
+// The live contacts of the spheres in ids, to go along with them to another process
+void ContactTable::Collect(const vector<int>& ids, vector<Record>& records)
+{
+	records.clear();
+	if (ids.empty()) return;
+	for (unsigned int i = 0; i < _capacity + _overflow.size(); i++)
+	{
+		unsigned long long key = i < _capacity ? (unsigned long long)_keys[i] : _overflow[i - _capacity].first;
+		const Contact& contact = i < _capacity ? _contacts[i] : _overflow[i - _capacity].second;
+		if (key == EMPTY || contact.stamp != _step) continue;
+		int id = (int)(key >> 32);
+		if (!binary_search(ids.begin(), ids.end(), id)) continue;
+		Record rec;
+		rec.id = id;
+		rec.other = (int)(unsigned int)key;
+		rec.stamp = contact.stamp;
+		for (int k = 0; k < 3; k++) rec.shear[k] = contact.shear[k];
+		rec.damping = contact.damping;
+		records.push_back(rec);
+	}
+}
+// Takes in contacts Collect()ed by another process. Between steps only.
+void ContactTable::Restore(const vector<Record>& records)
+{
+	for (unsigned int i = 0; i < records.size(); i++)
+	{
+		bool fresh;
+		Contact* contact = Find(records[i].id, records[i].other, fresh);
+		contact->shear.set(records[i].shear[0], records[i].shear[1], records[i].shear[2]);
+		contact->damping = records[i].damping;
+		contact->stamp = records[i].stamp;
+	}
+}
+ContactTable::~ContactTable()
+{
+}
+
+#endif _CONTACTTABLE_H_
@@ -0,0 +1,446 @@
+#ifndef _DOMAINDECOMPOSITION_H_
+#define _DOMAINDECOMPOSITION_H_
+#include <vector>
+#include <algorithm>
+#include <iostream>
+#include <math.h>
+#include <string.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/wait.h>
+#include <signal.h>
+#endif
+#include "objects.h"
+#include "Grid.h"
+#include "Transport.h"
+#include "ContactTable.h"
+using namespace std;
+
+// Splits the box into slabs along x and simulates each in its own process, to get past what
+// one process can hold. This process stays the master: it scatters the spheres, tells the
+// workers to step and collects the result for display.
+// Every step a worker sends the spheres within one contact distance of a face to the
+// neighbor across it (ghosts), builds its own grid over its spheres plus the ghosts, steps
+// its own spheres, and then hands any sphere whose center has crossed a face to the
+// neighbor. Contact forces are summed in sphere id order (see Grid::GatherNeighbors), so
+// the result is bit for bit what a single process gets in deterministic mode.
+// A ghost only goes one domain over, so no domain may be narrower than a contact distance:
+// Start() makes fewer domains if it would, and Scatter() goes back to one process if spheres
+// grow too big for the domains there are.
+// Spheres are identified by their index in the master's vector as of the last Scatter(), so
+// anything that changes the spheres on the master side has to be followed by a Scatter().
+// Each worker keeps the contact table for its own spheres, and a sphere's contacts move with
+// it when it changes domain.
+class DomainDecomposition
+{
+public:
+	//properties
+	int numDomains;
+	//members
+	DomainDecomposition();
+	bool Start(vector<sphere>& spheres, plane walls[6], double wall, int domains, Transport* transport);
+	bool Running() { return _transport != NULL; }
+	void Scatter(vector<sphere>& spheres, bool renumbered = false);
+	void Step(vector<sphere>& spheres, double deltat, const Vec3d& gravity, double drag, bool useEuler, plane walls[6], const ContactModel& contacts);
+	void Stop();
+	static int MostDomains(double wall, double maxRadius);
+	~DomainDecomposition();
+
+private:
+	enum { SCATTER, STEP, STOP };
+	struct Header
+	{
+		int type;
+		int useEuler;
+		int renumbered; // scatter: ids have changed, so the contact tables are no good
+		double deltat, gravity[3], drag, maxRadius;
+		double wallK[6]; // walls can be switched off (opened) while running
+		ContactModel contacts;
+	};
+	struct Record
+	{
+		int id;
+		int fixed, colliding;
+		double p[3], v[3], r, mass, K;
+		bool operator<(const Record& o) const { return id < o.id; }
+	};
+	Transport* _transport;
+	vector<int> _workers; // pids
+	double _wall, _maxRadius;
+	plane _walls[6];
+	vector<char> _msg;
+	// worker side
+	int _rank;
+	vector<Record> _owned; // sorted by id
+	vector<Record> _toLeft, _toRight, _fromLeft, _fromRight;
+	vector<Record> _all, _stay; // kept between steps so a step doesn't allocate
+	vector<int> _order;
+	vector<sphere> _local; // owned plus ghosts, in id order
+	vector<char> _isGhost;
+	vector<sphere*> _neighbors;
+	Grid* _grid;
+	ContactTable _contacts;
+	vector<int> _leftIds, _rightIds;
+	vector<ContactTable::Record> _contactsToLeft, _contactsToRight, _contactsFromLeft, _contactsFromRight;
+
+	int DomainOf(double x);
+	void Lose(int rank);
+	static void Pack(const sphere& s, int id, Record& rec);
+	static void Unpack(const Record& rec, sphere& s);
+	void Encode(const Header& header, const vector<Record>& records);
+	void Decode(Header& header, vector<Record>& records);
+	template <class R> bool SendRecords(int to, const vector<R>& records);
+	template <class R> bool ReceiveRecords(int from, vector<R>& records);
+	template <class R> bool Exchange(const vector<R>& toLeft, const vector<R>& toRight, vector<R>& fromLeft, vector<R>& fromRight);
+	void RunWorker(int rank);
+	bool WorkerStep(const Header& header);
+};
+
+DomainDecomposition::DomainDecomposition()
+{
+	numDomains = 0;
+	_transport = NULL;
+	_wall = _maxRadius = 0;
+	_rank = -1;
+	_grid = NULL;
+}
+int DomainDecomposition::DomainOf(double x)
+{
+	int d = (int)floor((x + _wall) * numDomains / (2 * _wall));
+	return d < 0 ? 0 : d >= numDomains ? numDomains - 1 : d;
+}
+void DomainDecomposition::Pack(const sphere& s, int id, Record& rec)
+{
+	rec.id = id;
+	rec.fixed = s.fixed;
+	rec.colliding = s.colliding;
+	for (int k = 0; k < 3; k++)
+	{
+		rec.p[k] = s.p[k];
+		rec.v[k] = s.v[k];
+	}
+	rec.r = s.r;
+	rec.mass = s.mass;
+	rec.K = s.K;
+}
+void DomainDecomposition::Unpack(const Record& rec, sphere& s)
+{
+	s.fixed = rec.fixed != 0;
+	s.colliding = rec.colliding != 0;
+	s.p.set(rec.p[0], rec.p[1], rec.p[2]);
+	s.v.set(rec.v[0], rec.v[1], rec.v[2]);
+	s.r = rec.r;
+	s.mass = rec.mass;
+	s.K = rec.K;
+}
+void DomainDecomposition::Encode(const Header& header, const vector<Record>& records)
+{
+	_msg.resize(sizeof(Header) + records.size() * sizeof(Record));
+	memcpy(&_msg[0], &header, sizeof(Header));
+	if (!records.empty()) memcpy(&_msg[sizeof(Header)], &records[0], records.size() * sizeof(Record));
+}
+void DomainDecomposition::Decode(Header& header, vector<Record>& records)
+{
+	memcpy(&header, &_msg[0], sizeof(Header));
+	records.resize((_msg.size() - sizeof(Header)) / sizeof(Record));
+	if (!records.empty()) memcpy(&records[0], &_msg[sizeof(Header)], records.size() * sizeof(Record));
+}
+template <class R>
+bool DomainDecomposition::SendRecords(int to, const vector<R>& records)
+{
+	_msg.resize(records.size() * sizeof(R));
+	if (!records.empty()) memcpy(&_msg[0], &records[0], _msg.size());
+	return _transport->Send(to, _msg);
+}
+template <class R>
+bool DomainDecomposition::ReceiveRecords(int from, vector<R>& records)
+{
+	if (!_transport->Receive(from, _msg)) return false;
+	records.resize(_msg.size() / sizeof(R));
+	if (!records.empty()) memcpy(&records[0], &_msg[0], _msg.size());
+	return true;
+}
+
+// Swaps toLeft/toRight for fromLeft/fromRight with the neighbors. Even ranks talk to
+// the right first and odd ranks to the left first, so every pair is talking to each other at
+// the same time; within a pair the lower rank sends first. Nobody waits on a full channel.
+template <class R>
+bool DomainDecomposition::Exchange(const vector<R>& toLeft, const vector<R>& toRight, vector<R>& fromLeft, vector<R>& fromRight)
+{
+	fromLeft.clear();
+	fromRight.clear();
+	for (int phase = 0; phase < 2; phase++)
+	{
+		bool right = (phase == 0) == (_rank % 2 == 0);
+		int peer = right ? _rank + 1 : _rank - 1;
+		if (peer < 0 || peer >= numDomains) continue;
+		const vector<R>& out = right ? toRight : toLeft;
+		vector<R>& in = right ? fromRight : fromLeft;
+		if (_rank < peer)
+		{
+			if (!SendRecords(peer, out) || !ReceiveRecords(peer, in)) return false;
+		}
+		else
+		{
+			if (!ReceiveRecords(peer, in) || !SendRecords(peer, out)) return false;
+		}
+	}
+	return true;
+}
+
+bool DomainDecomposition::Start(vector<sphere>& spheres, plane walls[6], double wall, int domains, Transport* transport)
+{
+#ifdef _WIN32
+	cout << "Domain decomposition needs fork(), running in one process" << endl;
+	return false;
+#else
+	double maxRadius = 0;
+	for (unsigned int i = 0; i < spheres.size(); i++)
+		if (spheres[i].r > maxRadius) maxRadius = spheres[i].r;
+	if (domains > MostDomains(wall, maxRadius))
+	{
+		domains = MostDomains(wall, maxRadius);
+		cout << "Domains can't be narrower than a contact distance, using " << domains << endl;
+		if (domains < 2) return false;
+	}
+	numDomains = domains;
+	_wall = wall;
+	for (int i = 0; i < 6; i++) _walls[i] = walls[i];
+	_transport = transport;
+	for (int r = 0; r < domains; r++)
+	{
+		int pid = fork();
+		if (pid < 0) { perror("fork"); Stop(); return false; }
+		if (pid == 0)
+		{
+			_transport->Attach(r);
+			RunWorker(r); // never returns
+		}
+		_workers.push_back(pid);
+		_transport->Watch(pid);
+	}
+	_transport->Attach(domains);
+	Scatter(spheres);
+	return Running();
+#endif
+}
+// Hands the spheres out to the domains again. renumbered says spheres have been removed, so
+// the ids no longer mean what they did.
+void DomainDecomposition::Scatter(vector<sphere>& spheres, bool renumbered)
+{
+	if (!Running()) return;
+	_maxRadius = 0;
+	for (unsigned int i = 0; i < spheres.size(); i++)
+		if (spheres[i].r > _maxRadius) _maxRadius = spheres[i].r;
+	if (numDomains > MostDomains(_wall, _maxRadius))
+	{
+		cout << "Spheres too big for " << numDomains << " domains, carrying on in one process" << endl;
+		Stop();
+		return;
+	}
+	vector< vector<Record> > parts(numDomains);
+	for (unsigned int i = 0; i < spheres.size(); i++)
+	{
+		Record rec;
+		Pack(spheres[i], i, rec);
+		parts[DomainOf(rec.p[0])].push_back(rec);
+	}
+	Header header;
+	memset(&header, 0, sizeof(header));
+	header.type = SCATTER;
+	header.renumbered = renumbered;
+	for (int r = 0; r < numDomains; r++)
+	{
+		Encode(header, parts[r]);
+		if (!_transport->Send(r, _msg)) { Lose(r); return; }
+	}
+}
+void DomainDecomposition::Step(vector<sphere>& spheres, double deltat, const Vec3d& gravity, double drag, bool useEuler, plane walls[6], const ContactModel& contacts)
+{
+	if (!Running()) return;
+	Header header;
+	memset(&header, 0, sizeof(header));
+	header.type = STEP;
+	header.useEuler = useEuler;
+	header.deltat = deltat;
+	for (int k = 0; k < 3; k++) header.gravity[k] = gravity[k];
+	header.drag = drag;
+	header.maxRadius = _maxRadius;
+	for (int i = 0; i < 6; i++) header.wallK[i] = walls[i].K;
+	header.contacts = contacts;
+	vector<Record>& records = _fromLeft; // only the workers use it otherwise
+	records.clear();
+	Encode(header, records);
+	for (int r = 0; r < numDomains; r++)
+		if (!_transport->Send(r, _msg)) { Lose(r); return; }
+	for (int r = 0; r < numDomains; r++)
+	{
+		if (!ReceiveRecords(r, records)) { Lose(r); return; }
+		for (unsigned int i = 0; i < records.size(); i++)
+			if (records[i].id < (int)spheres.size()) Unpack(records[i], spheres[records[i].id]);
+	}
+}
+void DomainDecomposition::Stop()
+{
+#ifndef _WIN32
+	if (!Running()) return;
+	Header header;
+	memset(&header, 0, sizeof(header));
+	header.type = STOP;
+	vector<Record> none;
+	Encode(header, none);
+	for (int r = 0; r < numDomains; r++)
+		_transport->Send(r, _msg);
+	for (unsigned int i = 0; i < _workers.size(); i++)
+		waitpid(_workers[i], NULL, 0);
+	_workers.clear();
+	_transport = NULL;
+#endif
+}
+
+// The most domains the box can be cut into, each at least a contact distance wide (2.01 radii,
+// as in WorkerStep)
+int DomainDecomposition::MostDomains(double wall, double maxRadius)
+{
+	if (maxRadius <= 0) return 1 << 20;
+	return max(1, (int)floor(2 * wall / (2.01 * maxRadius)));
+}
+// A worker died or stopped answering. The others may be waiting on it, so rather than ask them
+// to stop they are killed, and this process carries on alone.
+void DomainDecomposition::Lose(int rank)
+{
+#ifndef _WIN32
+	cout << "Lost domain " << rank << ", carrying on in one process" << endl;
+	for (unsigned int i = 0; i < _workers.size(); i++)
+	{
+		kill(_workers[i], SIGKILL);
+		waitpid(_workers[i], NULL, 0);
+	}
+	_workers.clear();
+	_transport = NULL;
+#endif
+}
+void DomainDecomposition::RunWorker(int rank)
+{
+#ifndef _WIN32
+	_rank = rank;
+	_grid = new Grid((float)_wall);
+	int master = numDomains;
+	Header header;
+	vector<Record> records;
+	while (_transport->Receive(master, _msg))
+	{
+		Decode(header, records);
+		if (header.type == STOP) break;
+		if (header.type == SCATTER)
+		{
+			_owned.swap(records);
+			sort(_owned.begin(), _owned.end());
+			if (header.renumbered) _contacts.Clear();
+			continue;
+		}
+		if (!WorkerStep(header) || !SendRecords(master, _owned)) break;
+	}
+	_exit(0);
+#endif
+}
+bool DomainDecomposition::WorkerStep(const Header& header)
+{
+	// ghosts: anything close enough to a face to touch a sphere on the other side
+	double reach = 2.01 * header.maxRadius;
+	double width = 2 * _wall / numDomains;
+	double lo = -_wall + _rank * width, hi = lo + width;
+	_toLeft.clear();
+	_toRight.clear();
+	for (unsigned int i = 0; i < _owned.size(); i++)
+	{
+		if (_owned[i].p[0] < lo + reach) _toLeft.push_back(_owned[i]);
+		if (_owned[i].p[0] >= hi - reach) _toRight.push_back(_owned[i]);
+	}
+	if (!Exchange(_toLeft, _toRight, _fromLeft, _fromRight)) return false;
+
+	// owned and ghost spheres merged by id, so neighbor lists come out in id order
+	vector<Record>& all = _all;
+	all.assign(_owned.begin(), _owned.end());
+	all.insert(all.end(), _fromLeft.begin(), _fromLeft.end());
+	all.insert(all.end(), _fromRight.begin(), _fromRight.end());
+	vector<int>& order = _order;
+	order.resize(all.size());
+	for (unsigned int i = 0; i < order.size(); i++) order[i] = i;
+	sort(order.begin(), order.end(), [&](int a, int b) { return all[a].id < all[b].id; });
+	_local.resize(all.size());
+	_isGhost.resize(all.size());
+	for (unsigned int i = 0; i < order.size(); i++)
+	{
+		Unpack(all[order[i]], _local[i]);
+		_isGhost[i] = order[i] >= (int)_owned.size();
+	}
+
+	_grid->ConstructGrid(_local);
+	Vec3d gravity(header.gravity[0], header.gravity[1], header.gravity[2]);
+	for (int w = 0; w < 6; w++) _walls[w].K = header.wallK[w];
+	const ContactModel& model = header.contacts;
+	_contacts.model = model;
+	_contacts.BeginStep();
+	for (unsigned int i = 0; i < _local.size(); i++)
+	{
+		if (_isGhost[i]) continue;
+		_local[i].colliding = false;
+		_grid->GatherNeighbors(i, _local, _neighbors);
+		if (!model.enabled)
+		{
+			_local[i].computeForcesWithNeighbors(gravity, header.drag, _walls, _neighbors);
+			continue;
+		}
+		_local[i].computeExternalForces(gravity, header.drag, _walls, model.damping);
+		for (unsigned int k = 0; k < _neighbors.size(); k++)
+		{
+			_contacts.Accumulate(_local[i], all[order[i]].id, *_neighbors[k], all[order[_neighbors[k] - &_local[0]]].id, header.deltat);
+			if (_neighbors[k]->fixed) _local[i].colliding = true;
+		}
+	}
+
+	// integrate, then hand on whatever crossed a face
+	vector<Record>& stay = _stay;
+	stay.clear();
+	_toLeft.clear();
+	_toRight.clear();
+	for (unsigned int i = 0; i < _local.size(); i++)
+	{
+		if (_isGhost[i]) continue;
+		if (header.useEuler) _local[i].Euler(header.deltat);
+		else _local[i].EulerCromer(header.deltat);
+		Record rec;
+		Pack(_local[i], all[order[i]].id, rec);
+		int d = DomainOf(rec.p[0]);
+		if (d < _rank) _toLeft.push_back(rec);
+		else if (d > _rank) _toRight.push_back(rec);
+		else stay.push_back(rec);
+	}
+	if (!Exchange(_toLeft, _toRight, _fromLeft, _fromRight)) return false;
+	if (model.enabled)
+	{
+		// the contacts of the spheres that left go with them
+		_leftIds.clear();
+		_rightIds.clear();
+		for (unsigned int i = 0; i < _toLeft.size(); i++) _leftIds.push_back(_toLeft[i].id);
+		for (unsigned int i = 0; i < _toRight.size(); i++) _rightIds.push_back(_toRight[i].id);
+		_contacts.Collect(_leftIds, _contactsToLeft);
+		_contacts.Collect(_rightIds, _contactsToRight);
+		if (!Exchange(_contactsToLeft, _contactsToRight, _contactsFromLeft, _contactsFromRight)) return false;
+		_contacts.Restore(_contactsFromLeft);
+		_contacts.Restore(_contactsFromRight);
+	}
+	_owned.swap(stay);
+	_owned.insert(_owned.end(), _fromLeft.begin(), _fromLeft.end());
+	_owned.insert(_owned.end(), _fromRight.begin(), _fromRight.end());
+	sort(_owned.begin(), _owned.end());
+	return true;
+}
+DomainDecomposition::~DomainDecomposition()
+{
+	Stop();
+	delete _grid;
+}
+
+#endif _DOMAINDECOMPOSITION_H_
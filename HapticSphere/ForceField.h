@@ -0,0 +1,189 @@
+#ifndef _FORCEFIELD_H_
+#define _FORCEFIELD_H_
+#include <vector>
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "objects.h"
+#include "Grid.h"
+using namespace std;
+
+// A body force worked out from where a sphere is and how fast it is going. Everything but WIND
+// is an acceleration, so heavy and light spheres are pulled alike:
+//     ATTRACTOR  strength towards center (away, if negative), however far off
+//     WELL       strength / d^2 towards center, softened by the sphere's radius
+//     VORTEX     strength * d turning about axis through center, d from the axis
+//     WIND       strength * (axis - v), drag towards moving along with the wind axis
+// A field with a radius only reaches the spheres whose centers are within it.
+struct ForceField
+{
+	enum Kind { ATTRACTOR, WELL, VORTEX, WIND };
+	int kind;
+	Vec3d center, axis;
+	double strength;
+	double radius; // 0 for everywhere
+};
+
+// The force fields, all added up for a list of spheres at a time: the fields go one after the
+// other, each over the whole list in a loop of its own, so what kind of field it is is decided
+// once per list rather than once per sphere. The step does its own spheres this way in the same
+// tasks that then find their contacts. Fields with a radius are culled against the grid's slabs
+// first, so a list of spheres from a slab the field can't reach skips it altogether.
+class ForceFields
+{
+public:
+	//properties
+	bool enabled;
+	vector<ForceField> fields;
+	//members
+	ForceFields();
+	bool Active() { return enabled && !fields.empty(); }
+	bool Load(const char* file);
+	void Prepare(Grid* grid); // between steps, with the grid the step uses (or NULL)
+	void Apply(vector<sphere>& spheres, const int* indices, int first, int last, int slab, Vec3d* force);
+	~ForceFields();
+
+private:
+	vector<int> _slabLo, _slabHi; // per field, the slabs its region touches
+};
+
+ForceFields::ForceFields()
+{
+	enabled = true;
+}
+// One field a line:
+//     attractor x y z strength [radius]
+//     well x y z strength [radius]
+//     vortex x y z ax ay az strength [radius]
+//     wind vx vy vz strength [x y z radius]
+bool ForceFields::Load(const char* file)
+{
+	FILE* in = fopen(file, "r");
+	if (in == NULL) return false;
+	char line[512], kind[16];
+	fields.clear();
+	while (fgets(line, sizeof(line), in) != NULL)
+	{
+		double c[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+		if (sscanf(line, "%15s", kind) != 1 || kind[0] == '#') continue;
+		int read = sscanf(line, "%*s %lf %lf %lf %lf %lf %lf %lf %lf", &c[0], &c[1], &c[2], &c[3], &c[4], &c[5], &c[6], &c[7]);
+		ForceField f;
+		f.center.set(c[0], c[1], c[2]);
+		f.axis.set(0.0, 0.0, 0.0);
+		f.strength = c[3];
+		f.radius = c[4];
+		if ((strcmp(kind, "attractor") == 0 || strcmp(kind, "well") == 0) && read >= 4)
+			f.kind = kind[0] == 'a' ? ForceField::ATTRACTOR : ForceField::WELL;
+		else if (strcmp(kind, "vortex") == 0 && read >= 7 && c[3] * c[3] + c[4] * c[4] + c[5] * c[5] > 0.0)
+		{
+			f.kind = ForceField::VORTEX;
+			f.axis.set(c[3], c[4], c[5]);
+			normalize(f.axis);
+			f.strength = c[6];
+			f.radius = c[7];
+		}
+		else if (strcmp(kind, "wind") == 0 && read >= 4)
+		{
+			f.kind = ForceField::WIND;
+			f.axis.set(c[0], c[1], c[2]);
+			f.center.set(c[4], c[5], c[6]);
+			f.radius = c[7];
+		}
+		else
+		{
+			cout << "Skipped field line: " << line;
+			continue;
+		}
+		fields.push_back(f);
+	}
+	fclose(in);
+	return !fields.empty();
+}
+void ForceFields::Prepare(Grid* grid)
+{
+	_slabLo.resize(fields.size());
+	_slabHi.resize(fields.size());
+	for (unsigned int k = 0; k < fields.size(); k++)
+	{
+		const ForceField& f = fields[k];
+		_slabLo[k] = 0;
+		_slabHi[k] = Grid::N_CELLS - 1;
+		if (grid == NULL || f.radius <= 0.0) continue;
+		// slabs are homes by center, and only centers within the radius count
+		Vec3d reach(f.radius, f.radius, f.radius);
+		int lo[3], hi[3];
+		grid->CellsOverlapping(f.center - reach, f.center + reach, lo, hi);
+		_slabLo[k] = lo[2] < 0 ? 0 : lo[2] >= Grid::N_CELLS ? Grid::N_CELLS - 1 : lo[2];
+		_slabHi[k] = hi[2] < 0 ? 0 : hi[2] >= Grid::N_CELLS ? Grid::N_CELLS - 1 : hi[2];
+	}
+}
+// Sets force[i] to the fields' force on each sphere i in indices[first, last) (or in
+// [first, last) itself if indices is NULL), all of them homed in slab (or -1 if not known)
+void ForceFields::Apply(vector<sphere>& spheres, const int* indices, int first, int last, int slab, Vec3d* force)
+{
+	for (int n = first; n < last; n++)
+		force[indices == NULL ? n : indices[n]].set(0.0, 0.0, 0.0);
+	for (unsigned int k = 0; k < fields.size(); k++)
+	{
+		const ForceField& f = fields[k];
+		if (slab >= 0 && k < _slabLo.size() && (slab < _slabLo[k] || slab > _slabHi[k])) continue;
+		double r2 = f.radius > 0.0 ? f.radius * f.radius : -1.0;
+		switch (f.kind)
+		{
+		case ForceField::ATTRACTOR:
+			for (int n = first; n < last; n++)
+			{
+				int i = indices == NULL ? n : indices[n];
+				const sphere& s = spheres[i];
+				Vec3d d = f.center - s.p;
+				double dd = dot(d, d);
+				if (dd == 0.0 || (r2 >= 0.0 && dd >= r2)) continue;
+				force[i] += d * (f.strength * s.mass / sqrt(dd));
+			}
+			break;
+		case ForceField::WELL:
+			for (int n = first; n < last; n++)
+			{
+				int i = indices == NULL ? n : indices[n];
+				const sphere& s = spheres[i];
+				Vec3d d = f.center - s.p;
+				double dd = dot(d, d);
+				if (r2 >= 0.0 && dd >= r2) continue;
+				double soft = dd + s.r * s.r;
+				force[i] += d * (f.strength * s.mass / (soft * sqrt(soft)));
+			}
+			break;
+		case ForceField::VORTEX:
+			for (int n = first; n < last; n++)
+			{
+				int i = indices == NULL ? n : indices[n];
+				const sphere& s = spheres[i];
+				Vec3d d = s.p - f.center;
+				if (r2 >= 0.0 && dot(d, d) >= r2) continue;
+				Vec3d turn;
+				cross(turn, f.axis, d); // the part along the axis drops out
+				force[i] += turn * (f.strength * s.mass);
+			}
+			break;
+		case ForceField::WIND:
+			for (int n = first; n < last; n++)
+			{
+				int i = indices == NULL ? n : indices[n];
+				const sphere& s = spheres[i];
+				if (r2 >= 0.0)
+				{
+					Vec3d d = s.p - f.center;
+					if (dot(d, d) >= r2) continue;
+				}
+				force[i] += (f.axis - s.v) * f.strength;
+			}
+			break;
+		}
+	}
+}
+ForceFields::~ForceFields()
+{
+}
+
+#endif _FORCEFIELD_H_
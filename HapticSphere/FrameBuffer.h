@@ -0,0 +1,143 @@
+#ifndef _FRAMEBUFFER_H_
+#define _FRAMEBUFFER_H_
+#include <vector>
+#include <atomic>
+#include <math.h>
+#include "objects.h"
+using namespace std;
+
+// Everything the display needs from one simulation step, copied out so drawing never
+// touches the live sphere vector. Stored as flat arrays so it can be streamed to GL as is.
+// Spheres are stored grouped by the bin (a coarse cubic grid, normally the Grid's cells) their
+// center falls in, so the display can cull whole bins. Only the bins with spheres in them are
+// listed, with binStart giving each one's range, so however fine the bins are, nothing has to
+// walk the empty ones. Spheres outside the binned volume are clamped into the border bins.
+struct FrameState
+{
+	enum { FIXED = 1, COLLIDING = 2 };
+	vector<float> posRadius; // x, y, z, r per sphere
+	vector<unsigned char> flags;
+	vector<unsigned char> color; // r, g, b, a per sphere
+	vector<int> bins; // (z * binCells + y) * binCells + x of each bin with spheres, in the order first found
+	vector<int> binStart; // bins.size() + 1 offsets into the sphere arrays
+	int numSpheres;
+	float maxRadius;
+	float binOrigin, binWidth;
+	int binCells;
+	unsigned int step; // simulation step this frame was taken at
+	// for the overlay, so the display never reads what the step is still writing
+	int contacts, contactBegins, contactEnds;
+	char broadphase[200]; // GridStats::Summary of the step
+
+	FrameState() : numSpheres(0), maxRadius(0), binOrigin(-1), binWidth(2), binCells(1), step(0),
+		contacts(0), contactBegins(0), contactEnds(0) { broadphase[0] = 0; }
+	void SetBinning(float origin, float width, int cells)
+	{
+		binOrigin = origin;
+		binWidth = width;
+		binCells = cells;
+	}
+	int BinCoord(double v)
+	{
+		int c = (int)floor((v - binOrigin) / binWidth);
+		return c < 0 ? 0 : c >= binCells ? binCells - 1 : c;
+	}
+	void Capture(vector<sphere>& spheres, unsigned int stepCount)
+	{
+		numSpheres = spheres.size();
+		step = stepCount;
+		maxRadius = 0;
+		static const float white[3] = { 1, 1, 1 };
+		posRadius.resize(4 * numSpheres);
+		flags.resize(numSpheres);
+		color.resize(4 * numSpheres);
+
+		// counting sort by bin, over only the bins that turn up. The slot of every bin is kept
+		// from frame to frame, so only the ones used last time need clearing.
+		int numCells = binCells * binCells * binCells;
+		if ((int)_binSlot.size() != numCells) _binSlot.assign(numCells, -1);
+		else for (unsigned int a = 0; a < bins.size(); a++) _binSlot[bins[a]] = -1;
+		bins.clear();
+		binStart.assign(1, 0);
+		_binOf.resize(numSpheres);
+		for (int i = 0; i < numSpheres; i++)
+		{
+			int b = (BinCoord(spheres[i].p[2]) * binCells + BinCoord(spheres[i].p[1])) * binCells + BinCoord(spheres[i].p[0]);
+			if (_binSlot[b] < 0)
+			{
+				_binSlot[b] = bins.size();
+				bins.push_back(b);
+				binStart.push_back(0);
+			}
+			_binOf[i] = _binSlot[b];
+			binStart[_binOf[i] + 1]++;
+		}
+		for (unsigned int a = 0; a < bins.size(); a++)
+			binStart[a + 1] += binStart[a];
+		_cursor.assign(binStart.begin(), binStart.end() - 1);
+
+		for (int n = 0; n < numSpheres; n++)
+		{
+			sphere& s = spheres[n];
+			int i = _cursor[_binOf[n]]++;
+			if (s.r > maxRadius) maxRadius = (float)s.r;
+			posRadius[4 * i + 0] = (float)s.p[0];
+			posRadius[4 * i + 1] = (float)s.p[1];
+			posRadius[4 * i + 2] = (float)s.p[2];
+			posRadius[4 * i + 3] = (float)s.r;
+			flags[i] = (s.fixed ? FIXED : 0) | (s.colliding ? COLLIDING : 0);
+			const float* c = s.fixed ? s._fixedColor : s.colliding ? s._collisionColor : white;
+			for (int k = 0; k < 3; k++)
+				color[4 * i + k] = (unsigned char)(255.0f * c[k]);
+			color[4 * i + 3] = 255;
+			s.colliding = false; // collision marks last one frame, like they did when draw() cleared them
+		}
+	}
+
+private:
+	vector<int> _binOf, _cursor; // _binOf is the slot in bins
+	vector<int> _binSlot; // per bin, -1 if it has no spheres
+};
+
+// Lock-free triple buffer between one writer thread and one reader thread.
+// The writer fills Back() and publishes it; the reader picks up the newest published value
+// with Acquire() and keeps reading Front() until the next one. Neither side ever waits, and
+// the reader never sees a value that is still being written.
+template <class T>
+class TripleExchange
+{
+public:
+	TripleExchange() : _back(0), _ready(1), _front(2) {}
+	T& Back() { return _slots[_back]; }
+	const T& Front() const { return _slots[_front]; }
+	void Publish()
+	{
+		_back = _ready.exchange(_back | FRESH) & INDEX;
+	}
+	// Returns true if a newer value was swapped in
+	bool Acquire()
+	{
+		if (!(_ready.load() & FRESH)) return false;
+		_front = _ready.exchange(_front) & INDEX;
+		return true;
+	}
+
+protected:
+	enum { INDEX = 3, FRESH = 4 };
+	T _slots[3];
+	int _back;
+	atomic<int> _ready;
+	int _front;
+};
+
+// Finished frames from physics (writer) to the display (reader)
+class TripleBuffer : public TripleExchange<FrameState>
+{
+public:
+	void SetBinning(float origin, float width, int cells)
+	{
+		for (int i = 0; i < 3; i++) _slots[i].SetBinning(origin, width, cells);
+	}
+};
+
+#endif _FRAMEBUFFER_H_
@@ -0,0 +1,207 @@
+#ifndef _GLEXT_H_
+#define _GLEXT_H_
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <GL/glut.h>
+#ifndef _WIN32
+#include <GL/glx.h>
+#endif
+
+// The opengl32.lib / libGL we link against only exports GL 1.1, so everything newer
+// (buffers, shaders, instancing, sync) is looked up at runtime once the window exists.
+// Call Load() after glutCreateWindow and check the Has* flags before using a feature.
+
+#ifndef GL_ARRAY_BUFFER
+#define GL_ARRAY_BUFFER 0x8892
+#define GL_ELEMENT_ARRAY_BUFFER 0x8893
+#define GL_STATIC_DRAW 0x88E4
+#define GL_STREAM_DRAW 0x88E0
+#define GL_DYNAMIC_DRAW 0x88E8
+#endif
+#ifndef GL_FRAGMENT_SHADER
+#define GL_FRAGMENT_SHADER 0x8B30
+#define GL_VERTEX_SHADER 0x8B31
+#define GL_COMPILE_STATUS 0x8B81
+#define GL_LINK_STATUS 0x8B82
+#define GL_INFO_LOG_LENGTH 0x8B84
+#endif
+#ifndef GL_MAP_WRITE_BIT
+#define GL_MAP_WRITE_BIT 0x0002
+#endif
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+#ifndef GL_SYNC_GPU_COMMANDS_COMPLETE
+#define GL_SYNC_GPU_COMMANDS_COMPLETE 0x9117
+#define GL_SYNC_FLUSH_COMMANDS_BIT 0x00000001
+#define GL_TIMEOUT_EXPIRED 0x911B
+#define GL_WAIT_FAILED 0x911D
+#endif
+#ifndef GL_VERTEX_PROGRAM_POINT_SIZE
+#define GL_VERTEX_PROGRAM_POINT_SIZE 0x8642
+#endif
+#ifndef GL_POINT_SPRITE
+#define GL_POINT_SPRITE 0x8861
+#endif
+
+#ifdef _WIN32
+#define GLEXT_CALL __stdcall
+#else
+#define GLEXT_CALL
+#endif
+
+typedef ptrdiff_t GLsizeiptrExt;
+typedef ptrdiff_t GLintptrExt;
+typedef void* GLsyncExt;
+typedef unsigned long long GLuint64Ext;
+
+struct GLExtensions
+{
+	typedef void (GLEXT_CALL *GenBuffersFn)(GLsizei, GLuint*);
+	typedef void (GLEXT_CALL *DeleteBuffersFn)(GLsizei, const GLuint*);
+	typedef void (GLEXT_CALL *BindBufferFn)(GLenum, GLuint);
+	typedef void (GLEXT_CALL *BufferDataFn)(GLenum, GLsizeiptrExt, const void*, GLenum);
+	typedef void (GLEXT_CALL *BufferSubDataFn)(GLenum, GLintptrExt, GLsizeiptrExt, const void*);
+	typedef void (GLEXT_CALL *BufferStorageFn)(GLenum, GLsizeiptrExt, const void*, GLbitfield);
+	typedef void* (GLEXT_CALL *MapBufferRangeFn)(GLenum, GLintptrExt, GLsizeiptrExt, GLbitfield);
+	typedef GLsyncExt (GLEXT_CALL *FenceSyncFn)(GLenum, GLbitfield);
+	typedef GLenum (GLEXT_CALL *ClientWaitSyncFn)(GLsyncExt, GLbitfield, GLuint64Ext);
+	typedef void (GLEXT_CALL *DeleteSyncFn)(GLsyncExt);
+	typedef GLuint (GLEXT_CALL *CreateShaderFn)(GLenum);
+	typedef void (GLEXT_CALL *ShaderSourceFn)(GLuint, GLsizei, const char* const*, const GLint*);
+	typedef void (GLEXT_CALL *CompileShaderFn)(GLuint);
+	typedef void (GLEXT_CALL *GetShaderivFn)(GLuint, GLenum, GLint*);
+	typedef void (GLEXT_CALL *GetShaderInfoLogFn)(GLuint, GLsizei, GLsizei*, char*);
+	typedef GLuint (GLEXT_CALL *CreateProgramFn)();
+	typedef void (GLEXT_CALL *AttachShaderFn)(GLuint, GLuint);
+	typedef void (GLEXT_CALL *BindAttribLocationFn)(GLuint, GLuint, const char*);
+	typedef void (GLEXT_CALL *LinkProgramFn)(GLuint);
+	typedef void (GLEXT_CALL *GetProgramivFn)(GLuint, GLenum, GLint*);
+	typedef void (GLEXT_CALL *GetProgramInfoLogFn)(GLuint, GLsizei, GLsizei*, char*);
+	typedef void (GLEXT_CALL *UseProgramFn)(GLuint);
+	typedef GLint (GLEXT_CALL *GetUniformLocationFn)(GLuint, const char*);
+	typedef void (GLEXT_CALL *Uniform1fFn)(GLint, GLfloat);
+	typedef void (GLEXT_CALL *EnableVertexAttribArrayFn)(GLuint);
+	typedef void (GLEXT_CALL *DisableVertexAttribArrayFn)(GLuint);
+	typedef void (GLEXT_CALL *VertexAttribPointerFn)(GLuint, GLint, GLenum, GLboolean, GLsizei, const void*);
+	typedef void (GLEXT_CALL *VertexAttribDivisorFn)(GLuint, GLuint);
+	typedef void (GLEXT_CALL *DrawElementsInstancedFn)(GLenum, GLsizei, GLenum, const void*, GLsizei);
+
+	GenBuffersFn GenBuffers;
+	DeleteBuffersFn DeleteBuffers;
+	BindBufferFn BindBuffer;
+	BufferDataFn BufferData;
+	BufferSubDataFn BufferSubData;
+	BufferStorageFn BufferStorage;
+	MapBufferRangeFn MapBufferRange;
+	FenceSyncFn FenceSync;
+	ClientWaitSyncFn ClientWaitSync;
+	DeleteSyncFn DeleteSync;
+	CreateShaderFn CreateShader;
+	ShaderSourceFn ShaderSource;
+	CompileShaderFn CompileShader;
+	GetShaderivFn GetShaderiv;
+	GetShaderInfoLogFn GetShaderInfoLog;
+	CreateProgramFn CreateProgram;
+	AttachShaderFn AttachShader;
+	BindAttribLocationFn BindAttribLocation;
+	LinkProgramFn LinkProgram;
+	GetProgramivFn GetProgramiv;
+	GetProgramInfoLogFn GetProgramInfoLog;
+	UseProgramFn UseProgram;
+	GetUniformLocationFn GetUniformLocation;
+	Uniform1fFn Uniform1f;
+	EnableVertexAttribArrayFn EnableVertexAttribArray;
+	DisableVertexAttribArrayFn DisableVertexAttribArray;
+	VertexAttribPointerFn VertexAttribPointer;
+	VertexAttribDivisorFn VertexAttribDivisor;
+	DrawElementsInstancedFn DrawElementsInstanced;
+
+	bool HasBuffers;   // GL 1.5
+	bool HasShaders;   // GL 2.0
+	bool HasInstancing; // GL 3.3 or ARB_instanced_arrays + ARB_draw_instanced
+	bool HasPersistentMap; // GL 4.4 or ARB_buffer_storage (+ sync)
+
+	GLExtensions()
+	{
+		memset(this, 0, sizeof(*this));
+	}
+
+	static void* Proc(const char* name)
+	{
+#ifdef _WIN32
+		return (void*)wglGetProcAddress(name);
+#else
+		return (void*)glXGetProcAddressARB((const GLubyte*)name);
+#endif
+	}
+	static bool HasExtension(const char* name)
+	{
+		const char* all = (const char*)glGetString(GL_EXTENSIONS);
+		if (all == NULL) return false;
+		size_t len = strlen(name);
+		for (const char* p = strstr(all, name); p != NULL; p = strstr(p + len, name))
+			if ((p == all || p[-1] == ' ') && (p[len] == ' ' || p[len] == '\0'))
+				return true;
+		return false;
+	}
+
+	void Load()
+	{
+		int major = 1, minor = 0;
+		const char* version = (const char*)glGetString(GL_VERSION);
+		if (version != NULL)
+		{
+			major = atoi(version);
+			const char* dot = strchr(version, '.');
+			if (dot != NULL) minor = atoi(dot + 1);
+		}
+		int v = major * 10 + minor;
+
+		GenBuffers = (GenBuffersFn)Proc("glGenBuffers");
+		DeleteBuffers = (DeleteBuffersFn)Proc("glDeleteBuffers");
+		BindBuffer = (BindBufferFn)Proc("glBindBuffer");
+		BufferData = (BufferDataFn)Proc("glBufferData");
+		BufferSubData = (BufferSubDataFn)Proc("glBufferSubData");
+		HasBuffers = v >= 15 && GenBuffers && DeleteBuffers && BindBuffer && BufferData && BufferSubData;
+
+		CreateShader = (CreateShaderFn)Proc("glCreateShader");
+		ShaderSource = (ShaderSourceFn)Proc("glShaderSource");
+		CompileShader = (CompileShaderFn)Proc("glCompileShader");
+		GetShaderiv = (GetShaderivFn)Proc("glGetShaderiv");
+		GetShaderInfoLog = (GetShaderInfoLogFn)Proc("glGetShaderInfoLog");
+		CreateProgram = (CreateProgramFn)Proc("glCreateProgram");
+		AttachShader = (AttachShaderFn)Proc("glAttachShader");
+		BindAttribLocation = (BindAttribLocationFn)Proc("glBindAttribLocation");
+		LinkProgram = (LinkProgramFn)Proc("glLinkProgram");
+		GetProgramiv = (GetProgramivFn)Proc("glGetProgramiv");
+		GetProgramInfoLog = (GetProgramInfoLogFn)Proc("glGetProgramInfoLog");
+		UseProgram = (UseProgramFn)Proc("glUseProgram");
+		GetUniformLocation = (GetUniformLocationFn)Proc("glGetUniformLocation");
+		Uniform1f = (Uniform1fFn)Proc("glUniform1f");
+		EnableVertexAttribArray = (EnableVertexAttribArrayFn)Proc("glEnableVertexAttribArray");
+		DisableVertexAttribArray = (DisableVertexAttribArrayFn)Proc("glDisableVertexAttribArray");
+		VertexAttribPointer = (VertexAttribPointerFn)Proc("glVertexAttribPointer");
+		HasShaders = HasBuffers && v >= 20 && CreateShader && ShaderSource && CompileShader && GetShaderiv &&
+			GetShaderInfoLog && CreateProgram && AttachShader && BindAttribLocation && LinkProgram &&
+			GetProgramiv && GetProgramInfoLog && UseProgram && GetUniformLocation && Uniform1f &&
+			EnableVertexAttribArray && DisableVertexAttribArray && VertexAttribPointer;
+
+		bool instancing = v >= 33 || (HasExtension("GL_ARB_instanced_arrays") && HasExtension("GL_ARB_draw_instanced"));
+		VertexAttribDivisor = (VertexAttribDivisorFn)Proc(v >= 33 ? "glVertexAttribDivisor" : "glVertexAttribDivisorARB");
+		DrawElementsInstanced = (DrawElementsInstancedFn)Proc(v >= 33 ? "glDrawElementsInstanced" : "glDrawElementsInstancedARB");
+		HasInstancing = HasShaders && instancing && VertexAttribDivisor && DrawElementsInstanced;
+
+		bool storage = (v >= 44 || HasExtension("GL_ARB_buffer_storage")) && (v >= 32 || HasExtension("GL_ARB_sync"));
+		BufferStorage = (BufferStorageFn)Proc("glBufferStorage");
+		MapBufferRange = (MapBufferRangeFn)Proc("glMapBufferRange");
+		FenceSync = (FenceSyncFn)Proc("glFenceSync");
+		ClientWaitSync = (ClientWaitSyncFn)Proc("glClientWaitSync");
+		DeleteSync = (DeleteSyncFn)Proc("glDeleteSync");
+		HasPersistentMap = HasBuffers && storage && BufferStorage && MapBufferRange && FenceSync && ClientWaitSync && DeleteSync;
+	}
+};
+
+#endif _GLEXT_H_
@@ -1,229 +1,376 @@
 #ifndef _GRID_H_
 #define _GRID_H_
 #include <vector>
+#include <algorithm>
+#include <iostream>
+#include <math.h>
 #include <GL/glut.h>
 #include "objects.h"
 using namespace std;
 
+// A uniform grid with no bounds: cells are keyed by integer coordinates and only the occupied
+// ones are stored, in open addressing hash tables, so spheres that escape the box are still
+// found and memory goes with the number of occupied cells instead of the volume.
+// The cell size and origin come from the wall box (N_CELLS cells across it, counting one
+// border cell either side). There is one table per z slab of cells; slabs past the ends of
+// the box are folded into the first and last slab, so the step can still fill the slabs in
+// parallel without any two tasks writing the same table.
+// Each slab also lists its occupied cells as they are made, so nothing ever has to walk a
+// table's empty slots, and keeps a bitmap of which of its cells inside the box are occupied,
+// so a lookup of an empty cell there (most of them, in a fine grid) is a bit test, not a probe.
 class Grid
 {
 public:
 	//properties
 	static const int GRID_SIZE = 8;
 	static const int N_CELLS = 2 + GRID_SIZE;
-	vector<int> _cells[N_CELLS][N_CELLS][N_CELLS];
+	static const int OCCUPANCY_BUCKETS = 8; // cells holding 1, 2, 3-4, 5-8, ... 65 or more spheres
 	float _cellWidthX, _cellWidthY, _cellWidthZ;
-	float wallLeft, wallBottom, wallFront;
+	float wallLeft, wallBottom, wallFront; // corner of cell (0, 0, 0)
 	//members
 	Grid(float wallRadius);
 	void ClearCells();
-	void PrintGridInfo();
-	void DrawGrid();
-	void AddIndexToCell(int x, int y, int z, int index);
 	void ConstructGrid(vector<sphere>& spheres);
-	vector<int>& GetSpheresInCell(int x, int y, int z);
+	const int* GetSpheresInCell(int x, int y, int z, int& count);
+	int NumOccupiedCells();
+	bool IsOccupied(int x, int y, int z);
+	template <class Visit> void ForEachOccupiedCell(Visit visit); // visit(x, y, z, spheres, count)
+	void Occupancy(int histogram[OCCUPANCY_BUCKETS], int& entries, int& maxPerCell);
+	// ConstructGrid in pieces, so the step can run them as separate tasks
+	void ComputeRanges(vector<sphere>& spheres, int first, int last);
+	void GroupBySlab();
+	void FillSlab(int z, int reach);
+	int Reach(double maxRadius);
+	bool IsFirstSharedCell(int i, int j, int x, int y, int z);
+	template <class List> void GatherNeighbors(int i, vector<sphere>& spheres, List& neighbors, bool sorted = true);
+	void CellsOverlapping(const Vec3d& lo, const Vec3d& hi, int cellLo[3], int cellHi[3]);
 	~Grid();
 
+	struct CellRange
+	{
+		int lo[3], hi[3]; // cells overlapped, inclusive
+		int home; // slab the center is in
+	};
+	vector<CellRange> _ranges; // per sphere
+	CellRange _bounds; // of all the ranges
+	vector<int> _slabStart; // N_CELLS + 1 offsets into _slabSpheres
+	vector<int> _slabSpheres; // sphere indices grouped by home slab
+
 private:
+	struct Cell
+	{
+		int x, y, z;
+		int start, count; // into the slab's sphere list; count < 0 marks an empty slot
+	};
+	struct Slab
+	{
+		vector<Cell> table; // power of two size, linear probing
+		vector<int> spheres;
+		int occupied;
+		vector<int> active; // table slots of the occupied cells
+		unsigned long long bitmap[N_CELLS * N_CELLS / 64 + 1]; // cell (x, y, slab), x and y in the box
+		int histogram[OCCUPANCY_BUCKETS], maxCount; // of the cells' sphere counts
+	};
+	Slab _slabs[N_CELLS];
 
+	int CellCoord(double v, float origin, float width);
+	static int SlabOf(int z) { return z < 0 ? 0 : z >= N_CELLS ? N_CELLS - 1 : z; }
+	static bool InBox(int x, int y, int z) { return x >= 0 && x < N_CELLS && y >= 0 && y < N_CELLS && z >= 0 && z < N_CELLS; }
+	static unsigned int Hash(int x, int y, int z)
+	{
+		return ((unsigned int)x * 73856093u) ^ ((unsigned int)y * 19349663u) ^ ((unsigned int)z * 83492791u);
+	}
+	Cell& Insert(Slab& slab, int x, int y, int z);
+	const Cell* Find(const Slab& slab, int x, int y, int z);
 };
 
 Grid::Grid(float wallRadius)
 {
 	_cellWidthZ = _cellWidthY = _cellWidthX = (2.0f * wallRadius) / (N_CELLS - 2);
-	wallLeft = -1 - _cellWidthX;
-	wallBottom = -1 - _cellWidthY;
-	wallFront = -1 - _cellWidthZ;
+	wallLeft = -wallRadius - _cellWidthX;
+	wallBottom = -wallRadius - _cellWidthY;
+	wallFront = -wallRadius - _cellWidthZ;
 	ClearCells();
-	 
-}
-vector<int>& Grid::GetSpheresInCell(int x, int y, int z)
-{
-	return _cells[x][y][z];
+
 }
-void Grid::AddIndexToCell(int x, int y, int z, int index)
+int Grid::CellCoord(double v, float origin, float width)
 {
-	_cells[x][y][z].push_back(index);
+	// far enough out to be meaningless, but still safe to turn into an int
+	double c = floor((v - origin) / width);
+	return c < -1e9 ? -1000000000 : c > 1e9 ? 1000000000 : (int)c;
 }
-void Grid::ClearCells()
+Grid::Cell& Grid::Insert(Slab& slab, int x, int y, int z)
 {
-	for (int x = 0; x < N_CELLS; x++)
+	unsigned int mask = slab.table.size() - 1;
+	for (unsigned int h = Hash(x, y, z) & mask; ; h = (h + 1) & mask)
 	{
-		for (int y = 0; y < N_CELLS; y++)
+		Cell& cell = slab.table[h];
+		if (cell.count < 0)
 		{
-			for (int z = 0; z < N_CELLS; z++)
+			cell.x = x; cell.y = y; cell.z = z;
+			cell.count = 0;
+			slab.occupied++;
+			slab.active.push_back(h);
+			if (InBox(x, y, z))
 			{
-				_cells[x][y][z].clear();
+				int bit = y * N_CELLS + x;
+				slab.bitmap[bit >> 6] |= 1ULL << (bit & 63);
 			}
+			return cell;
 		}
+		if (cell.x == x && cell.y == y && cell.z == z) return cell;
 	}
-	
 }
-
-void Grid::ConstructGrid(vector<sphere>& spheres)
+const Grid::Cell* Grid::Find(const Slab& slab, int x, int y, int z)
 {
-	ClearCells();
-	
-	float cellLeftBound;
-	float cellRightBound;
-	float cellLowBound;
-	float cellHighBound;
-	float cellFrontBound;
-	float cellBackBound;
+	if (slab.table.empty()) return NULL;
+	unsigned int mask = slab.table.size() - 1;
+	for (unsigned int h = Hash(x, y, z) & mask; ; h = (h + 1) & mask)
+	{
+		const Cell& cell = slab.table[h];
+		if (cell.count < 0) return NULL;
+		if (cell.x == x && cell.y == y && cell.z == z) return &cell;
+	}
+}
+const int* Grid::GetSpheresInCell(int x, int y, int z, int& count)
+{
+	const Slab& slab = _slabs[SlabOf(z)];
+	const Cell* cell = InBox(x, y, z) && !IsOccupied(x, y, z) ? NULL : Find(slab, x, y, z);
+	count = cell == NULL ? 0 : cell->count;
+	return cell == NULL ? NULL : &slab.spheres[cell->start];
+}
+int Grid::NumOccupiedCells()
+{
+	int n = 0;
+	for (int z = 0; z < N_CELLS; z++)
+		n += _slabs[z].occupied;
+	return n;
+}
+// Only for cells in the box; outside it, look the cell up
+bool Grid::IsOccupied(int x, int y, int z)
+{
+	int bit = y * N_CELLS + x;
+	return (_slabs[z].bitmap[bit >> 6] >> (bit & 63)) & 1;
+}
+// Every occupied cell once, slab by slab
+template <class Visit>
+void Grid::ForEachOccupiedCell(Visit visit)
+{
+	for (int z = 0; z < N_CELLS; z++)
+	{
+		const Slab& slab = _slabs[z];
+		for (unsigned int a = 0; a < slab.active.size(); a++)
+		{
+			const Cell& cell = slab.table[slab.active[a]];
+			visit(cell.x, cell.y, cell.z, &slab.spheres[cell.start], cell.count);
+		}
+	}
+}
+// The occupied cells by how many spheres they hold, as the slabs were last filled
+void Grid::Occupancy(int histogram[OCCUPANCY_BUCKETS], int& entries, int& maxPerCell)
+{
+	fill(histogram, histogram + OCCUPANCY_BUCKETS, 0);
+	entries = maxPerCell = 0;
+	for (int z = 0; z < N_CELLS; z++)
+	{
+		for (int b = 0; b < OCCUPANCY_BUCKETS; b++)
+			histogram[b] += _slabs[z].histogram[b];
+		entries += _slabs[z].spheres.size();
+		maxPerCell = max(maxPerCell, _slabs[z].maxCount);
+	}
+}
+void Grid::ClearCells()
+{
+	for (int z = 0; z < N_CELLS; z++)
+	{
+		_slabs[z].table.clear();
+		_slabs[z].spheres.clear();
+		_slabs[z].occupied = 0;
+		_slabs[z].active.clear();
+		fill(_slabs[z].bitmap, _slabs[z].bitmap + sizeof(_slabs[z].bitmap) / sizeof(_slabs[z].bitmap[0]), 0ULL);
+		_slabs[z].maxCount = 0;
+		fill(_slabs[z].histogram, _slabs[z].histogram + OCCUPANCY_BUCKETS, 0);
+	}
+	for (int k = 0; k < 3; k++)
+	{
+		_bounds.lo[k] = 0;
+		_bounds.hi[k] = -1;
+	}
 
-	int startX, endX;
-	int startY, endY;
-	int startZ, endZ;
-	startX = startY = startZ = 0;
-	endX = endY = endZ = 0;
+}
 
-	for (int i = 0; i < spheres.size(); i++)
+// Works out the cells every sphere in [first, last) overlaps, and the slab its center is in.
+// Only reads the spheres, so blocks of them can be done in parallel.
+void Grid::ComputeRanges(vector<sphere>& spheres, int first, int last)
+{
+	float origin[3] = { wallLeft, wallBottom, wallFront };
+	float width[3] = { _cellWidthX, _cellWidthY, _cellWidthZ };
+	for (int i = first; i < last; i++)
 	{
-		//get x cells
-		for (int x = 0; x < N_CELLS; x++)
+		CellRange& range = _ranges[i];
+		for (int k = 0; k < 3; k++)
 		{
-			
-			cellLeftBound = x * _cellWidthX + wallLeft; //0 * 1 -1 = -1
-			cellRightBound = x * _cellWidthX + wallLeft + _cellWidthX; //0 * 1 - 1 + 1 = 0
-			if (spheres[i].p[0] - spheres[i].r >= cellLeftBound && spheres[i].p[0] - spheres[i].r < cellRightBound)
-			{
-				startX = x;
-				
-			}
-			if (spheres[i].p[0] + spheres[i].r > cellLeftBound && spheres[i].p[0] + spheres[i].r <= cellRightBound)
-			{
-				endX = x;
-				//cout << endX << endl;
-			}
-			
+			range.lo[k] = CellCoord(spheres[i].p[k] - spheres[i].r, origin[k], width[k]);
+			range.hi[k] = CellCoord(spheres[i].p[k] + spheres[i].r, origin[k], width[k]);
 		}
-		//get y cells
-		for (int y = 0; y < N_CELLS; y++)
+		range.home = SlabOf(CellCoord(spheres[i].p[2], origin[2], width[2]));
+	}
+}
+// Groups the spheres by home slab (counting sort, so each slab keeps index order)
+void Grid::GroupBySlab()
+{
+	int n = _ranges.size();
+	_slabStart.assign(N_CELLS + 1, 0);
+	for (int k = 0; k < 3; k++)
+	{
+		_bounds.lo[k] = n > 0 ? _ranges[0].lo[k] : 0;
+		_bounds.hi[k] = n > 0 ? _ranges[0].hi[k] : -1;
+	}
+	for (int i = 0; i < n; i++)
+	{
+		_slabStart[_ranges[i].home + 1]++;
+		for (int k = 0; k < 3; k++)
 		{
-
-			cellLowBound = y * _cellWidthY + wallBottom; //0 * 1 -1 = -1
-			cellHighBound = y * _cellWidthY + wallBottom + _cellWidthY; //0 * 1 - 1 + 1 = 0
-			if (spheres[i].p[1] - spheres[i].r >= cellLowBound && spheres[i].p[1] - spheres[i].r < cellHighBound)
-			{
-				startY = y;
-				//cout <<"y "<< startY << endl;
-			}
-			if (spheres[i].p[1] + spheres[i].r > cellLowBound && spheres[i].p[1] + spheres[i].r <= cellHighBound)
-			{
-				endY = y;
-			}
-
+			_bounds.lo[k] = min(_bounds.lo[k], _ranges[i].lo[k]);
+			_bounds.hi[k] = max(_bounds.hi[k], _ranges[i].hi[k]);
 		}
-		//get z cells
-		for (int z = 0; z < N_CELLS; z++)
+	}
+	for (int z = 0; z < N_CELLS; z++)
+		_slabStart[z + 1] += _slabStart[z];
+	_slabSpheres.resize(n);
+	int cursor[N_CELLS];
+	for (int z = 0; z < N_CELLS; z++) cursor[z] = _slabStart[z];
+	for (int i = 0; i < n; i++)
+		_slabSpheres[cursor[_ranges[i].home]++] = i;
+}
+// Rebuilds the table of slab z. A sphere can only reach this slab from a home slab at most
+// reach away, so only those are looked at. Counts per cell first, then fills each cell's run.
+// The counts are also tallied into the slab's occupancy histogram on the way.
+void Grid::FillSlab(int z, int reach)
+{
+	Slab& slab = _slabs[z];
+	int h0 = z - reach < 0 ? 0 : z - reach;
+	int h1 = z + reach >= N_CELLS ? N_CELLS - 1 : z + reach;
+	int entries = 0;
+	for (int pass = 0; pass < 3; pass++)
+	{
+		if (pass == 1)
 		{
-
-			cellFrontBound = z * _cellWidthZ + wallFront; //0 * 1 -1 = -1
-			cellBackBound = z * _cellWidthZ + wallFront + _cellWidthZ; //0 * 1 - 1 + 1 = 0
-			if (spheres[i].p[2] - spheres[i].r >= cellFrontBound && spheres[i].p[2] - spheres[i].r < cellBackBound)
-			{
-				startZ = z;
-			}
-			if (spheres[i].p[2] + spheres[i].r > cellFrontBound && spheres[i].p[2] + spheres[i].r <= cellBackBound)
+			// at most one cell per entry, and keep the table at most half full
+			unsigned int size = 16;
+			while (size < 2u * entries) size <<= 1;
+			Cell empty = { 0, 0, 0, 0, -1 };
+			slab.table.assign(size, empty);
+			slab.occupied = 0;
+			slab.active.clear();
+			fill(slab.bitmap, slab.bitmap + sizeof(slab.bitmap) / sizeof(slab.bitmap[0]), 0ULL);
+		}
+		if (pass == 2)
+		{
+			int start = 0;
+			slab.maxCount = 0;
+			fill(slab.histogram, slab.histogram + OCCUPANCY_BUCKETS, 0);
+			for (unsigned int a = 0; a < slab.active.size(); a++)
 			{
-				endZ = z;
+				Cell& cell = slab.table[slab.active[a]];
+				int bucket = 0;
+				while (bucket < OCCUPANCY_BUCKETS - 1 && (1 << bucket) < cell.count) bucket++;
+				slab.histogram[bucket]++;
+				if (cell.count > slab.maxCount) slab.maxCount = cell.count;
+				cell.start = start;
+				start += cell.count;
+				cell.count = 0;
 			}
-
+			slab.spheres.resize(start);
 		}
-		
-		if (startX >= 0 && startY >= 0 && startZ >= 0 && endX >= 0 && endY >= 0 && endZ >= 0){
-			for (int j = startX; j <= endX; j++)
+		for (int n = _slabStart[h0]; n < _slabStart[h1 + 1]; n++)
+		{
+			int i = _slabSpheres[n];
+			const CellRange& range = _ranges[i];
+			// the z cells of this sphere that fold into this slab
+			int zlo = range.lo[2], zhi = range.hi[2];
+			if (SlabOf(zlo) > z || SlabOf(zhi) < z) continue;
+			if (z > 0 && zlo < z) zlo = z;
+			if (z < N_CELLS - 1 && zhi > z) zhi = z;
+			if (pass == 0)
 			{
-				for (int k = startY; k <= endY; k++)
-				{
-					//cout << "y " << startY << endl;
-					for (int l = startZ; l <= endZ; l++)
-					{
-						_cells[j][k][l].push_back(i);
+				entries += (range.hi[0] - range.lo[0] + 1) * (range.hi[1] - range.lo[1] + 1) * (zhi - zlo + 1);
+				continue;
+			}
+			for (int x = range.lo[0]; x <= range.hi[0]; x++){
+				for (int y = range.lo[1]; y <= range.hi[1]; y++){
+					for (int cz = zlo; cz <= zhi; cz++){
+						Cell& cell = Insert(slab, x, y, cz);
+						if (pass == 2) slab.spheres[cell.start + cell.count] = i;
+						cell.count++;
 					}
 				}
 			}
 		}
 	}
-
-	
 }
-void Grid::PrintGridInfo()
+// How many slabs away from its home slab a sphere of this radius can reach
+int Grid::Reach(double maxRadius)
 {
-	for (int z = 0; z < N_CELLS; z++)
-	{
-		for (int y = 0; y < N_CELLS; y++)
-		{
-			for (int x = 0; x < N_CELLS; x++)
-			{
-				cout << "(" << x << "," << y << "," << z <<","<<_cells[x][y][z].size()<< "): ";
-				
-				for (int i = 0; i < _cells[x][y][z].size(); i++)
-				{
-					cout << _cells[x][y][z].at(i) << " ";
-				}
-				cout << endl;
+	int reach = (int)ceil(maxRadius / _cellWidthZ);
+	return reach < 1 ? 1 : reach;
+}
+// Two spheres that overlap several of the same cells would otherwise meet once per shared
+// cell. Only the first shared cell (lowest corner of the overlap of their ranges) counts.
+bool Grid::IsFirstSharedCell(int i, int j, int x, int y, int z)
+{
+	const CellRange& a = _ranges[i];
+	const CellRange& b = _ranges[j];
+	return x == max(a.lo[0], b.lo[0]) && y == max(a.lo[1], b.lo[1]) && z == max(a.lo[2], b.lo[2]);
+}
+// Every other sphere sharing a cell with sphere i, each once. The order fixes the order contact
+// forces are summed in. Sorted, it is index order, so the result doesn't depend on how the
+// cells were laid out or filled (or, for a domain decomposition, on which process filled them)
+// and matches the brute force pass. Unsorted it follows the cells, which is cheaper and still
+// the same from run to run, but changes with the grid layout.
+template <class List>
+void Grid::GatherNeighbors(int i, vector<sphere>& spheres, List& neighbors, bool sorted)
+{
+	neighbors.clear();
+	const CellRange& range = _ranges[i];
+	for (int x = range.lo[0]; x <= range.hi[0]; x++){
+		for (int y = range.lo[1]; y <= range.hi[1]; y++){
+			for (int z = range.lo[2]; z <= range.hi[2]; z++){
+				int count;
+				const int* cell = GetSpheresInCell(x, y, z, count);
+				for (int k = 0; k < count; k++)
+					if (cell[k] != i && IsFirstSharedCell(i, cell[k], x, y, z))
+						neighbors.push_back(&spheres[cell[k]]);
 			}
-			
 		}
 	}
-
+	if (sorted) sort(neighbors.begin(), neighbors.end());
 }
-void Grid::DrawGrid()
+// The cells a box from lo to hi overlaps, inclusive
+void Grid::CellsOverlapping(const Vec3d& lo, const Vec3d& hi, int cellLo[3], int cellHi[3])
 {
-	float cellLeftBound;
-	float cellBottomBound;
-	float cellFrontBound;
-	for (int z = 0; z < N_CELLS; z++)
+	float origin[3] = { wallLeft, wallBottom, wallFront };
+	float width[3] = { _cellWidthX, _cellWidthY, _cellWidthZ };
+	for (int k = 0; k < 3; k++)
 	{
-		for (int y = 0; y < N_CELLS; y++)
-		{
-			for (int x = 0; x < N_CELLS; x++)
-			{
-				
-				cellLeftBound = x * _cellWidthX + wallLeft; //0 * 1 - 2 = -2
-				cellBottomBound = y * _cellWidthY + wallLeft;
-				cellFrontBound = z * _cellWidthZ + wallLeft;
-				glPushMatrix();
-				glDisable(GL_CULL_FACE);
-				glDisable(GL_COLOR_MATERIAL);
-				glDisable(GL_LIGHTING);
-				
-				glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-				glBegin(GL_QUADS);
-				//glColor4f(1.0f, 0, 0, 0.2);
-				
-				//left
-				glVertex3d(cellLeftBound, cellBottomBound, cellFrontBound); // ahh, really should use the array form of glVertex here
-				glVertex3d(cellLeftBound, cellBottomBound + _cellWidthY, cellFrontBound);
-				glVertex3d(cellLeftBound, cellBottomBound + _cellWidthY, cellFrontBound + _cellWidthZ);
-				glVertex3d(cellLeftBound, cellBottomBound, cellFrontBound + _cellWidthZ);
-
-				
-				//back
-				glVertex3d(cellLeftBound, cellBottomBound, cellFrontBound + _cellWidthZ);
-				glVertex3d(cellLeftBound, cellBottomBound + _cellWidthY, cellFrontBound + _cellWidthZ);
-				glVertex3d(cellLeftBound + _cellWidthX, cellBottomBound + _cellWidthY, cellFrontBound + _cellWidthZ);
-				glVertex3d(cellLeftBound + _cellWidthX, cellBottomBound, cellFrontBound + _cellWidthZ);
-
-				//bottom
-				glVertex3d(cellLeftBound, cellBottomBound, cellFrontBound);
-				glVertex3d(cellLeftBound, cellBottomBound, cellFrontBound + _cellWidthZ);
-				glVertex3d(cellLeftBound + _cellWidthX, cellBottomBound, cellFrontBound + _cellWidthZ);
-				glVertex3d(cellLeftBound + _cellWidthX, cellBottomBound, cellFrontBound);
-				
-				
-				glEnd();
-				glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-				glPopMatrix();
-			}
-
-		}
+		cellLo[k] = CellCoord(lo[k], origin[k], width[k]);
+		cellHi[k] = CellCoord(hi[k], origin[k], width[k]);
 	}
-	
+}
+void Grid::ConstructGrid(vector<sphere>& spheres)
+{
+	_ranges.resize(spheres.size());
+	ComputeRanges(spheres, 0, spheres.size());
+	GroupBySlab();
+	double maxRadius = 0;
+	for (unsigned int i = 0; i < spheres.size(); i++)
+		if (spheres[i].r > maxRadius) maxRadius = spheres[i].r;
+	int reach = Reach(maxRadius);
+	for (int z = 0; z < N_CELLS; z++)
+		FillSlab(z, reach);
 }
 Grid::~Grid()
 {
 }
 
-#endif _GRID_H_
\ No newline at end of file
+#endif _GRID_H_
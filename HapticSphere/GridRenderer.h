@@ -0,0 +1,223 @@
+#ifndef _GRIDRENDERER_H_
+#define _GRIDRENDERER_H_
+#include <vector>
+#include <algorithm>
+#include <string.h>
+#include <GL/glut.h>
+#include "GLExt.h"
+#include "FrameBuffer.h"
+using namespace std;
+
+// Draws the grid the way 'd' shows it: the lattice wireframe plus every occupied cell outlined
+// in a color that runs from blue (one sphere) to red (maxCount or more).
+// The lattice is built once into a buffer (or a display list on GL 1.1) and only rebuilt when
+// the grid dimensions change. The occupied-cell outlines live in a second buffer whose
+// positions never change; each frame only the colors of cells whose count changed are rewritten,
+// and only the occupied cells are drawn, so the cost goes with them and not the grid's size.
+// Occupancy comes from the frame's bins (spheres counted by their center), so this is safe to
+// call while the physics thread is rebuilding the Grid.
+class GridRenderer
+{
+public:
+	//properties
+	int maxCount; // cells with this many spheres or more are drawn fully red
+	//members
+	GridRenderer();
+	void Init(GLExtensions* gl);
+	void Draw(const FrameState& frame);
+	~GridRenderer();
+
+private:
+	static const int CELL_VERTS = 24; // 12 edges as GL_LINES
+	GLExtensions* _gl;
+	bool _useBuffers;
+	int _cells;
+	float _origin, _width;
+	GLuint _latticeVBO, _latticeList, _cellVBO;
+	int _latticeVerts;
+	vector<float> _cellPositions;
+	vector<unsigned char> _cellColors; // CPU copy, also what GL 1.1 draws from
+	vector<int> _counts; // as drawn
+	vector<int> _next; // this frame's, only set for the cells in it
+	vector<int> _shown; // cells drawn last frame
+	vector<GLuint> _indices; // vertices of the cells to draw
+
+	void Rebuild(const FrameState& frame);
+	void CellColor(int count, unsigned char* rgba);
+	void Recolor(int c, int count, size_t positionBytes);
+};
+
+GridRenderer::GridRenderer()
+{
+	maxCount = 8;
+	_gl = NULL;
+	_useBuffers = false;
+	_cells = 0;
+	_origin = _width = 0;
+	_latticeVBO = _latticeList = _cellVBO = 0;
+	_latticeVerts = 0;
+}
+// Needs a current GL context, so call after glutCreateWindow
+void GridRenderer::Init(GLExtensions* gl)
+{
+	_gl = gl;
+	_useBuffers = gl->HasBuffers;
+}
+void GridRenderer::CellColor(int count, unsigned char* rgba)
+{
+	float t = count >= maxCount ? 1.0f : (float)(count - 1) / (maxCount - 1);
+	rgba[0] = (unsigned char)(255 * t);
+	rgba[1] = (unsigned char)(80 * (1 - t));
+	rgba[2] = (unsigned char)(255 * (1 - t));
+	rgba[3] = count > 0 ? 255 : 0; // empty cells are dropped by the alpha test
+}
+void GridRenderer::Rebuild(const FrameState& frame)
+{
+	_cells = frame.binCells;
+	_origin = frame.binOrigin;
+	_width = frame.binWidth;
+	int n = _cells;
+	float hi = _origin + n * _width;
+
+	// each lattice line runs the full length of the grid once
+	vector<float> lattice;
+	for (int a = 0; a <= n; a++)
+	{
+		for (int b = 0; b <= n; b++)
+		{
+			float u = _origin + a * _width, v = _origin + b * _width;
+			float lines[18] = { _origin, u, v, hi, u, v,
+			                    u, _origin, v, u, hi, v,
+			                    u, v, _origin, u, v, hi };
+			lattice.insert(lattice.end(), lines, lines + 18);
+		}
+	}
+	_latticeVerts = lattice.size() / 3;
+
+	int numCells = n * n * n;
+	_cellPositions.resize(numCells * CELL_VERTS * 3);
+	_cellColors.assign(numCells * CELL_VERTS * 4, 0);
+	_counts.assign(numCells, 0);
+	_next.assign(numCells, 0);
+	_shown.clear();
+	static const int edges[12][2] = { {0,1},{2,3},{4,5},{6,7}, {0,2},{1,3},{4,6},{5,7}, {0,4},{1,5},{2,6},{3,7} };
+	for (int z = 0; z < n; z++){
+		for (int y = 0; y < n; y++){
+			for (int x = 0; x < n; x++){
+				float* out = &_cellPositions[((z * n + y) * n + x) * CELL_VERTS * 3];
+				for (int e = 0; e < 12; e++){
+					for (int k = 0; k < 2; k++){
+						int corner = edges[e][k];
+						*out++ = _origin + (x + (corner & 1)) * _width;
+						*out++ = _origin + (y + ((corner >> 1) & 1)) * _width;
+						*out++ = _origin + (z + ((corner >> 2) & 1)) * _width;
+					}
+				}
+			}
+		}
+	}
+
+	if (_useBuffers)
+	{
+		if (_latticeVBO == 0) _gl->GenBuffers(1, &_latticeVBO);
+		if (_cellVBO == 0) _gl->GenBuffers(1, &_cellVBO);
+		_gl->BindBuffer(GL_ARRAY_BUFFER, _latticeVBO);
+		_gl->BufferData(GL_ARRAY_BUFFER, lattice.size() * sizeof(float), &lattice[0], GL_STATIC_DRAW);
+		// positions then colors; only the colors are ever touched again
+		size_t positionBytes = _cellPositions.size() * sizeof(float);
+		_gl->BindBuffer(GL_ARRAY_BUFFER, _cellVBO);
+		_gl->BufferData(GL_ARRAY_BUFFER, positionBytes + _cellColors.size(), NULL, GL_DYNAMIC_DRAW);
+		_gl->BufferSubData(GL_ARRAY_BUFFER, 0, positionBytes, &_cellPositions[0]);
+		_gl->BufferSubData(GL_ARRAY_BUFFER, positionBytes, _cellColors.size(), &_cellColors[0]);
+		_gl->BindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+	else
+	{
+		if (_latticeList == 0) _latticeList = glGenLists(1);
+		glNewList(_latticeList, GL_COMPILE);
+		glBegin(GL_LINES);
+		for (int i = 0; i < _latticeVerts; i++)
+			glVertex3fv(&lattice[3 * i]);
+		glEnd();
+		glEndList();
+	}
+}
+void GridRenderer::Recolor(int c, int count, size_t positionBytes)
+{
+	if (count == _counts[c]) return;
+	_counts[c] = count;
+	unsigned char rgba[4];
+	CellColor(count, rgba);
+	size_t first = (size_t)c * CELL_VERTS * 4;
+	for (int v = 0; v < CELL_VERTS; v++)
+		memcpy(&_cellColors[first + v * 4], rgba, 4);
+	if (_useBuffers) _gl->BufferSubData(GL_ARRAY_BUFFER, positionBytes + first, CELL_VERTS * 4, &_cellColors[first]);
+}
+void GridRenderer::Draw(const FrameState& frame)
+{
+	if (frame.binCells != _cells || frame.binOrigin != _origin || frame.binWidth != _width)
+		Rebuild(frame);
+	size_t positionBytes = _cellPositions.size() * sizeof(float);
+	bool haveCounts = frame.binStart.size() == frame.bins.size() + 1;
+
+	// recolor only the cells whose count changed: the ones in this frame, and the ones that
+	// were in the last frame and may have emptied since
+	if (_useBuffers) _gl->BindBuffer(GL_ARRAY_BUFFER, _cellVBO);
+	for (unsigned int a = 0; haveCounts && a < frame.bins.size(); a++)
+		_next[frame.bins[a]] = frame.binStart[a + 1] - frame.binStart[a];
+	for (unsigned int k = 0; k < _shown.size(); k++)
+		Recolor(_shown[k], _next[_shown[k]], positionBytes);
+	// drawn in cell order, so where neighbors share an edge it is always the same one's color
+	if (haveCounts) _shown.assign(frame.bins.begin(), frame.bins.end());
+	else _shown.clear();
+	sort(_shown.begin(), _shown.end());
+	_indices.clear();
+	for (unsigned int k = 0; k < _shown.size(); k++)
+	{
+		int c = _shown[k];
+		Recolor(c, _next[c], positionBytes);
+		_next[c] = 0;
+		for (int v = 0; v < CELL_VERTS; v++)
+			_indices.push_back(c * CELL_VERTS + v);
+	}
+
+	glPushAttrib(GL_ENABLE_BIT | GL_CURRENT_BIT | GL_LINE_BIT);
+	glDisable(GL_CULL_FACE);
+	glDisable(GL_COLOR_MATERIAL);
+	glDisable(GL_LIGHTING);
+	glEnableClientState(GL_VERTEX_ARRAY);
+
+	if (_useBuffers)
+	{
+		_gl->BindBuffer(GL_ARRAY_BUFFER, _latticeVBO);
+		glVertexPointer(3, GL_FLOAT, 0, 0);
+		glDrawArrays(GL_LINES, 0, _latticeVerts);
+	}
+	else glCallList(_latticeList);
+
+	glEnable(GL_ALPHA_TEST);
+	glAlphaFunc(GL_GREATER, 0.0f);
+	glLineWidth(2.0);
+	glEnableClientState(GL_COLOR_ARRAY);
+	if (_useBuffers)
+	{
+		_gl->BindBuffer(GL_ARRAY_BUFFER, _cellVBO);
+		glVertexPointer(3, GL_FLOAT, 0, 0);
+		glColorPointer(4, GL_UNSIGNED_BYTE, 0, (const void*)positionBytes);
+	}
+	else
+	{
+		glVertexPointer(3, GL_FLOAT, 0, &_cellPositions[0]);
+		glColorPointer(4, GL_UNSIGNED_BYTE, 0, &_cellColors[0]);
+	}
+	if (!_indices.empty()) glDrawElements(GL_LINES, _indices.size(), GL_UNSIGNED_INT, &_indices[0]);
+	glDisableClientState(GL_COLOR_ARRAY);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	if (_useBuffers) _gl->BindBuffer(GL_ARRAY_BUFFER, 0);
+	glPopAttrib();
+}
+GridRenderer::~GridRenderer()
+{
+}
+
+#endif _GRIDRENDERER_H_
@@ -0,0 +1,138 @@
+#ifndef _GRIDSTATS_H_
+#define _GRIDSTATS_H_
+#include <vector>
+#include <iostream>
+#include <stdio.h>
+#include "Grid.h"
+#include "LooseOctree.h"
+#include "TaskScheduler.h"
+using namespace std;
+
+// The numbers to tune the grid by, as of the last step: how full the cells are, how many of the
+// pairs the broadphase hands over actually touch, and how evenly the step's threads were kept
+// busy. Nothing here walks the spheres or the cells: the grid tallies its cells as it fills
+// them, each contact task counts its own pairs into a slot of its own, and Update() only adds
+// up the slabs, the slots and the threads. With the octree for the broadphase its nodes stand in
+// for the cells.
+class GridStats
+{
+public:
+	//properties
+	int spheres, occupiedCells, entries, maxPerCell;
+	int histogram[Grid::OCCUPANCY_BUCKETS];
+	double meanPerCell;
+	double emptyFraction; // of the cells in the box around every sphere
+	int nodes, depth; // the octree's, if it was used
+	long long candidates, contacts; // pairs, each once
+	double efficiency; // contacts over candidates
+	vector<double> busy; // seconds each thread spent in tasks
+	double imbalance; // the busiest thread's time over the mean
+	//members
+	GridStats();
+	void Slots(int count); // one per contact task
+	void Count(int slot, long long candidates, long long contacts) { _candidates[slot] = candidates; _contacts[slot] = contacts; }
+	void Update(Grid* grid, LooseOctree* octree, TaskScheduler& scheduler, int count);
+	void Print(ostream& out);
+	void Summary(char* text, int size);
+	~GridStats();
+
+private:
+	vector<long long> _candidates, _contacts; // each pair counted from both ends
+};
+
+GridStats::GridStats()
+{
+	spheres = occupiedCells = entries = maxPerCell = 0;
+	nodes = depth = 0;
+	fill(histogram, histogram + Grid::OCCUPANCY_BUCKETS, 0);
+	meanPerCell = emptyFraction = efficiency = imbalance = 0.0;
+	candidates = contacts = 0;
+}
+// Between steps only: the slots start over at zero
+void GridStats::Slots(int count)
+{
+	_candidates.assign(count, 0);
+	_contacts.assign(count, 0);
+}
+// After the step, with whichever of the grid and the octree it used. Without either only the
+// pairs and the threads are counted.
+void GridStats::Update(Grid* grid, LooseOctree* octree, TaskScheduler& scheduler, int count)
+{
+	spheres = count;
+	nodes = depth = 0;
+	if (octree != NULL)
+	{
+		octree->Occupancy(histogram, entries, maxPerCell);
+		occupiedCells = octree->NumOccupiedNodes();
+		meanPerCell = occupiedCells > 0 ? entries / (double)occupiedCells : 0.0;
+		emptyFraction = 0.0;
+		nodes = octree->NumNodes();
+		depth = octree->Depth();
+	}
+	else if (grid != NULL)
+	{
+		grid->Occupancy(histogram, entries, maxPerCell);
+		occupiedCells = grid->NumOccupiedCells();
+		meanPerCell = occupiedCells > 0 ? entries / (double)occupiedCells : 0.0;
+		double box = 1.0;
+		for (int k = 0; k < 3; k++)
+			box *= max(0, grid->_bounds.hi[k] - grid->_bounds.lo[k] + 1);
+		emptyFraction = box > 0.0 ? 1.0 - occupiedCells / box : 0.0;
+	}
+	else
+	{
+		occupiedCells = entries = maxPerCell = 0;
+		fill(histogram, histogram + Grid::OCCUPANCY_BUCKETS, 0);
+		meanPerCell = emptyFraction = 0.0;
+	}
+	candidates = contacts = 0;
+	for (unsigned int i = 0; i < _candidates.size(); i++)
+	{
+		candidates += _candidates[i];
+		contacts += _contacts[i];
+	}
+	candidates /= 2;
+	contacts /= 2;
+	efficiency = candidates > 0 ? contacts / (double)candidates : 0.0;
+	busy.resize(scheduler.numThreads);
+	double total = 0.0, most = 0.0;
+	for (int t = 0; t < scheduler.numThreads; t++)
+	{
+		busy[t] = scheduler.Busy(t);
+		total += busy[t];
+		most = max(most, busy[t]);
+	}
+	imbalance = total > 0.0 ? most * scheduler.numThreads / total : 0.0;
+	scheduler.ClearBusy();
+}
+void GridStats::Print(ostream& out)
+{
+	const char* cells = nodes > 0 ? "Nodes" : "Cells";
+	if (nodes > 0)
+		out << "Octree nodes: " << nodes << ", " << occupiedCells << " holding spheres, " << depth << " deep" << endl;
+	else out << "Occupied cells: " << occupiedCells << " (" << 100.0 * emptyFraction << "% of the box around the spheres empty)" << endl;
+	out << "Spheres per " << (nodes > 0 ? "node" : "cell") << ": mean " << meanPerCell << ", max " << maxPerCell << ", " << entries << " entries for " << spheres << " spheres" << endl;
+	out << cells << " holding 1, 2, 3-4, ... spheres:";
+	for (int b = 0; b < Grid::OCCUPANCY_BUCKETS; b++)
+		out << " " << histogram[b];
+	out << endl;
+	out << "Candidate pairs: " << candidates << ", touching: " << contacts << " (" << 100.0 * efficiency << "%)" << endl;
+	out << "Thread busy (ms):";
+	for (unsigned int t = 0; t < busy.size(); t++)
+		out << " " << busy[t] * 1000.0;
+	out << ", busiest over mean " << imbalance << endl;
+}
+// One line, for the overlay
+void GridStats::Summary(char* text, int size)
+{
+	if (nodes > 0)
+		snprintf(text, size, "Nodes:%d depth:%d mean:%.1f max:%d pairs:%lld touching:%.0f%% imbalance:%.2f",
+			occupiedCells, depth, meanPerCell, maxPerCell, candidates, 100.0 * efficiency, imbalance);
+	else snprintf(text, size, "Cells:%d mean:%.1f max:%d empty:%.0f%% pairs:%lld touching:%.0f%% imbalance:%.2f",
+		occupiedCells, meanPerCell, maxPerCell, 100.0 * emptyFraction, candidates, 100.0 * efficiency, imbalance);
+}
+GridStats::~GridStats()
+{
+}
+
+#endif _GRIDSTATS_H_
@@ -0,0 +1,252 @@
+#ifndef _HAPTICDEVICE_H_
+#define _HAPTICDEVICE_H_
+#include <chrono>
+#include <vector>
+#include <stdio.h>
+#include <gmtl/gmtl.h>
+#include "FrameBuffer.h"
+using namespace std;
+using namespace gmtl;
+
+// What the haptic servo loop talks to: a handle the user moves, which can push back.
+// A driver for a real device implements this; SimulatedDevice, ScriptedDevice and DeviceRecorder
+// stand in for one. Only the servo thread calls ReadPosition() and WriteForce().
+class HapticDevice
+{
+public:
+	virtual ~HapticDevice() {}
+	virtual const char* Name() = 0;
+	// Where the handle is now
+	virtual Vec3d ReadPosition() = 0;
+	// The force and torque to push the handle with until the next call. A device that can't
+	// give a torque (most three degree of freedom ones) ignores it.
+	virtual void WriteForce(const Vec3d& force, const Vec3d& torque) = 0;
+};
+
+// A hand holding a handle, for running the servo loop without a device. The hand is a mass
+// on a spring pulled towards a target (which the arrow keys move), and the force written back
+// pushes on it, so pushing into something stops it short the way it would stop a real hand.
+class SimulatedDevice : public HapticDevice
+{
+public:
+	//properties
+	double mass, stiffness, damping; // of the hand
+	double maxForce; // what the motors can give
+	//members
+	SimulatedDevice(const Vec3d& start);
+	const char* Name() { return "simulated"; }
+	void MoveTarget(const Vec3d& by); // from the GLUT thread
+	Vec3d ReadPosition();
+	void WriteForce(const Vec3d& force, const Vec3d& torque);
+	~SimulatedDevice();
+
+private:
+	Vec3d _target; // GLUT thread side
+	TripleExchange<Vec3d> _targets;
+	Vec3d _p, _v; // servo thread side
+	chrono::steady_clock::time_point _last;
+	bool _started;
+};
+
+SimulatedDevice::SimulatedDevice(const Vec3d& start)
+{
+	mass = 0.2;
+	stiffness = 200.0;
+	damping = 2.0 * sqrt(mass * stiffness); // critical, a hand doesn't wobble
+	maxForce = 20.0;
+	_target = _p = start;
+	_v.set(0.0, 0.0, 0.0);
+	_targets.Back() = start;
+	_targets.Publish();
+	_started = false;
+}
+void SimulatedDevice::MoveTarget(const Vec3d& by)
+{
+	_target += by;
+	_targets.Back() = _target;
+	_targets.Publish();
+}
+Vec3d SimulatedDevice::ReadPosition()
+{
+	return _p;
+}
+// Moves the hand on by however long it has been since the last call. A hand holding a point
+// doesn't turn, so the torque goes nowhere.
+void SimulatedDevice::WriteForce(const Vec3d& force, const Vec3d&)
+{
+	chrono::steady_clock::time_point now = chrono::steady_clock::now();
+	double dt = _started ? chrono::duration<double>(now - _last).count() : 0.0;
+	_last = now;
+	_started = true;
+	if (dt > 0.01) dt = 0.01; // after a stall, don't jump
+	_targets.Acquire();
+	Vec3d pushed = force;
+	double magnitude = length(pushed);
+	if (magnitude > maxForce) pushed *= maxForce / magnitude;
+	Vec3d accel = ((_targets.Front() - _p) * stiffness - _v * damping + pushed) / mass;
+	_v += accel * dt;
+	_p += _v * dt;
+}
+SimulatedDevice::~SimulatedDevice()
+{
+}
+
+// A handle that follows a path given as timed positions, for runs that have to be repeatable
+// (and for replaying a DeviceRecorder file, which starts with the same four columns).
+// It goes in straight lines between the positions and stays at the last one. It pays no
+// attention to the force, the way a very stiff hand wouldn't.
+class ScriptedDevice : public HapticDevice
+{
+public:
+	struct Key
+	{
+		double t; // seconds from the first ReadPosition()
+		Vec3d p;
+	};
+	//members
+	ScriptedDevice(const Vec3d& start);
+	const char* Name() { return "scripted"; }
+	void Add(double t, const Vec3d& p); // in time order
+	bool Load(const char* file); // "t x y z" a line, anything after that is skipped
+	Vec3d At(double t);
+	Vec3d ReadPosition();
+	void WriteForce(const Vec3d&, const Vec3d&) {}
+	~ScriptedDevice();
+
+private:
+	vector<Key> _keys;
+	unsigned int _key; // the segment the last read was in
+	chrono::steady_clock::time_point _start;
+	bool _started;
+};
+
+ScriptedDevice::ScriptedDevice(const Vec3d& start)
+{
+	Key key = { 0.0, start };
+	_keys.push_back(key);
+	_key = 0;
+	_started = false;
+}
+void ScriptedDevice::Add(double t, const Vec3d& p)
+{
+	Key key = { t, p };
+	if (_keys.size() == 1 && _keys[0].t == 0.0 && t == 0.0) _keys[0] = key; // a path that says where to start
+	else _keys.push_back(key);
+}
+bool ScriptedDevice::Load(const char* file)
+{
+	FILE* in = fopen(file, "r");
+	if (in == NULL) return false;
+	char line[512];
+	int count = 0;
+	while (fgets(line, sizeof(line), in) != NULL)
+	{
+		double t, x, y, z;
+		if (line[0] == '#' || sscanf(line, "%lf %lf %lf %lf", &t, &x, &y, &z) != 4) continue;
+		if (count > 0 && t < _keys.back().t) continue; // out of order
+		Add(t, Vec3d(x, y, z));
+		count++;
+	}
+	fclose(in);
+	return count > 0;
+}
+// Where the path is at time t. Reads go forward in time, so the search starts where the last one stopped.
+Vec3d ScriptedDevice::At(double t)
+{
+	if (_key >= _keys.size() || (_key > 0 && t < _keys[_key].t)) _key = 0;
+	while (_key + 1 < _keys.size() && _keys[_key + 1].t <= t) _key++;
+	if (_key + 1 == _keys.size() || t <= _keys[_key].t) return _keys[_key].p;
+	const Key& a = _keys[_key];
+	const Key& b = _keys[_key + 1];
+	return a.p + (b.p - a.p) * ((t - a.t) / (b.t - a.t));
+}
+Vec3d ScriptedDevice::ReadPosition()
+{
+	chrono::steady_clock::time_point now = chrono::steady_clock::now();
+	if (!_started) _start = now;
+	_started = true;
+	return At(chrono::duration<double>(now - _start).count());
+}
+ScriptedDevice::~ScriptedDevice()
+{
+}
+
+// Wraps another device and keeps every tick of it: when, where the handle was and what it was
+// pushed with. The buffer is allocated up front so the servo thread never allocates; once it
+// is full the rest of the run isn't kept. Save() writes it out between runs.
+class DeviceRecorder : public HapticDevice
+{
+public:
+	struct Sample
+	{
+		double t;
+		Vec3d p, force, torque;
+	};
+	//members
+	DeviceRecorder(HapticDevice* device, int capacity = 120000); // takes the device over
+	const char* Name() { return "recorded"; }
+	HapticDevice* Device() { return _device; }
+	Vec3d ReadPosition();
+	void WriteForce(const Vec3d& force, const Vec3d& torque);
+	int Count() { return _count; }
+	int Dropped() { return _dropped; }
+	bool Save(const char* file); // "t x y z fx fy fz tx ty tz" a line
+	~DeviceRecorder();
+
+private:
+	HapticDevice* _device;
+	vector<Sample> _samples;
+	int _count, _dropped;
+	Vec3d _p; // read this tick
+	chrono::steady_clock::time_point _start;
+	bool _started;
+};
+
+DeviceRecorder::DeviceRecorder(HapticDevice* device, int capacity)
+{
+	_device = device;
+	_samples.resize(capacity);
+	_count = _dropped = 0;
+	_started = false;
+}
+Vec3d DeviceRecorder::ReadPosition()
+{
+	_p = _device->ReadPosition();
+	return _p;
+}
+void DeviceRecorder::WriteForce(const Vec3d& force, const Vec3d& torque)
+{
+	_device->WriteForce(force, torque);
+	chrono::steady_clock::time_point now = chrono::steady_clock::now();
+	if (!_started) _start = now;
+	_started = true;
+	if (_count == (int)_samples.size())
+	{
+		_dropped++;
+		return;
+	}
+	Sample& sample = _samples[_count++];
+	sample.t = chrono::duration<double>(now - _start).count();
+	sample.p = _p;
+	sample.force = force;
+	sample.torque = torque;
+}
+bool DeviceRecorder::Save(const char* file)
+{
+	FILE* out = fopen(file, "w");
+	if (out == NULL) return false;
+	fprintf(out, "# t x y z fx fy fz tx ty tz (%s device)\n", _device->Name());
+	for (int i = 0; i < _count; i++)
+	{
+		const Sample& s = _samples[i];
+		fprintf(out, "%.6f %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g\n", s.t, s.p[0], s.p[1], s.p[2],
+			s.force[0], s.force[1], s.force[2], s.torque[0], s.torque[1], s.torque[2]);
+	}
+	return fclose(out) == 0;
+}
+DeviceRecorder::~DeviceRecorder()
+{
+	delete _device;
+}
+
+#endif _HAPTICDEVICE_H_
@@ -0,0 +1,243 @@
+#ifndef _HAPTICSERVO_H_
+#define _HAPTICSERVO_H_
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <math.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include "objects.h"
+#include "FrameBuffer.h"
+#include "HapticDevice.h"
+using namespace std;
+
+// The proxy's surroundings, handed from the simulation to the servo loop after every step:
+// the spheres near the proxy and the walls, and the filtered contact force and torque the step
+// worked out on the proxy where it was then. The servo works off the newest one it has.
+struct HapticPatch
+{
+	struct Neighbor
+	{
+		Vec3d p, v;
+		double r, K;
+	};
+	vector<Neighbor> spheres;
+	plane walls[6];
+	double proxyRadius, proxyK;
+	Vec3d proxyAt; // where the proxy was for the step
+	Vec3d reactionForce, reactionTorque; // on the proxy at proxyAt, with damping and friction
+	// with a virtual coupling the handle only ever feels the coupling spring to the proxy
+	bool coupled;
+	double couplingK, couplingC;
+	Vec3d proxyVelocity;
+	unsigned int step;
+	HapticPatch() : proxyRadius(0), proxyK(0), proxyAt(0, 0, 0), reactionForce(0, 0, 0), reactionTorque(0, 0, 0),
+		coupled(false), couplingK(0), couplingC(0), proxyVelocity(0, 0, 0), step(0) {}
+};
+
+// One tick of the servo loop, handed back to the simulation
+struct ServoState
+{
+	Vec3d position, velocity; // of the device handle, which is where the proxy goes
+	Vec3d force, torque; // on the proxy from what it is touching, also what the handle is pushed with
+	unsigned long long tick;
+	ServoState() : tick(0) {}
+};
+
+// Stable force feedback needs the force updated about a thousand times a second, far more
+// often than the simulation steps. This runs its own thread at that rate, at the highest
+// priority it is allowed: every tick it reads the device, works out the force on the proxy
+// from the last patch the simulation published, and writes the force back to the device.
+// The force is the step's reaction on the proxy, carried on between steps by how much the
+// patch's springs have changed since: only the few spheres in the patch are looked at a tick.
+// With a virtual coupling it is just the coupling spring to where the proxy has got to.
+// Both directions go through lock-free triple buffers, so neither side ever waits on the other.
+// The tick period is measured as it runs (rate, jitter and the worst late wake up, over the
+// last second) so the loop can be checked on an ordinary desktop.
+class HapticServo
+{
+public:
+	//properties
+	double rate; // ticks a second asked for
+	//members
+	HapticServo();
+	bool Start(HapticDevice* device, double hz = 1000.0);
+	void Stop();
+	bool Running() { return _running; }
+	HapticDevice* Device() { return _device; }
+	bool Realtime() { return _realtime; }
+	// simulation side
+	HapticPatch& Patch() { return _patches.Back(); }
+	void PublishPatch() { _patches.Publish(); }
+	bool Latest(ServoState& state);
+	// measured, any thread
+	double MeasuredRate() { return _measuredRate; }
+	double Jitter() { return _jitter; } // standard deviation of the period, microseconds
+	double WorstLate() { return _worstLate; } // microseconds
+	~HapticServo();
+
+private:
+	TripleExchange<HapticPatch> _patches;
+	TripleExchange<ServoState> _states;
+	HapticDevice* _device;
+	thread _thread;
+	atomic<bool> _running;
+	atomic<bool> _realtime;
+	atomic<double> _measuredRate, _jitter, _worstLate;
+
+	void Loop();
+	bool RaisePriority();
+	static Vec3d ContactForce(const HapticPatch& patch, const Vec3d& p);
+	static Vec3d ReactionForce(const HapticPatch& patch, const Vec3d& springAtStep, const Vec3d& p);
+	static Vec3d CouplingForce(const HapticPatch& patch, const Vec3d& p, const Vec3d& v, double age);
+};
+
+HapticServo::HapticServo()
+{
+	rate = 1000.0;
+	_device = NULL;
+	_running = false;
+	_realtime = false;
+	_measuredRate = _jitter = _worstLate = 0.0;
+}
+bool HapticServo::Start(HapticDevice* device, double hz)
+{
+	if (_running || device == NULL) return false;
+	_device = device;
+	rate = hz;
+	_running = true;
+	_thread = thread(&HapticServo::Loop, this);
+	return true;
+}
+void HapticServo::Stop()
+{
+	if (!_running) return;
+	_running = false;
+	_thread.join();
+}
+// The newest tick, if there has been one
+bool HapticServo::Latest(ServoState& state)
+{
+	_states.Acquire();
+	if (_states.Front().tick == 0) return false;
+	state = _states.Front();
+	return true;
+}
+// Real time scheduling if the OS lets us have it (on Linux that takes CAP_SYS_NICE or an rtprio limit)
+bool HapticServo::RaisePriority()
+{
+#ifdef _WIN32
+	return SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL) != 0;
+#else
+	sched_param param;
+	param.sched_priority = sched_get_priority_max(SCHED_FIFO) - 1;
+	return pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0;
+#endif
+}
+// Penalty springs against the patch spheres and the walls, the same springs the simulation uses
+Vec3d HapticServo::ContactForce(const HapticPatch& patch, const Vec3d& p)
+{
+	Vec3d force(0.0, 0.0, 0.0);
+	if (patch.step == 0) return force; // nothing published yet
+	for (int w = 0; w < 6; w++)
+	{
+		double dist = dot(p - patch.walls[w].p, patch.walls[w].N) - patch.proxyRadius;
+		if (dist < 0.0) force += patch.walls[w].N * (-dist * patch.walls[w].K);
+	}
+	for (unsigned int i = 0; i < patch.spheres.size(); i++)
+	{
+		const HapticPatch::Neighbor& s = patch.spheres[i];
+		Vec3d N = p - s.p;
+		double len = length(N);
+		double dist = len - patch.proxyRadius - s.r;
+		if (dist >= 0.0 || len == 0.0) continue;
+		force += N * (-dist * 0.5 * (patch.proxyK + s.K) / len);
+	}
+	return force;
+}
+// The step's reaction moved on from proxyAt to p, taking springAtStep = ContactForce(patch, proxyAt)
+Vec3d HapticServo::ReactionForce(const HapticPatch& patch, const Vec3d& springAtStep, const Vec3d& p)
+{
+	if (patch.step == 0) return Vec3d(0.0, 0.0, 0.0);
+	return patch.reactionForce + ContactForce(patch, p) - springAtStep;
+}
+// The coupling spring and damper, with the proxy carried on at its last velocity for the age
+// of the patch (it only moves once a step, and the handle would feel it lag otherwise)
+Vec3d HapticServo::CouplingForce(const HapticPatch& patch, const Vec3d& p, const Vec3d& v, double age)
+{
+	Vec3d proxy = patch.proxyAt + patch.proxyVelocity * age;
+	return (proxy - p) * patch.couplingK + (patch.proxyVelocity - v) * patch.couplingC;
+}
+void HapticServo::Loop()
+{
+	typedef chrono::steady_clock clock;
+	_realtime = RaisePriority();
+	clock::duration period = chrono::duration_cast<clock::duration>(chrono::duration<double>(1.0 / rate));
+	clock::time_point next = clock::now(), last = next, windowStart = next;
+	Vec3d lastPosition = _device->ReadPosition();
+	Vec3d springAtStep(0.0, 0.0, 0.0);
+	clock::time_point patchTime = next;
+	unsigned long long tick = 0;
+	// period statistics over the current one second window
+	int count = 0;
+	double sum = 0, sumSquares = 0, late = 0;
+	while (_running)
+	{
+		next += period;
+		this_thread::sleep_until(next);
+		clock::time_point now = clock::now();
+		double behind = chrono::duration<double, micro>(now - next).count();
+		if (behind > late) late = behind;
+		if (now - next > 10 * period) next = now; // a long stall: start again from here
+		double elapsed = chrono::duration<double>(now - last).count();
+		last = now;
+
+		Vec3d position = _device->ReadPosition();
+		Vec3d velocity = elapsed > 0.0 ? (position - lastPosition) / elapsed : Vec3d(0.0, 0.0, 0.0);
+		lastPosition = position;
+		bool fresh = _patches.Acquire();
+		const HapticPatch& patch = _patches.Front();
+		if (fresh)
+		{
+			springAtStep = ContactForce(patch, patch.proxyAt);
+			patchTime = now;
+		}
+		Vec3d force = patch.coupled ? CouplingForce(patch, position, velocity, chrono::duration<double>(now - patchTime).count())
+			: ReactionForce(patch, springAtStep, position);
+		_device->WriteForce(force, patch.reactionTorque);
+
+		ServoState& state = _states.Back();
+		state.position = position;
+		state.velocity = velocity;
+		state.force = force;
+		state.torque = patch.reactionTorque;
+		state.tick = ++tick;
+		_states.Publish();
+
+		count++;
+		sum += elapsed * 1e6;
+		sumSquares += elapsed * elapsed * 1e12;
+		if (now - windowStart >= chrono::seconds(1))
+		{
+			double mean = sum / count;
+			_measuredRate = count / chrono::duration<double>(now - windowStart).count();
+			_jitter = sqrt(max(0.0, sumSquares / count - mean * mean));
+			_worstLate = late;
+			windowStart = now;
+			count = 0;
+			sum = sumSquares = late = 0;
+		}
+	}
+	_device->WriteForce(Vec3d(0.0, 0.0, 0.0), Vec3d(0.0, 0.0, 0.0)); // let go
+}
+HapticServo::~HapticServo()
+{
+	Stop();
+}
+
+#endif _HAPTICSERVO_H_
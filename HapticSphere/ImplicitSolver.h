@@ -0,0 +1,287 @@
+#ifndef _IMPLICITSOLVER_H_
+#define _IMPLICITSOLVER_H_
+#include <vector>
+#include <math.h>
+#include "objects.h"
+#include "TaskScheduler.h"
+using namespace std;
+
+// Linearly implicit (backward Euler) integration, for timesteps well past what the explicit
+// integrators take with stiff contact springs. Each step solves
+//     (M + dt C + dt^2 K) dv = dt (f - dt K v)
+// where K and C are the contact and wall stiffness and damping linearized about the current
+// positions, then sets v += dv and p += dt v.
+// Each sphere's row is assembled by the task that computed its forces, as a diagonal 3x3
+// block and one 3x3 block per touching sphere. The system is solved with conjugate gradient
+// (Jacobi preconditioned) straight off those blocks, the vector work split into fixed blocks
+// of spheres on the task scheduler. The blocks don't depend on the thread count, so neither
+// does the order the dot products are summed in.
+class ImplicitSolver
+{
+public:
+	//properties
+	int maxIterations;
+	double tolerance; // on the residual, relative to the right hand side
+	int iterations; // what the last step took
+	//members
+	ImplicitSolver();
+	void Begin(int count);
+	void AssembleRow(int i, vector<sphere>& spheres, sphere* const* neighbors, int count, plane walls[6], double drag,
+		double dampingRatio, double shearStiffness, double deltat);
+	void Solve(vector<sphere>& spheres, double deltat, TaskScheduler& scheduler);
+	~ImplicitSolver();
+
+private:
+	static const int BLOCK = 256; // spheres per task in the solver's vector work
+	struct Sym // symmetric 3x3
+	{
+		double xx, xy, xz, yy, yz, zz;
+		void Clear() { xx = xy = xz = yy = yz = zz = 0.0; }
+		// a on the direction n (unit) and b across it
+		void Add(const Vec3d& n, double a, double b)
+		{
+			double d = a - b;
+			xx += b + d * n[0] * n[0]; xy += d * n[0] * n[1]; xz += d * n[0] * n[2];
+			yy += b + d * n[1] * n[1]; yz += d * n[1] * n[2];
+			zz += b + d * n[2] * n[2];
+		}
+		Vec3d operator*(const Vec3d& v) const
+		{
+			return Vec3d(xx * v[0] + xy * v[1] + xz * v[2], xy * v[0] + yy * v[1] + yz * v[2], xz * v[0] + yz * v[1] + zz * v[2]);
+		}
+	};
+	struct Block
+	{
+		int j;
+		Sym a; // row i gets -a * x[j]
+	};
+	vector< vector<Block> > _rows;
+	vector<Sym> _diag;
+	vector<Vec3d> _b, _x, _r, _z, _p, _q;
+	int _count;
+	// scalars the solver tasks read, set between runs
+	double _alpha, _beta;
+	double _deltat;
+	vector<double> _dot0, _dot1; // per block partial sums
+	vector<sphere>* _spheres;
+	TaskGraph _start, _direction, _update, _integrate;
+	int _blocks; // what the graphs were built for
+
+	void BuildGraphs(int blocks);
+	void Range(int b, int& first, int& last);
+	double Sum(const vector<double>& partial);
+	void Start(int b);
+	void MultiplyDirection(int b);
+	void Update(int b);
+	void Integrate(int b);
+};
+
+ImplicitSolver::ImplicitSolver()
+{
+	maxIterations = 100;
+	tolerance = 1e-6;
+	iterations = 0;
+	_count = 0;
+	_alpha = _beta = _deltat = 0;
+	_spheres = NULL;
+	_blocks = -1;
+}
+// Makes room for count rows. Between steps only.
+void ImplicitSolver::Begin(int count)
+{
+	_count = count;
+	if ((int)_rows.size() < count) _rows.resize(count);
+	if ((int)_diag.size() < count)
+	{
+		_diag.resize(count);
+		_b.resize(count);
+		_x.resize(count);
+		_r.resize(count);
+		_z.resize(count);
+		_p.resize(count);
+		_q.resize(count);
+	}
+}
+// Row i of the system and its right hand side, from the spheres i might touch (all of them if
+// neighbors is NULL). Needs sphere i's force for this step already worked out. Fixed spheres
+// don't move, so they get an identity row and aren't coupled to anything.
+void ImplicitSolver::AssembleRow(int i, vector<sphere>& spheres, sphere* const* neighbors, int count, plane walls[6], double drag,
+	double dampingRatio, double shearStiffness, double deltat)
+{
+	sphere& s = spheres[i];
+	vector<Block>& row = _rows[i];
+	Sym& diag = _diag[i];
+	row.clear();
+	diag.Clear();
+	if (s.fixed)
+	{
+		diag.xx = diag.yy = diag.zz = 1.0;
+		_b[i].set(0.0, 0.0, 0.0);
+		return;
+	}
+	double dt2 = deltat * deltat;
+	diag.Add(Vec3d(1.0, 0.0, 0.0), s.mass + deltat * drag, s.mass + deltat * drag);
+	Vec3d Kv(0.0, 0.0, 0.0); // -K v: how fast the spring forces are changing along the current velocity
+	for (int w = 0; w < 6; w++)
+	{
+		if (s.distSpherePlane(walls[w]) >= 0.0 || walls[w].K == 0.0) continue;
+		double c = 2.0 * dampingRatio * sqrt(s.mass * walls[w].K);
+		diag.Add(walls[w].N, dt2 * walls[w].K + deltat * c, 0.0);
+		Kv -= walls[w].N * (walls[w].K * dot(walls[w].N, s.v));
+	}
+	if (neighbors == NULL) count = spheres.size();
+	for (int k = 0; k < count; k++)
+	{
+		const sphere& o = neighbors == NULL ? spheres[k] : *neighbors[k];
+		if (&o == &s) continue;
+		Vec3d N = s.p - o.p;
+		double len = length(N);
+		if (len >= s.r + o.r || len == 0.0) continue;
+		N /= len;
+		double kN = 0.5 * (s.K + o.K), kT = shearStiffness * kN;
+		double c = 2.0 * dampingRatio * sqrt(kN * s.mass * o.mass / (s.mass + o.mass));
+		Sym stiffness;
+		stiffness.Clear();
+		stiffness.Add(N, kN, kT);
+		Kv -= stiffness * (s.v - o.v);
+		Block block;
+		block.j = &o - &spheres[0];
+		block.a.Clear();
+		block.a.Add(N, dt2 * kN + deltat * c, dt2 * kT);
+		diag.Add(N, dt2 * kN + deltat * c, dt2 * kT);
+		if (!o.fixed) row.push_back(block);
+	}
+	_b[i] = (s.f + Kv * deltat) * deltat;
+}
+
+void ImplicitSolver::Range(int b, int& first, int& last)
+{
+	first = b * BLOCK;
+	last = min(_count, first + BLOCK);
+}
+double ImplicitSolver::Sum(const vector<double>& partial)
+{
+	double sum = 0;
+	for (int b = 0; b < _blocks; b++) sum += partial[b];
+	return sum;
+}
+// x = 0, r = b, z = r preconditioned, p = 0
+void ImplicitSolver::Start(int b)
+{
+	int first, last;
+	Range(b, first, last);
+	double rz = 0, rr = 0;
+	for (int i = first; i < last; i++)
+	{
+		_x[i].set(0.0, 0.0, 0.0);
+		_p[i].set(0.0, 0.0, 0.0);
+		_r[i] = _b[i];
+		_z[i].set(_r[i][0] / _diag[i].xx, _r[i][1] / _diag[i].yy, _r[i][2] / _diag[i].zz);
+		rz += dot(_r[i], _z[i]);
+		rr += dot(_r[i], _r[i]);
+	}
+	_dot0[b] = rz;
+	_dot1[b] = rr;
+}
+// q = A p, with p already moved on for this iteration by every block
+void ImplicitSolver::MultiplyDirection(int b)
+{
+	int first, last;
+	Range(b, first, last);
+	double pq = 0;
+	for (int i = first; i < last; i++)
+	{
+		Vec3d q = _diag[i] * _p[i];
+		const vector<Block>& row = _rows[i];
+		for (unsigned int k = 0; k < row.size(); k++)
+			q -= row[k].a * _p[row[k].j];
+		_q[i] = q;
+		pq += dot(_p[i], q);
+	}
+	_dot0[b] = pq;
+}
+// x += alpha p, r -= alpha q, z = r preconditioned
+void ImplicitSolver::Update(int b)
+{
+	int first, last;
+	Range(b, first, last);
+	double rz = 0, rr = 0;
+	for (int i = first; i < last; i++)
+	{
+		_x[i] += _p[i] * _alpha;
+		_r[i] -= _q[i] * _alpha;
+		_z[i].set(_r[i][0] / _diag[i].xx, _r[i][1] / _diag[i].yy, _r[i][2] / _diag[i].zz);
+		rz += dot(_r[i], _z[i]);
+		rr += dot(_r[i], _r[i]);
+	}
+	_dot0[b] = rz;
+	_dot1[b] = rr;
+}
+void ImplicitSolver::Integrate(int b)
+{
+	int first, last;
+	Range(b, first, last);
+	vector<sphere>& spheres = *_spheres;
+	for (int i = first; i < last; i++)
+	{
+		if (spheres[i].fixed) continue;
+		spheres[i].v += _x[i];
+		spheres[i].p += spheres[i].v * _deltat;
+	}
+}
+void ImplicitSolver::BuildGraphs(int blocks)
+{
+	_blocks = blocks;
+	_dot0.resize(blocks);
+	_dot1.resize(blocks);
+	_start.Clear();
+	_direction.Clear();
+	_update.Clear();
+	_integrate.Clear();
+	// p = z + beta p has to be finished everywhere before any row reads its neighbors' p
+	int moved = _direction.Add([]{});
+	for (int b = 0; b < blocks; b++)
+	{
+		_start.Add([=]{ Start(b); });
+		_direction.Precede(_direction.Add([=]{
+			int first, last;
+			Range(b, first, last);
+			for (int i = first; i < last; i++)
+				_p[i] = _z[i] + _p[i] * _beta;
+		}), moved);
+		_direction.Precede(moved, _direction.Add([=]{ MultiplyDirection(b); }));
+		_update.Add([=]{ Update(b); });
+		_integrate.Add([=]{ Integrate(b); });
+	}
+}
+// Solves for this step's velocity change and moves the spheres with it
+void ImplicitSolver::Solve(vector<sphere>& spheres, double deltat, TaskScheduler& scheduler)
+{
+	_spheres = &spheres;
+	_deltat = deltat;
+	int blocks = (_count + BLOCK - 1) / BLOCK;
+	if (blocks == 0) return;
+	if (blocks != _blocks) BuildGraphs(blocks);
+
+	scheduler.Run(_start);
+	double rz = Sum(_dot0), bb = Sum(_dot1);
+	double goal = tolerance * tolerance * bb;
+	_beta = 0;
+	for (iterations = 0; iterations < maxIterations && Sum(_dot1) > goal; iterations++)
+	{
+		scheduler.Run(_direction);
+		double pq = Sum(_dot0);
+		if (pq <= 0.0) break;
+		_alpha = rz / pq;
+		scheduler.Run(_update);
+		double next = Sum(_dot0);
+		_beta = next / rz;
+		rz = next;
+	}
+	scheduler.Run(_integrate);
+}
+ImplicitSolver::~ImplicitSolver()
+{
+}
+
+#endif _IMPLICITSOLVER_H_
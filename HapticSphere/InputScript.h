@@ -0,0 +1,267 @@
+#ifndef _INPUTSCRIPT_H_
+#define _INPUTSCRIPT_H_
+#include <vector>
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <gmtl/gmtl.h>
+#include <gmtl/ParametricCurve.h>
+using namespace std;
+using namespace gmtl;
+
+// What the user did to the simulation, stamped with the step it was done before, so a session
+// at the keyboard can be played back exactly: the same keys before the same steps, from the same
+// start (the sphere count, time step and random seed are kept too). Stamping with steps rather
+// than seconds is what makes it exact; the seconds are kept only to read it by.
+// Keys are stored as they came in; proxy events are where the servo put the proxy each step.
+class InputRecording
+{
+public:
+	enum Kind { KEY, SPECIAL, PROXY };
+	struct Event
+	{
+		unsigned int step;
+		double seconds;
+		int kind, key;
+		Vec3d p, v; // PROXY
+	};
+	//properties
+	unsigned int seed;
+	int spheres;
+	double deltat;
+	//members
+	InputRecording();
+	void Record(unsigned int step, double seconds, int kind, int key);
+	void RecordProxy(unsigned int step, double seconds, const Vec3d& p, const Vec3d& v);
+	bool Save(const char* file);
+	bool Load(const char* file);
+	bool Playing() { return _playing; }
+	bool Next(unsigned int step, Event& e); // the next event due before step, if there is one
+	void Rewind() { _next = 0; }
+	int Count() { return _events.size(); }
+	~InputRecording();
+
+private:
+	vector<Event> _events;
+	unsigned int _next;
+	bool _playing;
+};
+
+InputRecording::InputRecording()
+{
+	seed = 1;
+	spheres = 0;
+	deltat = 0;
+	_next = 0;
+	_playing = false;
+}
+void InputRecording::Record(unsigned int step, double seconds, int kind, int key)
+{
+	Event e;
+	e.step = step;
+	e.seconds = seconds;
+	e.kind = kind;
+	e.key = key;
+	e.p.set(0.0, 0.0, 0.0);
+	e.v.set(0.0, 0.0, 0.0);
+	_events.push_back(e);
+}
+void InputRecording::RecordProxy(unsigned int step, double seconds, const Vec3d& p, const Vec3d& v)
+{
+	Record(step, seconds, PROXY, 0);
+	_events.back().p = p;
+	_events.back().v = v;
+}
+// One event a line: "step seconds key k", "step seconds special k" or "step seconds proxy x y z vx vy vz"
+bool InputRecording::Save(const char* file)
+{
+	FILE* out = fopen(file, "w");
+	if (out == NULL) return false;
+	fprintf(out, "input %u %d %.17g\n", seed, spheres, deltat);
+	for (unsigned int i = 0; i < _events.size(); i++)
+	{
+		const Event& e = _events[i];
+		if (e.kind == PROXY)
+			fprintf(out, "%u %.3f proxy %.17g %.17g %.17g %.17g %.17g %.17g\n", e.step, e.seconds, e.p[0], e.p[1], e.p[2], e.v[0], e.v[1], e.v[2]);
+		else fprintf(out, "%u %.3f %s %d\n", e.step, e.seconds, e.kind == KEY ? "key" : "special", e.key);
+	}
+	return fclose(out) == 0;
+}
+bool InputRecording::Load(const char* file)
+{
+	FILE* in = fopen(file, "r");
+	if (in == NULL) return false;
+	char line[512], kind[16];
+	bool ok = fgets(line, sizeof(line), in) != NULL && sscanf(line, "input %u %d %lf", &seed, &spheres, &deltat) == 3;
+	_events.clear();
+	while (ok && fgets(line, sizeof(line), in) != NULL)
+	{
+		Event e;
+		int read = sscanf(line, "%u %lf %15s %d", &e.step, &e.seconds, kind, &e.key);
+		if (read < 3) continue;
+		if (strcmp(kind, "proxy") == 0)
+		{
+			double x, y, z, vx, vy, vz;
+			if (sscanf(line, "%*u %*f %*s %lf %lf %lf %lf %lf %lf", &x, &y, &z, &vx, &vy, &vz) != 6) continue;
+			RecordProxy(e.step, e.seconds, Vec3d(x, y, z), Vec3d(vx, vy, vz));
+		}
+		else if (read == 4) Record(e.step, e.seconds, strcmp(kind, "key") == 0 ? KEY : SPECIAL, e.key);
+	}
+	fclose(in);
+	_next = 0;
+	_playing = ok;
+	return ok;
+}
+bool InputRecording::Next(unsigned int step, Event& e)
+{
+	if (!_playing || _next >= _events.size() || _events[_next].step > step) return false;
+	e = _events[_next++];
+	return true;
+}
+InputRecording::~InputRecording()
+{
+}
+
+// Paths for the proxy to follow, made of gmtl curves each taking a range of steps:
+//     linear FROM TO p0 p1
+//     quadratic FROM TO p0 p1 p2                          (Bezier)
+//     cubic bezier|catmullrom|hermite|bspline FROM TO p0 p1 p2 p3
+// a line each, points as "x y z". Between the steps of consecutive segments the proxy is left
+// where it is. Hermite takes the two ends and then the two end tangents.
+class ProxyPath
+{
+public:
+	//members
+	ProxyPath();
+	bool Load(const char* file);
+	void AddLinear(unsigned int from, unsigned int to, const Vec3d p[2]);
+	void AddQuadratic(unsigned int from, unsigned int to, const Vec3d p[3]);
+	void AddCubic(unsigned int from, unsigned int to, const char* basis, const Vec3d p[4]);
+	bool At(unsigned int step, double deltat, Vec3d& p, Vec3d& v); // false if no segment has step
+	int Count() { return _segments.size(); }
+	unsigned int End(); // the last step any segment has
+	~ProxyPath();
+
+private:
+	struct Segment
+	{
+		unsigned int from, to;
+		int order;
+		LinearCurve<double, 3> linear;
+		QuadraticCurve<double, 3> quadratic;
+		CubicCurve<double, 3> cubic;
+	};
+	vector<Segment> _segments;
+	unsigned int _current;
+};
+
+ProxyPath::ProxyPath()
+{
+	_current = 0;
+}
+bool ProxyPath::Load(const char* file)
+{
+	FILE* in = fopen(file, "r");
+	if (in == NULL) return false;
+	char line[512], kind[16], basis[16];
+	_segments.clear();
+	while (fgets(line, sizeof(line), in) != NULL)
+	{
+		unsigned int from, to;
+		double c[12];
+		if (sscanf(line, "%15s", kind) != 1 || kind[0] == '#') continue;
+		if (strcmp(kind, "linear") == 0 && sscanf(line, "%*s %u %u %lf %lf %lf %lf %lf %lf", &from, &to,
+			&c[0], &c[1], &c[2], &c[3], &c[4], &c[5]) == 8)
+		{
+			Vec3d p[2] = { Vec3d(c[0], c[1], c[2]), Vec3d(c[3], c[4], c[5]) };
+			AddLinear(from, to, p);
+		}
+		else if (strcmp(kind, "quadratic") == 0 && sscanf(line, "%*s %u %u %lf %lf %lf %lf %lf %lf %lf %lf %lf", &from, &to,
+			&c[0], &c[1], &c[2], &c[3], &c[4], &c[5], &c[6], &c[7], &c[8]) == 11)
+		{
+			Vec3d p[3] = { Vec3d(c[0], c[1], c[2]), Vec3d(c[3], c[4], c[5]), Vec3d(c[6], c[7], c[8]) };
+			AddQuadratic(from, to, p);
+		}
+		else if (strcmp(kind, "cubic") == 0 && sscanf(line, "%*s %15s %u %u %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf", basis, &from, &to,
+			&c[0], &c[1], &c[2], &c[3], &c[4], &c[5], &c[6], &c[7], &c[8], &c[9], &c[10], &c[11]) == 15)
+		{
+			Vec3d p[4] = { Vec3d(c[0], c[1], c[2]), Vec3d(c[3], c[4], c[5]), Vec3d(c[6], c[7], c[8]), Vec3d(c[9], c[10], c[11]) };
+			AddCubic(from, to, basis, p);
+		}
+		else cout << "Skipped path line: " << line;
+	}
+	fclose(in);
+	_current = 0;
+	return !_segments.empty();
+}
+void ProxyPath::AddLinear(unsigned int from, unsigned int to, const Vec3d p[2])
+{
+	Segment s;
+	s.from = from;
+	s.to = to;
+	s.order = 2;
+	s.linear.makeLerp();
+	s.linear.setControlPoints(p);
+	_segments.push_back(s);
+}
+void ProxyPath::AddQuadratic(unsigned int from, unsigned int to, const Vec3d p[3])
+{
+	Segment s;
+	s.from = from;
+	s.to = to;
+	s.order = 3;
+	s.quadratic.makeBezier();
+	s.quadratic.setControlPoints(p);
+	_segments.push_back(s);
+}
+void ProxyPath::AddCubic(unsigned int from, unsigned int to, const char* basis, const Vec3d p[4])
+{
+	Segment s;
+	s.from = from;
+	s.to = to;
+	s.order = 4;
+	if (strcmp(basis, "catmullrom") == 0) s.cubic.makeCatmullRom();
+	else if (strcmp(basis, "hermite") == 0) s.cubic.makeHermite();
+	else if (strcmp(basis, "bspline") == 0) s.cubic.makeBspline();
+	else s.cubic.makeBezier();
+	s.cubic.setControlPoints(p);
+	_segments.push_back(s);
+}
+// Where the path has the proxy at step, and how fast it is going there
+bool ProxyPath::At(unsigned int step, double deltat, Vec3d& p, Vec3d& v)
+{
+	if (_current >= _segments.size() || step < _segments[_current].from) _current = 0;
+	while (_current < _segments.size() && step > _segments[_current].to) _current++;
+	if (_current >= _segments.size() || step < _segments[_current].from) return false;
+	const Segment& s = _segments[_current];
+	double span = s.to > s.from ? (double)(s.to - s.from) : 1.0;
+	double u = s.to > s.from ? (step - s.from) / span : 1.0;
+	switch (s.order)
+	{
+	case 2:
+		p = s.linear.getInterpolatedValue(u);
+		v = s.linear.getInterpolatedDerivative(u);
+		break;
+	case 3:
+		p = s.quadratic.getInterpolatedValue(u);
+		v = s.quadratic.getInterpolatedDerivative(u);
+		break;
+	default:
+		p = s.cubic.getInterpolatedValue(u);
+		v = s.cubic.getInterpolatedDerivative(u);
+	}
+	v /= span * deltat;
+	return true;
+}
+unsigned int ProxyPath::End()
+{
+	unsigned int end = 0;
+	for (unsigned int i = 0; i < _segments.size(); i++)
+		if (_segments[i].to > end) end = _segments[i].to;
+	return end;
+}
+ProxyPath::~ProxyPath()
+{
+}
+
+#endif _INPUTSCRIPT_H_
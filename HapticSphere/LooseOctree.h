@@ -0,0 +1,422 @@
+#ifndef _LOOSEOCTREE_H_
+#define _LOOSEOCTREE_H_
+#include <vector>
+#include <algorithm>
+#include <math.h>
+#include "objects.h"
+#include "Grid.h"
+using namespace std;
+
+// A loose octree over the sphere centers, for scenes where the spheres pile up in a few places
+// and leave the rest of the box empty: a node is only split while it holds more than leafSize
+// spheres, so the tree is deep where the spheres are packed and a single leaf where they are
+// sparse. Each sphere is kept in the deepest node whose cell is at least twice its diameter
+// (or higher up, in a leaf), and each node knows the biggest radius below it, so its bounds are
+// its cell grown by that much and nothing ever has to be stored twice.
+// The root cube is fitted to the centers every build. Building goes by Morton codes: the codes
+// are worked out in blocks, bucketed by their top bits into one subtree per node TOP_DEPTH down,
+// and each subtree is sorted and linked by a task of its own. Spheres too big for a subtree
+// (none, unless they are a quarter of the whole pile across) are kept in a list of their own.
+class LooseOctree
+{
+public:
+	//properties
+	static const int MAX_DEPTH = 10; // 10 bits a coordinate, 30 bit codes
+	static const int TOP_DEPTH = 2;
+	static const int SUBTREES = 1 << (3 * TOP_DEPTH);
+	int leafSize;
+	//members
+	LooseOctree();
+	void Build(vector<sphere>& spheres); // all of it, on this thread
+	// Build in pieces, so the step can run them as separate tasks
+	void Blocks(int blocks);
+	void Resize(int count); // between steps
+	void Bounds(vector<sphere>& spheres, int block);
+	void Root();
+	void Codes(vector<sphere>& spheres, int block);
+	void Offsets();
+	void Scatter(int block);
+	void BuildSubtree(vector<sphere>& spheres, int k);
+	int Count() { return _count; }
+	const int* Order() { return _order.data(); } // sphere indices, subtree by subtree in Morton order
+	template <class Enter, class Visit> void Traverse(Enter enter, Visit visit); // enter(lo, hi) for each node's bounds, visit(i)
+	template <class List> void GatherNeighbors(int i, vector<sphere>& spheres, List& neighbors, bool sorted = true);
+	void Occupancy(int histogram[Grid::OCCUPANCY_BUCKETS], int& entries, int& maxPerNode);
+	int NumNodes();
+	int NumOccupiedNodes();
+	int Depth(); // of the deepest node
+	~LooseOctree();
+
+private:
+	struct Node
+	{
+		double lo[3];
+		int depth;
+		double maxR; // biggest radius in the subtree: how far its spheres can reach out of the cell
+		int start, count; // its own spheres, in the subtree's items
+		int child[8]; // -1 for none
+	};
+	struct Subtree
+	{
+		vector<Node> nodes; // depth first, the root first
+		vector<int> items;
+		int occupied, maxCount, deepest;
+		int histogram[Grid::OCCUPANCY_BUCKETS];
+	};
+	Subtree _trees[SUBTREES];
+	double _lo[3], _size; // the root cube
+	double _topR; // biggest radius on the top list
+	int _count, _blocks;
+	vector<unsigned long long> _sphereKeys; // code, depth and index of each sphere
+	vector<unsigned long long> _keys; // grouped by subtree (the top list last), sorted within each
+	vector<int> _order;
+	vector<double> _blockBounds; // 6 per block
+	vector<int> _blockCounts; // SUBTREES + 1 per block, then where each block's spheres go
+	int _subtreeStart[SUBTREES + 2];
+
+	static unsigned int Spread(unsigned int v);
+	static unsigned int CodeOf(unsigned long long key) { return (unsigned int)(key >> 34); }
+	static int DepthOf(unsigned long long key) { return (int)(key >> 30) & 15; }
+	static int IndexOf(unsigned long long key) { return (int)(key & 0x3fffffffu); }
+	void BlockRange(int block, int& first, int& last) { first = _count * block / _blocks; last = _count * (block + 1) / _blocks; }
+	int Link(Subtree& tree, vector<sphere>& spheres, int a, int b, int depth, const double lo[3]);
+};
+
+LooseOctree::LooseOctree()
+{
+	leafSize = 8;
+	_lo[0] = _lo[1] = _lo[2] = 0.0;
+	_size = 1.0;
+	_topR = 0.0;
+	_count = 0;
+	_blocks = 0;
+	fill(_subtreeStart, _subtreeStart + SUBTREES + 2, 0);
+	for (int k = 0; k < SUBTREES; k++)
+	{
+		_trees[k].occupied = _trees[k].maxCount = _trees[k].deepest = 0;
+		fill(_trees[k].histogram, _trees[k].histogram + Grid::OCCUPANCY_BUCKETS, 0);
+	}
+}
+void LooseOctree::Build(vector<sphere>& spheres)
+{
+	Blocks(1);
+	Resize(spheres.size());
+	Bounds(spheres, 0);
+	Root();
+	Codes(spheres, 0);
+	Offsets();
+	Scatter(0);
+	for (int k = 0; k <= SUBTREES; k++)
+		BuildSubtree(spheres, k);
+}
+void LooseOctree::Blocks(int blocks)
+{
+	_blocks = blocks;
+	_blockBounds.resize(6 * blocks);
+	_blockCounts.resize((SUBTREES + 1) * blocks);
+}
+void LooseOctree::Resize(int count)
+{
+	_count = count;
+	_sphereKeys.resize(count);
+	_keys.resize(count);
+	_order.resize(count);
+}
+// The box around the centers of a block of the spheres
+void LooseOctree::Bounds(vector<sphere>& spheres, int block)
+{
+	int first, last;
+	BlockRange(block, first, last);
+	double* bounds = &_blockBounds[6 * block];
+	for (int a = 0; a < 3; a++)
+	{
+		bounds[a] = 1e300;
+		bounds[3 + a] = -1e300;
+	}
+	for (int i = first; i < last; i++)
+		for (int a = 0; a < 3; a++)
+		{
+			bounds[a] = min(bounds[a], spheres[i].p[a]);
+			bounds[3 + a] = max(bounds[3 + a], spheres[i].p[a]);
+		}
+}
+// The root cube, around every block's box
+void LooseOctree::Root()
+{
+	double lo[3] = { 1e300, 1e300, 1e300 }, hi[3] = { -1e300, -1e300, -1e300 };
+	for (int b = 0; b < _blocks; b++)
+		for (int a = 0; a < 3; a++)
+		{
+			lo[a] = min(lo[a], _blockBounds[6 * b + a]);
+			hi[a] = max(hi[a], _blockBounds[6 * b + 3 + a]);
+		}
+	_size = 0.0;
+	for (int a = 0; a < 3; a++)
+	{
+		_lo[a] = _count > 0 ? lo[a] : 0.0;
+		if (_count > 0) _size = max(_size, hi[a] - lo[a]);
+	}
+	// a little over, so the highest centers still fall inside the last cell
+	_size = _size > 0.0 ? _size * (1.0 + 1e-6) : 1.0;
+}
+// Each sphere's key, and how many of the block's spheres go in each subtree
+void LooseOctree::Codes(vector<sphere>& spheres, int block)
+{
+	int first, last;
+	BlockRange(block, first, last);
+	int* counts = &_blockCounts[(SUBTREES + 1) * block];
+	fill(counts, counts + SUBTREES + 1, 0);
+	const double cells = 1 << MAX_DEPTH;
+	for (int i = first; i < last; i++)
+	{
+		const sphere& s = spheres[i];
+		unsigned int c[3];
+		for (int a = 0; a < 3; a++)
+		{
+			double x = (s.p[a] - _lo[a]) / _size * cells;
+			c[a] = x <= 0.0 ? 0 : x >= cells ? (1 << MAX_DEPTH) - 1 : (unsigned int)x;
+		}
+		unsigned int code = Spread(c[0]) | (Spread(c[1]) << 1) | (Spread(c[2]) << 2);
+		// the deepest node at least twice the sphere's diameter across
+		int depth = 0;
+		for (double side = _size; depth < MAX_DEPTH && s.r <= side / 4.0; side /= 2.0)
+			depth++;
+		_sphereKeys[i] = ((unsigned long long)code << 34) | ((unsigned long long)depth << 30) | (unsigned long long)i;
+		counts[depth < TOP_DEPTH ? SUBTREES : code >> (3 * (MAX_DEPTH - TOP_DEPTH))]++;
+	}
+}
+// Where each subtree's keys start, and where in them each block's go
+void LooseOctree::Offsets()
+{
+	int at = 0;
+	for (int k = 0; k <= SUBTREES; k++)
+	{
+		_subtreeStart[k] = at;
+		for (int b = 0; b < _blocks; b++)
+		{
+			int& count = _blockCounts[(SUBTREES + 1) * b + k];
+			int n = count;
+			count = at;
+			at += n;
+		}
+	}
+	_subtreeStart[SUBTREES + 1] = at;
+}
+void LooseOctree::Scatter(int block)
+{
+	int first, last;
+	BlockRange(block, first, last);
+	int* cursor = &_blockCounts[(SUBTREES + 1) * block];
+	for (int i = first; i < last; i++)
+	{
+		unsigned long long key = _sphereKeys[i];
+		_keys[cursor[DepthOf(key) < TOP_DEPTH ? SUBTREES : CodeOf(key) >> (3 * (MAX_DEPTH - TOP_DEPTH))]++] = key;
+	}
+}
+// Sorts subtree k's keys and links its nodes (k == SUBTREES is the top list, only sorted)
+void LooseOctree::BuildSubtree(vector<sphere>& spheres, int k)
+{
+	int a = _subtreeStart[k], b = _subtreeStart[k + 1];
+	sort(_keys.begin() + a, _keys.begin() + b);
+	for (int n = a; n < b; n++)
+		_order[n] = IndexOf(_keys[n]);
+	if (k == SUBTREES)
+	{
+		_topR = 0.0;
+		for (int n = a; n < b; n++)
+			_topR = max(_topR, spheres[_order[n]].r);
+		return;
+	}
+	Subtree& tree = _trees[k];
+	tree.nodes.clear();
+	tree.items.clear();
+	tree.occupied = tree.maxCount = tree.deepest = 0;
+	fill(tree.histogram, tree.histogram + Grid::OCCUPANCY_BUCKETS, 0);
+	if (a == b) return;
+	// the cell's corner from the top bits of its codes
+	double side = _size / (1 << TOP_DEPTH), lo[3];
+	for (int axis = 0; axis < 3; axis++)
+	{
+		int c = 0;
+		for (int d = 0; d < TOP_DEPTH; d++)
+			c |= ((k >> (3 * d + axis)) & 1) << d;
+		lo[axis] = _lo[axis] + c * side;
+	}
+	Link(tree, spheres, a, b, TOP_DEPTH, lo);
+}
+// Makes the node for keys[a, b), at depth with its cell's corner at lo, and the nodes under it.
+// The range still holds the spheres kept further up (those shallower than depth), skipped here;
+// keeping them there leaves the keys whole, in order, for the force tasks to go by.
+int LooseOctree::Link(Subtree& tree, vector<sphere>& spheres, int a, int b, int depth, const double lo[3])
+{
+	int unclaimed = 0;
+	for (int n = a; n < b; n++)
+		if (DepthOf(_keys[n]) >= depth) unclaimed++;
+	bool leaf = unclaimed <= leafSize || depth == MAX_DEPTH;
+	Node node;
+	for (int axis = 0; axis < 3; axis++)
+		node.lo[axis] = lo[axis];
+	node.depth = depth;
+	node.maxR = 0.0;
+	node.start = tree.items.size();
+	fill(node.child, node.child + 8, -1);
+	for (int n = a; n < b; n++)
+	{
+		int d = DepthOf(_keys[n]);
+		if (d < depth || (d > depth && !leaf)) continue;
+		int i = IndexOf(_keys[n]);
+		tree.items.push_back(i);
+		node.maxR = max(node.maxR, spheres[i].r);
+	}
+	node.count = tree.items.size() - node.start;
+	int index = tree.nodes.size();
+	tree.nodes.push_back(node);
+	if (node.count > 0)
+	{
+		int bucket = 0;
+		while (bucket < Grid::OCCUPANCY_BUCKETS - 1 && (1 << bucket) < node.count) bucket++;
+		tree.histogram[bucket]++;
+		tree.occupied++;
+		tree.maxCount = max(tree.maxCount, node.count);
+	}
+	tree.deepest = max(tree.deepest, depth);
+	if (leaf) return index;
+	// the children's keys are runs of the same next three bits
+	int shift = 3 * (MAX_DEPTH - depth - 1);
+	double half = _size / (1 << (depth + 1));
+	double maxR = node.maxR;
+	for (int n = a; n < b;)
+	{
+		int digit = (CodeOf(_keys[n]) >> shift) & 7;
+		int e = n;
+		bool any = false;
+		for (; e < b && (int)((CodeOf(_keys[e]) >> shift) & 7) == digit; e++)
+			any = any || DepthOf(_keys[e]) > depth;
+		if (any)
+		{
+			double childLo[3];
+			for (int axis = 0; axis < 3; axis++)
+				childLo[axis] = lo[axis] + ((digit >> axis) & 1) * half;
+			int child = Link(tree, spheres, n, e, depth + 1, childLo);
+			tree.nodes[index].child[digit] = child;
+			maxR = max(maxR, tree.nodes[child].maxR);
+		}
+		n = e;
+	}
+	tree.nodes[index].maxR = maxR;
+	return index;
+}
+// Spaces out the low 10 bits of v to every third bit
+unsigned int LooseOctree::Spread(unsigned int v)
+{
+	v &= 0x3ff;
+	v = (v | (v << 16)) & 0x030000ff;
+	v = (v | (v << 8)) & 0x0300f00f;
+	v = (v | (v << 4)) & 0x030c30c3;
+	v = (v | (v << 2)) & 0x09249249;
+	return v;
+}
+// Calls visit(i) for the spheres of every node whose bounds enter(lo, hi) accepts, below nodes it
+// accepted (the top list goes by the root's bounds). enter is asked again for each node, so a
+// search that narrows as it goes (a ray cast) prunes as it goes.
+template <class Enter, class Visit>
+void LooseOctree::Traverse(Enter enter, Visit visit)
+{
+	if (_count == 0) return;
+	int a = _subtreeStart[SUBTREES], b = _subtreeStart[SUBTREES + 1];
+	if (a < b)
+	{
+		Vec3d lo(_lo[0] - _topR, _lo[1] - _topR, _lo[2] - _topR);
+		Vec3d hi(_lo[0] + _size + _topR, _lo[1] + _size + _topR, _lo[2] + _size + _topR);
+		if (enter(lo, hi))
+			for (int n = a; n < b; n++)
+				visit(_order[n]);
+	}
+	int stack[8 * MAX_DEPTH];
+	for (int k = 0; k < SUBTREES; k++)
+	{
+		const Subtree& tree = _trees[k];
+		if (tree.nodes.empty()) continue;
+		int top = 0;
+		stack[top++] = 0;
+		while (top > 0)
+		{
+			const Node& node = tree.nodes[stack[--top]];
+			double side = _size / (1 << node.depth);
+			Vec3d lo(node.lo[0] - node.maxR, node.lo[1] - node.maxR, node.lo[2] - node.maxR);
+			Vec3d hi(node.lo[0] + side + node.maxR, node.lo[1] + side + node.maxR, node.lo[2] + side + node.maxR);
+			if (!enter(lo, hi)) continue;
+			for (int m = 0; m < node.count; m++)
+				visit(tree.items[node.start + m]);
+			for (int c = 0; c < 8; c++)
+				if (node.child[c] >= 0) stack[top++] = node.child[c];
+		}
+	}
+}
+// Every sphere whose box overlaps sphere i's box: all the spheres it could touch. The same as
+// Grid::GatherNeighbors, so the two are interchangeable in the step.
+template <class List>
+void LooseOctree::GatherNeighbors(int i, vector<sphere>& spheres, List& neighbors, bool sorted)
+{
+	neighbors.clear();
+	const sphere& s = spheres[i];
+	Vec3d reach(s.r, s.r, s.r);
+	Vec3d lo = s.p - reach, hi = s.p + reach;
+	Traverse([&](const Vec3d& nodeLo, const Vec3d& nodeHi) {
+		return nodeLo[0] <= hi[0] && nodeHi[0] >= lo[0] && nodeLo[1] <= hi[1] && nodeHi[1] >= lo[1] && nodeLo[2] <= hi[2] && nodeHi[2] >= lo[2];
+	}, [&](int j) {
+		const sphere& other = spheres[j];
+		if (j == i) return;
+		for (int a = 0; a < 3; a++)
+			if (fabs(other.p[a] - s.p[a]) > other.r + s.r) return;
+		neighbors.push_back(&spheres[j]);
+	});
+	if (sorted) sort(neighbors.begin(), neighbors.end());
+}
+// As Grid::Occupancy, with nodes for cells: every sphere is in one node
+void LooseOctree::Occupancy(int histogram[Grid::OCCUPANCY_BUCKETS], int& entries, int& maxPerNode)
+{
+	fill(histogram, histogram + Grid::OCCUPANCY_BUCKETS, 0);
+	entries = _count;
+	maxPerNode = 0;
+	for (int k = 0; k < SUBTREES; k++)
+	{
+		for (int b = 0; b < Grid::OCCUPANCY_BUCKETS; b++)
+			histogram[b] += _trees[k].histogram[b];
+		maxPerNode = max(maxPerNode, _trees[k].maxCount);
+	}
+	int top = _subtreeStart[SUBTREES + 1] - _subtreeStart[SUBTREES];
+	if (top > 0)
+	{
+		int bucket = 0;
+		while (bucket < Grid::OCCUPANCY_BUCKETS - 1 && (1 << bucket) < top) bucket++;
+		histogram[bucket]++;
+		maxPerNode = max(maxPerNode, top);
+	}
+}
+int LooseOctree::NumNodes()
+{
+	int count = 0;
+	for (int k = 0; k < SUBTREES; k++)
+		count += _trees[k].nodes.size();
+	return count;
+}
+int LooseOctree::NumOccupiedNodes()
+{
+	int count = _subtreeStart[SUBTREES + 1] > _subtreeStart[SUBTREES] ? 1 : 0;
+	for (int k = 0; k < SUBTREES; k++)
+		count += _trees[k].occupied;
+	return count;
+}
+int LooseOctree::Depth()
+{
+	int deepest = 0;
+	for (int k = 0; k < SUBTREES; k++)
+		deepest = max(deepest, _trees[k].deepest);
+	return deepest;
+}
+LooseOctree::~LooseOctree()
+{
+}
+
+#endif _LOOSEOCTREE_H_
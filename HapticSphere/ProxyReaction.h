@@ -0,0 +1,84 @@
+#ifndef _PROXYREACTION_H_
+#define _PROXYREACTION_H_
+#include <vector>
+#include <math.h>
+#include "objects.h"
+using namespace std;
+
+// The net contact force and torque on every fixed sphere. Fixed spheres are kinematic proxies:
+// the user moves them and the simulation never does, so their force used to be thrown away.
+// The step's force pass fills it in from the same neighbor gather as every other sphere, so it
+// costs only that sphere's own contacts. After the step, a first order low pass filter takes out
+// the step to step chatter before anything is fed back to the user.
+class ProxyReactions
+{
+public:
+	//properties
+	double cutoff; // Hz
+	//members
+	ProxyReactions();
+	void Begin(int count);
+	void Set(int i, const Vec3d& force, const Vec3d& torque); // from sphere i's force task
+	void Filter(double deltat);
+	void Clear(); // the filters start again from nothing
+	const Vec3d& Force(int i) { return _filteredForce[i]; }
+	const Vec3d& Torque(int i) { return _filteredTorque[i]; }
+	~ProxyReactions();
+
+private:
+	vector<Vec3d> _force, _torque, _filteredForce, _filteredTorque;
+	vector<char> _set; // this step
+	int _count;
+};
+
+ProxyReactions::ProxyReactions()
+{
+	cutoff = 100.0;
+	_count = 0;
+}
+// Makes room for count spheres. Between steps only.
+void ProxyReactions::Begin(int count)
+{
+	if ((int)_force.size() < count)
+	{
+		Vec3d zero(0.0, 0.0, 0.0);
+		_force.resize(count, zero);
+		_torque.resize(count, zero);
+		_filteredForce.resize(count, zero);
+		_filteredTorque.resize(count, zero);
+		_set.resize(count, 0);
+	}
+	_count = count;
+}
+void ProxyReactions::Set(int i, const Vec3d& force, const Vec3d& torque)
+{
+	_force[i] = force;
+	_torque[i] = torque;
+	_set[i] = 1;
+}
+// Runs the filter one step on for the spheres that were Set() this step
+void ProxyReactions::Filter(double deltat)
+{
+	double a = 1.0 - exp(-2.0 * M_PI * cutoff * deltat);
+	for (int i = 0; i < _count; i++)
+	{
+		if (!_set[i]) continue;
+		_set[i] = 0;
+		_filteredForce[i] += (_force[i] - _filteredForce[i]) * a;
+		_filteredTorque[i] += (_torque[i] - _filteredTorque[i]) * a;
+	}
+}
+void ProxyReactions::Clear()
+{
+	_force.clear();
+	_torque.clear();
+	_filteredForce.clear();
+	_filteredTorque.clear();
+	_set.clear();
+	_count = 0;
+}
+ProxyReactions::~ProxyReactions()
+{
+}
+
+#endif _PROXYREACTION_H_
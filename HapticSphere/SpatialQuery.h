@@ -0,0 +1,397 @@
+#ifndef _SPATIALQUERY_H_
+#define _SPATIALQUERY_H_
+#include <vector>
+#include <math.h>
+#include <gmtl/gmtl.h>
+#include <gmtl/AABox.h>
+#include <gmtl/Ray.h>
+#include <gmtl/Sphere.h>
+#include <gmtl/Intersection.h>
+#include "objects.h"
+#include "Grid.h"
+#include "LooseOctree.h"
+using namespace std;
+using namespace gmtl;
+
+// "Which spheres are near here" for code outside the step (the haptic patch, the proxy, picking,
+// analysis). It goes through the grid or the octree when the step built one for the current
+// spheres and scans them otherwise. Results go into buffers the caller owns: a query returns how many it found
+// and writes as many of them as fit, so a caller can size its buffer and ask again. Nothing is
+// allocated and nothing is written but the caller's buffers, so between steps any number of
+// threads can query at once. Going by the grid or the octree, spheres that have moved since it
+// was built can be missed by up to how far they moved.
+class SpatialQuery
+{
+public:
+	//members
+	SpatialQuery();
+	void Attach(Grid* grid, vector<sphere>& spheres); // grid NULL, or not built: scan
+	void AttachOctree(LooseOctree* octree, vector<sphere>& spheres);
+	bool UsesGrid() const;
+	bool UsesOctree() const;
+	// spheres that overlap the ball
+	int Radius(const Vec3d& center, double radius, int* found, int capacity) const;
+	int Radius(const Vec3d& center, double radius, vector<int>& found) const; // grows found to fit
+	// the k spheres whose surfaces are nearest center (gap < 0 is inside), nearest first; skip is left out
+	int Nearest(const Vec3d& center, int k, int* found, double* gap, int skip = -1) const;
+	// spheres that overlap the box
+	int Box(const AABoxd& box, int* found, int capacity) const;
+	// one Radius() for each of count balls: ball q's spheres are found[start[q]] up to found[start[q + 1]]
+	// (start has count + 1 entries). Returns the total, which may be more than capacity.
+	int RadiusBatch(const Vec3d* centers, const double* radii, int count, int* found, int* start, int capacity) const;
+	// the first sphere along the ray no further than maxT (in lengths of the ray's direction), or -1
+	int Raycast(const Rayd& ray, double maxT, double& t, int skip = -1) const;
+	~SpatialQuery();
+
+private:
+	Grid* _grid;
+	LooseOctree* _octree;
+	vector<sphere>* _spheres;
+
+	static void Keep(int i, double gap, int k, int& kept, int* found, double* gaps);
+	static bool Hit(const sphere& s, const Rayd& ray, double& t);
+	bool Overlaps(const sphere& s, const Vec3d& lo, const Vec3d& hi) const;
+	int Scan(const Vec3d& lo, const Vec3d& hi, const Vec3d& center, double radius, bool ball, int* found, int capacity) const;
+	int Cells(const Vec3d& lo, const Vec3d& hi, const Vec3d& center, double radius, bool ball, int* found, int capacity) const;
+	int Nodes(const Vec3d& lo, const Vec3d& hi, const Vec3d& center, double radius, bool ball, int* found, int capacity) const;
+};
+
+SpatialQuery::SpatialQuery()
+{
+	_grid = NULL;
+	_octree = NULL;
+	_spheres = NULL;
+}
+void SpatialQuery::Attach(Grid* grid, vector<sphere>& spheres)
+{
+	_grid = grid;
+	_octree = NULL;
+	_spheres = &spheres;
+}
+void SpatialQuery::AttachOctree(LooseOctree* octree, vector<sphere>& spheres)
+{
+	_grid = NULL;
+	_octree = octree;
+	_spheres = &spheres;
+}
+// Only if every sphere is in the grid, and nothing in it has gone since
+bool SpatialQuery::UsesGrid() const
+{
+	return _grid != NULL && _grid->_ranges.size() == _spheres->size() && !_spheres->empty();
+}
+bool SpatialQuery::UsesOctree() const
+{
+	return _octree != NULL && _octree->Count() == (int)_spheres->size() && !_spheres->empty();
+}
+int SpatialQuery::Radius(const Vec3d& center, double radius, int* found, int capacity) const
+{
+	Vec3d reach(radius, radius, radius);
+	if (UsesGrid()) return Cells(center - reach, center + reach, center, radius, true, found, capacity);
+	if (UsesOctree()) return Nodes(center - reach, center + reach, center, radius, true, found, capacity);
+	return Scan(center - reach, center + reach, center, radius, true, found, capacity);
+}
+int SpatialQuery::Radius(const Vec3d& center, double radius, vector<int>& found) const
+{
+	found.resize(found.capacity());
+	int count = Radius(center, radius, found.empty() ? NULL : &found[0], found.size());
+	if (count > (int)found.size())
+	{
+		found.resize(count);
+		count = Radius(center, radius, &found[0], found.size());
+	}
+	found.resize(count);
+	return count;
+}
+int SpatialQuery::Box(const AABoxd& box, int* found, int capacity) const
+{
+	if (box.isEmpty()) return 0;
+	Vec3d lo(box.getMin()[0], box.getMin()[1], box.getMin()[2]);
+	Vec3d hi(box.getMax()[0], box.getMax()[1], box.getMax()[2]);
+	if (UsesGrid()) return Cells(lo, hi, lo, 0.0, false, found, capacity);
+	if (UsesOctree()) return Nodes(lo, hi, lo, 0.0, false, found, capacity);
+	return Scan(lo, hi, lo, 0.0, false, found, capacity);
+}
+int SpatialQuery::RadiusBatch(const Vec3d* centers, const double* radii, int count, int* found, int* start, int capacity) const
+{
+	int total = 0;
+	for (int q = 0; q < count; q++)
+	{
+		start[q] = total;
+		int room = max(0, capacity - total);
+		total += Radius(centers[q], radii[q], room > 0 ? found + total : NULL, room);
+	}
+	start[count] = total;
+	return total;
+}
+// Adds sphere i to the k nearest so far (kept of them, sorted by gap) if it is nearer than the last
+void SpatialQuery::Keep(int i, double gap, int k, int& kept, int* found, double* gaps)
+{
+	if (kept == k && gap >= gaps[k - 1]) return;
+	int at = kept < k ? kept++ : k - 1;
+	for (; at > 0 && gaps[at - 1] > gap; at--)
+	{
+		found[at] = found[at - 1];
+		gaps[at] = gaps[at - 1];
+	}
+	found[at] = i;
+	gaps[at] = gap;
+}
+// Grows a box of cells out from center's cell a shell at a time. Every sphere whose surface is
+// within d of center overlaps a cell within d of it, so once the kth nearest is nearer than the
+// box's walls nothing outside can beat it. A sphere spanning several cells is taken only in the
+// first cell of the shell it is in, and not at all if it reached into the box before.
+int SpatialQuery::Nearest(const Vec3d& center, int k, int* found, double* gap, int skip) const
+{
+	vector<sphere>& spheres = *_spheres;
+	int kept = 0;
+	if (k <= 0) return 0;
+	if (UsesGrid())
+	{
+		Grid& grid = *_grid;
+		float origin[3] = { grid.wallLeft, grid.wallBottom, grid.wallFront };
+		float width[3] = { grid._cellWidthX, grid._cellWidthY, grid._cellWidthZ };
+		int c[3], unused[3];
+		grid.CellsOverlapping(center, center, c, unused);
+		const Grid::CellRange& bounds = grid._bounds;
+		for (int n = 0; n <= 2 * Grid::N_CELLS; n++)
+		{
+			int lo[3] = { c[0] - n, c[1] - n, c[2] - n }, hi[3] = { c[0] + n, c[1] + n, c[2] + n };
+			for (int x = lo[0]; x <= hi[0]; x++){
+				for (int y = lo[1]; y <= hi[1]; y++){
+					for (int z = lo[2]; z <= hi[2]; z++){
+						bool shell = n == 0 || x == lo[0] || x == hi[0] || y == lo[1] || y == hi[1] || z == lo[2] || z == hi[2];
+						if (!shell) continue;
+						int count;
+						const int* cell = grid.GetSpheresInCell(x, y, z, count);
+						for (int m = 0; m < count; m++)
+						{
+							const Grid::CellRange& range = grid._ranges[cell[m]];
+							bool before = n > 0;
+							for (int a = 0; a < 3 && before; a++)
+								before = range.hi[a] >= lo[a] + 1 && range.lo[a] <= hi[a] - 1;
+							if (before) continue;
+							if (x != max(range.lo[0], lo[0]) || y != max(range.lo[1], lo[1]) || z != max(range.lo[2], lo[2])) continue;
+							if (cell[m] == skip) continue;
+							const sphere& s = spheres[cell[m]];
+							Keep(cell[m], length(Vec3d(s.p - center)) - s.r, k, kept, found, gap);
+						}
+					}
+				}
+			}
+			// how far the box's walls are from center
+			double clear = 1e300;
+			bool all = true;
+			for (int a = 0; a < 3; a++)
+			{
+				clear = min(clear, min(center[a] - (origin[a] + lo[a] * width[a]), origin[a] + (hi[a] + 1) * width[a] - center[a]));
+				all = all && lo[a] <= bounds.lo[a] && hi[a] >= bounds.hi[a];
+			}
+			if (all || (kept == k && gap[k - 1] <= clear)) return kept;
+		}
+		kept = 0; // a long way from anything: start again, the slow way
+	}
+	else if (UsesOctree())
+	{
+		// a node's spheres are all inside its bounds, so from outside them none is nearer than they are
+		_octree->Traverse([&](const Vec3d& lo, const Vec3d& hi) {
+			if (kept < k) return true;
+			double d2 = 0.0;
+			for (int a = 0; a < 3; a++)
+			{
+				double d = center[a] < lo[a] ? lo[a] - center[a] : center[a] > hi[a] ? center[a] - hi[a] : 0.0;
+				d2 += d * d;
+			}
+			return d2 == 0.0 || (gap[k - 1] >= 0.0 && d2 <= gap[k - 1] * gap[k - 1]);
+		}, [&](int i) {
+			if (i != skip) Keep(i, length(Vec3d(spheres[i].p - center)) - spheres[i].r, k, kept, found, gap);
+		});
+		return kept;
+	}
+	for (unsigned int i = 0; i < spheres.size(); i++)
+		if ((int)i != skip) Keep(i, length(Vec3d(spheres[i].p - center)) - spheres[i].r, k, kept, found, gap);
+	return kept;
+}
+// Where the ray first meets s's surface, if it does ahead of its origin
+bool SpatialQuery::Hit(const sphere& s, const Rayd& ray, double& t)
+{
+	int hits;
+	double t1;
+	return intersect(Sphered(Point3d(s.p[0], s.p[1], s.p[2]), s.r), ray, hits, t, t1);
+}
+// Walks the cells the ray crosses in order (Amanatides and Woo's 3D DDA), from where it enters
+// the occupied cells to where it leaves them. A sphere the ray hits at t is listed in the cell
+// the ray is in at t, so once the nearest hit so far comes before the ray leaves the current
+// cell, nothing further on can be nearer.
+int SpatialQuery::Raycast(const Rayd& ray, double maxT, double& t, int skip) const
+{
+	vector<sphere>& spheres = *_spheres;
+	const Vec3d& o = ray.getOrigin();
+	const Vec3d& dir = ray.getDir();
+	int best = -1;
+	t = maxT;
+	if (UsesOctree())
+	{
+		// nodes the ray doesn't cross before the nearest hit so far are passed by
+		_octree->Traverse([&](const Vec3d& lo, const Vec3d& hi) {
+			double enter = 0.0, leave = t;
+			for (int a = 0; a < 3; a++)
+			{
+				if (dir[a] == 0.0)
+				{
+					if (o[a] < lo[a] || o[a] > hi[a]) return false;
+					continue;
+				}
+				double ta = (lo[a] - o[a]) / dir[a], tb = (hi[a] - o[a]) / dir[a];
+				enter = max(enter, min(ta, tb));
+				leave = min(leave, max(ta, tb));
+			}
+			return enter <= leave;
+		}, [&](int i) {
+			double hit;
+			if (i == skip || !Hit(spheres[i], ray, hit) || hit > t) return;
+			if (hit == t && best >= 0 && i > best) return;
+			best = i;
+			t = hit;
+		});
+		return best;
+	}
+	if (!UsesGrid())
+	{
+		for (unsigned int i = 0; i < spheres.size(); i++)
+		{
+			double hit;
+			if ((int)i != skip && Hit(spheres[i], ray, hit) && (hit < t || (hit == t && best < 0)))
+			{
+				best = i;
+				t = hit;
+			}
+		}
+		return best;
+	}
+	Grid& grid = *_grid;
+	float origin[3] = { grid.wallLeft, grid.wallBottom, grid.wallFront };
+	float width[3] = { grid._cellWidthX, grid._cellWidthY, grid._cellWidthZ };
+	const Grid::CellRange& bounds = grid._bounds;
+	// the part of the ray inside the occupied cells
+	double enter = 0.0, leave = maxT;
+	for (int a = 0; a < 3; a++)
+	{
+		double lo = origin[a] + bounds.lo[a] * (double)width[a], hi = origin[a] + (bounds.hi[a] + 1) * (double)width[a];
+		if (dir[a] == 0.0)
+		{
+			if (o[a] < lo || o[a] > hi) return -1;
+			continue;
+		}
+		double ta = (lo - o[a]) / dir[a], tb = (hi - o[a]) / dir[a];
+		enter = max(enter, min(ta, tb));
+		leave = min(leave, max(ta, tb));
+	}
+	if (enter > leave) return -1;
+	int cell[3], step[3], unused[3];
+	double next[3], delta[3]; // where the ray crosses the next cell wall on each axis, and the distance between walls
+	grid.CellsOverlapping(o + dir * enter, o + dir * enter, cell, unused);
+	for (int a = 0; a < 3; a++)
+	{
+		cell[a] = min(max(cell[a], bounds.lo[a]), bounds.hi[a]);
+		step[a] = dir[a] > 0.0 ? 1 : dir[a] < 0.0 ? -1 : 0;
+		double wall = origin[a] + (cell[a] + (step[a] > 0 ? 1 : 0)) * (double)width[a];
+		next[a] = step[a] == 0 ? 1e300 : (wall - o[a]) / dir[a];
+		delta[a] = step[a] == 0 ? 1e300 : width[a] / fabs(dir[a]);
+	}
+	for (;;)
+	{
+		int count;
+		const int* spheresIn = grid.GetSpheresInCell(cell[0], cell[1], cell[2], count);
+		for (int m = 0; m < count; m++)
+		{
+			double hit;
+			if (spheresIn[m] != skip && Hit(spheres[spheresIn[m]], ray, hit) && hit <= t)
+			{
+				if (hit == t && best >= 0 && spheresIn[m] > best) continue; // ties go to the lower index, as in a scan
+				best = spheresIn[m];
+				t = hit;
+			}
+		}
+		int a = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+		if ((best >= 0 && t <= next[a]) || next[a] > leave) break;
+		cell[a] += step[a];
+		if (cell[a] < bounds.lo[a] || cell[a] > bounds.hi[a]) break;
+		next[a] += delta[a];
+	}
+	return best;
+}
+// Does s overlap the box from lo to hi
+bool SpatialQuery::Overlaps(const sphere& s, const Vec3d& lo, const Vec3d& hi) const
+{
+	double d2 = 0;
+	for (int a = 0; a < 3; a++)
+	{
+		double d = s.p[a] < lo[a] ? lo[a] - s.p[a] : s.p[a] > hi[a] ? s.p[a] - hi[a] : 0.0;
+		d2 += d * d;
+	}
+	return d2 <= s.r * s.r;
+}
+// Every sphere overlapping the ball (or the box from lo to hi, if not ball), from every sphere
+int SpatialQuery::Scan(const Vec3d& lo, const Vec3d& hi, const Vec3d& center, double radius, bool ball, int* found, int capacity) const
+{
+	vector<sphere>& spheres = *_spheres;
+	int count = 0;
+	for (unsigned int i = 0; i < spheres.size(); i++)
+	{
+		const sphere& s = spheres[i];
+		Vec3d d = s.p - center;
+		if (ball ? dot(d, d) >= (radius + s.r) * (radius + s.r) : !Overlaps(s, lo, hi)) continue;
+		if (count < capacity) found[count] = i;
+		count++;
+	}
+	return count;
+}
+// The same from the cells the box from lo to hi overlaps, each sphere only in the first cell it shares with them
+int SpatialQuery::Cells(const Vec3d& lo, const Vec3d& hi, const Vec3d& center, double radius, bool ball, int* found, int capacity) const
+{
+	vector<sphere>& spheres = *_spheres;
+	Grid& grid = *_grid;
+	int cellLo[3], cellHi[3];
+	grid.CellsOverlapping(lo, hi, cellLo, cellHi);
+	int count = 0;
+	for (int x = cellLo[0]; x <= cellHi[0]; x++){
+		for (int y = cellLo[1]; y <= cellHi[1]; y++){
+			for (int z = cellLo[2]; z <= cellHi[2]; z++){
+				int n;
+				const int* cell = grid.GetSpheresInCell(x, y, z, n);
+				for (int m = 0; m < n; m++)
+				{
+					const Grid::CellRange& range = grid._ranges[cell[m]];
+					if (x != max(range.lo[0], cellLo[0]) || y != max(range.lo[1], cellLo[1]) || z != max(range.lo[2], cellLo[2])) continue;
+					const sphere& s = spheres[cell[m]];
+					Vec3d d = s.p - center;
+					if (ball ? dot(d, d) >= (radius + s.r) * (radius + s.r) : !Overlaps(s, lo, hi)) continue;
+					if (count < capacity) found[count] = cell[m];
+					count++;
+				}
+			}
+		}
+	}
+	return count;
+}
+// The same from the octree's nodes whose bounds overlap the box from lo to hi
+int SpatialQuery::Nodes(const Vec3d& lo, const Vec3d& hi, const Vec3d& center, double radius, bool ball, int* found, int capacity) const
+{
+	vector<sphere>& spheres = *_spheres;
+	int count = 0;
+	_octree->Traverse([&](const Vec3d& nodeLo, const Vec3d& nodeHi) {
+		return nodeLo[0] <= hi[0] && nodeHi[0] >= lo[0] && nodeLo[1] <= hi[1] && nodeHi[1] >= lo[1] && nodeLo[2] <= hi[2] && nodeHi[2] >= lo[2];
+	}, [&](int i) {
+		const sphere& s = spheres[i];
+		Vec3d d = s.p - center;
+		if (ball ? dot(d, d) >= (radius + s.r) * (radius + s.r) : !Overlaps(s, lo, hi)) return;
+		if (count < capacity) found[count] = i;
+		count++;
+	});
+	return count;
+}
+SpatialQuery::~SpatialQuery()
+{
+}
+
+#endif _SPATIALQUERY_H_
@@ -0,0 +1,176 @@
+#ifndef _SPAWNER_H_
+#define _SPAWNER_H_
+#include <vector>
+#include <thread>
+#include <random>
+#include <algorithm>
+#include <math.h>
+#include "objects.h"
+using namespace std;
+
+// Places a batch of spheres inside the box without overlapping each other or the spheres
+// already in the scene (dart throwing). A uniform grid with cells one contact distance wide
+// means each dart only has to look at the 27 cells around it.
+// The box is cut into slabs along x, each slab at least two cells thick. Even slabs are
+// filled in parallel first, then odd slabs, so two threads never write cells the other reads.
+class Spawner
+{
+public:
+	//properties
+	int numThreads;
+	int maxAttempts; // darts thrown per requested sphere before a slab gives up
+	//members
+	Spawner(int threads = 0);
+	int SpawnSpheres(vector<sphere>& spheres, int count, double wall, double rad, unsigned int seed);
+	~Spawner();
+
+private:
+	struct placed
+	{
+		Vec3d p;
+		double r;
+	};
+	int _nx, _ny, _nz;
+	double _cellWidth, _wall;
+	vector< vector<placed> > _cells;
+
+	int CellCoord(double v, int n);
+	vector<placed>& Cell(int x, int y, int z);
+	bool IsFree(const Vec3d& p, double r, int x, int y, int z);
+	void Insert(const Vec3d& p, double r);
+	void FillSlab(int x0, int x1, int quota, double rad, unsigned int seed, vector<Vec3d>& out);
+};
+
+Spawner::Spawner(int threads)
+{
+	numThreads = threads > 0 ? threads : (int)thread::hardware_concurrency();
+	if (numThreads < 1) numThreads = 1;
+	maxAttempts = 30;
+}
+int Spawner::CellCoord(double v, int n)
+{
+	int c = (int)floor((v + _wall) / _cellWidth);
+	if (c < 0) c = 0;
+	if (c >= n) c = n - 1;
+	return c;
+}
+vector<Spawner::placed>& Spawner::Cell(int x, int y, int z)
+{
+	return _cells[(z * _ny + y) * _nx + x];
+}
+bool Spawner::IsFree(const Vec3d& p, double r, int x, int y, int z)
+{
+	for (int k = max(z - 1, 0); k <= min(z + 1, _nz - 1); k++){
+		for (int j = max(y - 1, 0); j <= min(y + 1, _ny - 1); j++){
+			for (int i = max(x - 1, 0); i <= min(x + 1, _nx - 1); i++){
+				vector<placed>& cell = Cell(i, j, k);
+				for (unsigned int n = 0; n < cell.size(); n++){
+					double minDist = r + cell[n].r;
+					if (lengthSquared(Vec3d(p - cell[n].p)) < minDist * minDist)
+						return false;
+				}
+			}
+		}
+	}
+	return true;
+}
+void Spawner::Insert(const Vec3d& p, double r)
+{
+	placed s;
+	s.p = p;
+	s.r = r;
+	Cell(CellCoord(p[0], _nx), CellCoord(p[1], _ny), CellCoord(p[2], _nz)).push_back(s);
+}
+
+// Throw darts into cells [x0, x1) along x. Only cells in that range are written,
+// only cells in [x0 - 1, x1] are read.
+void Spawner::FillSlab(int x0, int x1, int quota, double rad, unsigned int seed, vector<Vec3d>& out)
+{
+	mt19937 rng(seed);
+	uniform_real_distribution<double> ux(-_wall + x0 * _cellWidth, min(-_wall + x1 * _cellWidth, _wall));
+	uniform_real_distribution<double> uyz(-_wall, _wall);
+	int attempts = quota * maxAttempts;
+	for (int a = 0; a < attempts && (int)out.size() < quota; a++){
+		Vec3d p(ux(rng), uyz(rng), uyz(rng));
+		int x = CellCoord(p[0], _nx);
+		if (x < x0 || x >= x1) continue; // rounding at the slab face
+		if (IsFree(p, rad, x, CellCoord(p[1], _ny), CellCoord(p[2], _nz))){
+			Insert(p, rad);
+			out.push_back(p);
+		}
+	}
+}
+
+// Append up to count spheres of radius rad with centers in [-wall, wall]^3 (the same range
+// makeRandomSphere uses). Returns how many were actually placed; a box that is too full
+// for the request comes back short instead of overlapping.
+int Spawner::SpawnSpheres(vector<sphere>& spheres, int count, double wall, double rad, unsigned int seed)
+{
+	if (count <= 0 || wall <= 0.0) return 0;
+
+	double maxR = rad;
+	for (unsigned int i = 0; i < spheres.size(); i++)
+		if (spheres[i].r > maxR) maxR = spheres[i].r;
+
+	_wall = wall;
+	_cellWidth = rad + maxR;
+	_nx = _ny = _nz = max(1, (int)(2.0 * wall / _cellWidth));
+	_cellWidth = 2.0 * wall / _nx;
+	_cells.assign(_nx * _ny * _nz, vector<placed>());
+	for (unsigned int i = 0; i < spheres.size(); i++)
+		Insert(spheres[i].p, spheres[i].r);
+
+	// Slabs need to be two cells thick so same-parity slabs are never neighbours
+	int numSlabs = min(2 * numThreads, _nx / 2);
+	if (numSlabs < 2) numSlabs = 1;
+	vector<int> slabStart(numSlabs + 1);
+	vector<int> quota(numSlabs);
+	vector< vector<Vec3d> > accepted(numSlabs);
+	int assigned = 0;
+	for (int s = 0; s <= numSlabs; s++)
+		slabStart[s] = s * _nx / numSlabs;
+	for (int s = 0; s < numSlabs; s++){
+		quota[s] = count * slabStart[s + 1] / _nx - assigned;
+		assigned += quota[s];
+		accepted[s].reserve(quota[s]);
+	}
+
+	for (int parity = 0; parity < 2; parity++){
+		vector<thread> workers;
+		for (int s = parity; s < numSlabs; s += 2){
+			if (numSlabs == 1)
+				FillSlab(slabStart[s], slabStart[s + 1], quota[s], rad, seed + 7919 * s, accepted[s]);
+			else
+				workers.push_back(thread(&Spawner::FillSlab, this, slabStart[s], slabStart[s + 1], quota[s], rad, seed + 7919 * s, ref(accepted[s])));
+		}
+		for (unsigned int t = 0; t < workers.size(); t++)
+			workers[t].join();
+	}
+
+	// Any slab that came back short gets topped up from the whole box on this thread
+	int placedCount = 0;
+	for (int s = 0; s < numSlabs; s++)
+		placedCount += accepted[s].size();
+	vector<Vec3d> topUp;
+	if (placedCount < count){
+		FillSlab(0, _nx, count - placedCount, rad, seed + 7919 * numSlabs, topUp);
+		placedCount += topUp.size();
+	}
+	accepted.push_back(topUp);
+
+	spheres.reserve(spheres.size() + placedCount);
+	for (unsigned int s = 0; s < accepted.size(); s++){
+		for (unsigned int i = 0; i < accepted[s].size(); i++){
+			sphere sp(rad);
+			sp.p = accepted[s][i];
+			spheres.push_back(sp);
+		}
+	}
+	_cells.clear();
+	return placedCount;
+}
+Spawner::~Spawner()
+{
+}
+
+#endif _SPAWNER_H_
@@ -0,0 +1,144 @@
+#ifndef _SPHEREREGISTRY_H_
+#define _SPHEREREGISTRY_H_
+#include <vector>
+#include "objects.h"
+using namespace std;
+
+// A handle stays valid until its sphere is removed, no matter how the dense array is shuffled.
+// The generation is bumped every time a slot is freed so stale handles are detected instead
+// of silently pointing at whichever sphere reused the slot.
+struct SphereHandle
+{
+	unsigned int slot;
+	unsigned int generation;
+};
+
+// Owns the bookkeeping that maps stable handles onto the dense sphere vector the simulation
+// loops over. Removal swaps the last sphere into the hole, so both add and remove are O(1)
+// and the dense array never has gaps. Dense indices (and so the Grid) are only valid until
+// the next add or remove; hold a handle across frames instead.
+class SphereRegistry
+{
+public:
+	//members
+	SphereRegistry(vector<sphere>& spheres);
+	SphereHandle Add(const sphere& s);
+	void RegisterAppended();
+	void Reset(); // after the sphere vector was replaced wholesale
+	bool Remove(SphereHandle h);
+	bool IsValid(SphereHandle h);
+	sphere* Get(SphereHandle h);
+	int DenseIndex(SphereHandle h);
+	SphereHandle HandleAt(int denseIndex);
+	void Reserve(int n);
+	int Size();
+	~SphereRegistry();
+
+private:
+	vector<sphere>& _spheres;
+	vector<unsigned int> _slotDense; // slot -> dense index
+	vector<unsigned int> _slotGeneration;
+	vector<unsigned int> _freeSlots;
+	vector<unsigned int> _denseSlot; // dense index -> slot
+	unsigned int AllocSlot(unsigned int denseIndex);
+};
+
+SphereRegistry::SphereRegistry(vector<sphere>& spheres) : _spheres(spheres)
+{
+	RegisterAppended();
+}
+unsigned int SphereRegistry::AllocSlot(unsigned int denseIndex)
+{
+	unsigned int slot;
+	if (!_freeSlots.empty()){
+		slot = _freeSlots.back();
+		_freeSlots.pop_back();
+		_slotDense[slot] = denseIndex;
+	}
+	else{
+		slot = _slotDense.size();
+		_slotDense.push_back(denseIndex);
+		_slotGeneration.push_back(0);
+	}
+	_denseSlot.push_back(slot);
+	return slot;
+}
+SphereHandle SphereRegistry::Add(const sphere& s)
+{
+	_spheres.push_back(s);
+	SphereHandle h;
+	h.slot = AllocSlot(_spheres.size() - 1);
+	h.generation = _slotGeneration[h.slot];
+	return h;
+}
+// Hand out slots for spheres that were pushed straight onto the vector, e.g. by a bulk spawn
+void SphereRegistry::RegisterAppended()
+{
+	for (unsigned int i = _denseSlot.size(); i < _spheres.size(); i++)
+		AllocSlot(i);
+}
+// Frees every slot, so every handle from before goes stale, and hands out new ones for the
+// spheres there are now
+void SphereRegistry::Reset()
+{
+	for (unsigned int d = 0; d < _denseSlot.size(); d++)
+	{
+		_slotGeneration[_denseSlot[d]]++;
+		_freeSlots.push_back(_denseSlot[d]);
+	}
+	_denseSlot.clear();
+	RegisterAppended();
+}
+bool SphereRegistry::IsValid(SphereHandle h)
+{
+	return h.slot < _slotGeneration.size() && _slotGeneration[h.slot] == h.generation;
+}
+bool SphereRegistry::Remove(SphereHandle h)
+{
+	if (!IsValid(h)) return false;
+	unsigned int hole = _slotDense[h.slot];
+	unsigned int last = _spheres.size() - 1;
+	if (hole != last){
+		_spheres[hole] = _spheres[last];
+		_denseSlot[hole] = _denseSlot[last];
+		_slotDense[_denseSlot[hole]] = hole;
+	}
+	_spheres.pop_back();
+	_denseSlot.pop_back();
+	_slotGeneration[h.slot]++;
+	_freeSlots.push_back(h.slot);
+	return true;
+}
+sphere* SphereRegistry::Get(SphereHandle h)
+{
+	if (!IsValid(h)) return NULL;
+	return &_spheres[_slotDense[h.slot]];
+}
+int SphereRegistry::DenseIndex(SphereHandle h)
+{
+	if (!IsValid(h)) return -1;
+	return _slotDense[h.slot];
+}
+SphereHandle SphereRegistry::HandleAt(int denseIndex)
+{
+	SphereHandle h;
+	h.slot = _denseSlot[denseIndex];
+	h.generation = _slotGeneration[h.slot];
+	return h;
+}
+void SphereRegistry::Reserve(int n)
+{
+	_spheres.reserve(n);
+	_denseSlot.reserve(n);
+	_slotDense.reserve(n);
+	_slotGeneration.reserve(n);
+}
+int SphereRegistry::Size()
+{
+	return _spheres.size();
+}
+SphereRegistry::~SphereRegistry()
+{
+}
+
+#endif _SPHEREREGISTRY_H_
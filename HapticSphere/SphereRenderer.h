@@ -0,0 +1,445 @@
+#ifndef _SPHERERENDERER_H_
+#define _SPHERERENDERER_H_
+#include <vector>
+#include <iostream>
+#include <math.h>
+#include <algorithm>
+#include <string.h>
+#include <GL/glut.h>
+#include "GLExt.h"
+#include "FrameBuffer.h"
+#include "ViewCuller.h"
+using namespace std;
+
+// Draws the spheres a ViewCuller found visible with one instanced call per LOD. Unit sphere
+// meshes for every LOD are uploaded once; per sphere only the position/radius and color streams
+// change, and those are copied straight out of the culler's arrays into a persistently mapped
+// buffer (3 regions fenced in turn, so we never write a region the GPU is still reading).
+// Without GL 3.3 style instancing it falls back to one display list call per sphere,
+// which still skips re-tessellating like glutSolidSphere did.
+// IMPOSTOR mode draws each sphere as a single point sprite instead and shades it per fragment
+// as a true sphere (normal and depth from the sprite coordinate). It only needs GL 2.0, so it
+// runs on software GL (Mesa llvmpipe/softpipe); with GL 1.1 alone it degrades to round points.
+class SphereRenderer
+{
+public:
+	//properties
+	enum DrawMode { MESH, IMPOSTOR };
+	static const int LODS = ViewCuller::LODS;
+	//members
+	SphereRenderer();
+	void Init(GLExtensions* gl, const ViewCuller& culler);
+	void Draw(const ViewCuller& visible, DrawMode mode = MESH);
+	bool IsInstanced();
+	~SphereRenderer();
+
+private:
+	enum { ATTRIB_VERTEX = 0, ATTRIB_POS_RADIUS = 1, ATTRIB_COLOR = 2, REGIONS = 3 };
+	GLExtensions* _gl;
+	bool _instanced;
+	GLuint _sphereLists[LODS];
+	GLuint _program;
+	GLuint _impostorProgram;
+	GLint _pointScaleLocation;
+	GLuint _meshVBO, _meshIBO, _instanceVBO;
+	int _lodFirstIndex[LODS], _lodIndexCount[LODS];
+	int _capacity; // spheres per region
+	unsigned char* _mapped; // persistent mapping, NULL when streaming with BufferSubData
+	GLsyncExt _fences[REGIONS];
+	int _region;
+
+	GLuint CompileProgram(const char* vertexSrc, const char* fragmentSrc);
+	void BuildMeshes(const ViewCuller& culler);
+	void Reserve(int n);
+	int Upload(const ViewCuller& visible);
+	void FenceLastRegion();
+	void DrawLegacy(const ViewCuller& visible);
+	void DrawInstanced(const ViewCuller& visible);
+	void DrawImpostors(const ViewCuller& visible);
+	void DrawPoints(const ViewCuller& visible);
+};
+
+static const char* _sphereVertexSrc =
+	"#version 120\n"
+	"attribute vec3 vertex;\n"
+	"attribute vec4 posRadius;\n"
+	"attribute vec4 color;\n"
+	"varying vec3 normal;\n"
+	"varying vec4 baseColor;\n"
+	"void main()\n"
+	"{\n"
+	"	gl_Position = gl_ModelViewProjectionMatrix * vec4(posRadius.xyz + vertex * posRadius.w, 1.0);\n"
+	"	normal = gl_NormalMatrix * vertex;\n"
+	"	baseColor = color;\n"
+	"}\n";
+
+// Same terms the fixed pipeline evaluates with GL_COLOR_MATERIAL driving the diffuse color
+static const char* _sphereShadeSrc =
+	"#version 120\n"
+	"vec3 shade(vec3 n, vec4 baseColor)\n"
+	"{\n"
+	"	vec3 l = normalize(gl_LightSource[0].position.xyz);\n"
+	"	vec3 h = normalize(l + vec3(0.0, 0.0, 1.0));\n"
+	"	float diffuse = max(dot(n, l), 0.0);\n"
+	"	float specular = diffuse > 0.0 ? pow(max(dot(n, h), 0.0), gl_FrontMaterial.shininess) : 0.0;\n"
+	"	return (gl_LightModel.ambient.rgb + gl_LightSource[0].ambient.rgb) * gl_FrontMaterial.ambient.rgb\n"
+	"		+ baseColor.rgb * gl_LightSource[0].diffuse.rgb * diffuse\n"
+	"		+ gl_FrontMaterial.specular.rgb * gl_LightSource[0].specular.rgb * specular;\n"
+	"}\n";
+
+static const char* _sphereFragmentSrc =
+	"varying vec3 normal;\n"
+	"varying vec4 baseColor;\n"
+	"void main()\n"
+	"{\n"
+	"	gl_FragColor = vec4(shade(normalize(normal), baseColor), baseColor.a);\n"
+	"}\n";
+
+// One point per sphere, sized to the sphere's projected diameter in pixels
+static const char* _impostorVertexSrc =
+	"#version 120\n"
+	"attribute vec4 posRadius;\n"
+	"attribute vec4 color;\n"
+	"uniform float pointScale;\n"
+	"varying vec3 eyeCenter;\n"
+	"varying float radius;\n"
+	"varying vec4 baseColor;\n"
+	"void main()\n"
+	"{\n"
+	"	vec4 eye = gl_ModelViewMatrix * vec4(posRadius.xyz, 1.0);\n"
+	"	eyeCenter = eye.xyz;\n"
+	"	radius = max(posRadius.w, 0.01);\n"
+	"	baseColor = color;\n"
+	"	gl_Position = gl_ProjectionMatrix * eye;\n"
+	"	gl_PointSize = max(2.0 * radius * pointScale / -eye.z, 1.0);\n"
+	"}\n";
+
+// Rebuild the visible hemisphere from the sprite coordinate and write its true depth,
+// so impostors intersect each other and the walls like real geometry
+static const char* _impostorFragmentSrc =
+	"varying vec3 eyeCenter;\n"
+	"varying float radius;\n"
+	"varying vec4 baseColor;\n"
+	"void main()\n"
+	"{\n"
+	"	vec2 xy = gl_PointCoord * 2.0 - 1.0;\n"
+	"	xy.y = -xy.y;\n"
+	"	float d2 = dot(xy, xy);\n"
+	"	if (d2 > 1.0) discard;\n"
+	"	vec3 n = vec3(xy, sqrt(1.0 - d2));\n"
+	"	vec4 clip = gl_ProjectionMatrix * vec4(eyeCenter + n * radius, 1.0);\n"
+	"	gl_FragDepth = 0.5 * (clip.z / clip.w) + 0.5;\n"
+	"	gl_FragColor = vec4(shade(n, baseColor), baseColor.a);\n"
+	"}\n";
+
+SphereRenderer::SphereRenderer()
+{
+	_gl = NULL;
+	_instanced = false;
+	for (int i = 0; i < LODS; i++) _sphereLists[i] = 0;
+	_program = 0;
+	_impostorProgram = 0;
+	_pointScaleLocation = -1;
+	_meshVBO = _meshIBO = _instanceVBO = 0;
+	for (int i = 0; i < LODS; i++) _lodFirstIndex[i] = _lodIndexCount[i] = 0;
+	_capacity = 0;
+	_mapped = NULL;
+	for (int i = 0; i < REGIONS; i++) _fences[i] = NULL;
+	_region = 0;
+}
+// Needs a current GL context, so call after glutCreateWindow
+void SphereRenderer::Init(GLExtensions* gl, const ViewCuller& culler)
+{
+	_gl = gl;
+	for (int l = 0; l < LODS; l++)
+	{
+		_sphereLists[l] = glGenLists(1);
+		glNewList(_sphereLists[l], GL_COMPILE);
+		glutSolidSphere(1.0, culler.lodSlices[l], culler.lodSlices[l]);
+		glEndList();
+	}
+
+	if (_gl->HasInstancing)
+		_program = CompileProgram(_sphereVertexSrc, _sphereFragmentSrc);
+	_instanced = _program != 0;
+	if (_instanced) BuildMeshes(culler);
+	if (_gl->HasShaders)
+		_impostorProgram = CompileProgram(_impostorVertexSrc, _impostorFragmentSrc);
+	if (_impostorProgram)
+		_pointScaleLocation = _gl->GetUniformLocation(_impostorProgram, "pointScale");
+	cout << "Sphere renderer: " << (_instanced ? "instanced" : "display list")
+		<< (_instanced && _gl->HasPersistentMap ? ", persistent mapped buffer" : "")
+		<< (_impostorProgram ? ", impostors" : ", point fallback for impostors") << endl;
+}
+bool SphereRenderer::IsInstanced()
+{
+	return _instanced;
+}
+GLuint SphereRenderer::CompileProgram(const char* vertexSrc, const char* fragmentSrc)
+{
+	// fragment shaders get the shared shade() function prepended
+	const char* src[2][2] = { { vertexSrc, "" }, { _sphereShadeSrc, fragmentSrc } };
+	GLenum type[2] = { GL_VERTEX_SHADER, GL_FRAGMENT_SHADER };
+	GLuint program = _gl->CreateProgram();
+	for (int i = 0; i < 2; i++)
+	{
+		GLuint shader = _gl->CreateShader(type[i]);
+		_gl->ShaderSource(shader, 2, src[i], NULL);
+		_gl->CompileShader(shader);
+		GLint ok = 0;
+		_gl->GetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+		if (!ok)
+		{
+			char log[1024];
+			_gl->GetShaderInfoLog(shader, sizeof(log), NULL, log);
+			cout << "Shader compile failed: " << log << endl;
+			return 0;
+		}
+		_gl->AttachShader(program, shader);
+	}
+	_gl->BindAttribLocation(program, ATTRIB_VERTEX, "vertex");
+	_gl->BindAttribLocation(program, ATTRIB_POS_RADIUS, "posRadius");
+	_gl->BindAttribLocation(program, ATTRIB_COLOR, "color");
+	_gl->LinkProgram(program);
+	GLint ok = 0;
+	_gl->GetProgramiv(program, GL_LINK_STATUS, &ok);
+	if (!ok)
+	{
+		char log[1024];
+		_gl->GetProgramInfoLog(program, sizeof(log), NULL, log);
+		cout << "Shader link failed: " << log << endl;
+		return 0;
+	}
+	return program;
+}
+// Unit spheres as latitude/longitude grids, one per LOD, all in one vertex and index buffer.
+// The vertex doubles as its own normal.
+void SphereRenderer::BuildMeshes(const ViewCuller& culler)
+{
+	const double pi = 3.14159265358979;
+	vector<float> vertices;
+	vector<unsigned short> indices;
+	for (int l = 0; l < LODS; l++)
+	{
+		int n = culler.lodSlices[l];
+		unsigned short base = vertices.size() / 3;
+		for (int i = 0; i <= n; i++)
+		{
+			double theta = i * pi / n;
+			for (int j = 0; j <= n; j++)
+			{
+				double phi = j * 2.0 * pi / n;
+				vertices.push_back((float)(sin(theta) * cos(phi)));
+				vertices.push_back((float)(sin(theta) * sin(phi)));
+				vertices.push_back((float)cos(theta));
+			}
+		}
+		_lodFirstIndex[l] = indices.size();
+		for (int i = 0; i < n; i++)
+		{
+			for (int j = 0; j < n; j++)
+			{
+				unsigned short a = base + i * (n + 1) + j, b = a + n + 1;
+				indices.push_back(a); indices.push_back(b); indices.push_back(a + 1);
+				indices.push_back(a + 1); indices.push_back(b); indices.push_back(b + 1);
+			}
+		}
+		_lodIndexCount[l] = indices.size() - _lodFirstIndex[l];
+	}
+	_gl->GenBuffers(1, &_meshVBO);
+	_gl->BindBuffer(GL_ARRAY_BUFFER, _meshVBO);
+	_gl->BufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), &vertices[0], GL_STATIC_DRAW);
+	_gl->GenBuffers(1, &_meshIBO);
+	_gl->BindBuffer(GL_ELEMENT_ARRAY_BUFFER, _meshIBO);
+	_gl->BufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned short), &indices[0], GL_STATIC_DRAW);
+	_gl->BindBuffer(GL_ARRAY_BUFFER, 0);
+	_gl->BindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+// Each region holds capacity posRadius vec4s followed by capacity rgba colors
+void SphereRenderer::Reserve(int n)
+{
+	if (n <= _capacity) return;
+	_capacity = max(n, 2 * _capacity);
+	for (int i = 0; i < REGIONS; i++)
+	{
+		if (_fences[i]) _gl->DeleteSync(_fences[i]);
+		_fences[i] = NULL;
+	}
+	if (_instanceVBO) _gl->DeleteBuffers(1, &_instanceVBO); // also drops any mapping
+	_gl->GenBuffers(1, &_instanceVBO);
+	_gl->BindBuffer(GL_ARRAY_BUFFER, _instanceVBO);
+	GLsizeiptrExt regionBytes = (GLsizeiptrExt)_capacity * 20;
+	if (_gl->HasPersistentMap)
+	{
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		_gl->BufferStorage(GL_ARRAY_BUFFER, REGIONS * regionBytes, NULL, flags);
+		_mapped = (unsigned char*)_gl->MapBufferRange(GL_ARRAY_BUFFER, 0, REGIONS * regionBytes, flags);
+	}
+	else
+	{
+		_gl->BufferData(GL_ARRAY_BUFFER, regionBytes, NULL, GL_STREAM_DRAW);
+		_mapped = NULL;
+	}
+	_gl->BindBuffer(GL_ARRAY_BUFFER, 0);
+}
+// Copy the visible streams into the next free region and return its byte offset
+int SphereRenderer::Upload(const ViewCuller& visible)
+{
+	int n = visible.numVisible;
+	Reserve(n);
+	int regionBytes = _capacity * 20;
+	_gl->BindBuffer(GL_ARRAY_BUFFER, _instanceVBO);
+	if (_mapped == NULL)
+	{
+		_gl->BufferData(GL_ARRAY_BUFFER, regionBytes, NULL, GL_STREAM_DRAW); // orphan
+		_gl->BufferSubData(GL_ARRAY_BUFFER, 0, n * 16, &visible.posRadius[0]);
+		_gl->BufferSubData(GL_ARRAY_BUFFER, _capacity * 16, n * 4, &visible.color[0]);
+		return 0;
+	}
+	if (_fences[_region])
+	{
+		while (_gl->ClientWaitSync(_fences[_region], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED)
+			;
+		_gl->DeleteSync(_fences[_region]);
+		_fences[_region] = NULL;
+	}
+	int offset = _region * regionBytes;
+	memcpy(_mapped + offset, &visible.posRadius[0], n * 16);
+	memcpy(_mapped + offset + _capacity * 16, &visible.color[0], n * 4);
+	_region = (_region + 1) % REGIONS;
+	return offset;
+}
+// The region just drawn from may not be rewritten until the GPU has passed this point
+void SphereRenderer::FenceLastRegion()
+{
+	if (_mapped == NULL) return;
+	int used = (_region + REGIONS - 1) % REGIONS;
+	if (_fences[used]) _gl->DeleteSync(_fences[used]);
+	_fences[used] = _gl->FenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+void SphereRenderer::DrawInstanced(const ViewCuller& visible)
+{
+	int offset = Upload(visible);
+	_gl->UseProgram(_program);
+
+	_gl->BindBuffer(GL_ARRAY_BUFFER, _meshVBO);
+	_gl->EnableVertexAttribArray(ATTRIB_VERTEX);
+	_gl->VertexAttribPointer(ATTRIB_VERTEX, 3, GL_FLOAT, GL_FALSE, 0, 0);
+
+	_gl->BindBuffer(GL_ARRAY_BUFFER, _instanceVBO);
+	_gl->EnableVertexAttribArray(ATTRIB_POS_RADIUS);
+	_gl->VertexAttribDivisor(ATTRIB_POS_RADIUS, 1);
+	_gl->EnableVertexAttribArray(ATTRIB_COLOR);
+	_gl->VertexAttribDivisor(ATTRIB_COLOR, 1);
+	_gl->BindBuffer(GL_ELEMENT_ARRAY_BUFFER, _meshIBO);
+
+	// one call per LOD, each starting at its group in the instance streams
+	for (int l = 0; l < LODS; l++)
+	{
+		int first = visible.lodStart[l], count = visible.lodStart[l + 1] - first;
+		if (count == 0) continue;
+		_gl->VertexAttribPointer(ATTRIB_POS_RADIUS, 4, GL_FLOAT, GL_FALSE, 0, (const void*)(size_t)(offset + first * 16));
+		_gl->VertexAttribPointer(ATTRIB_COLOR, 4, GL_UNSIGNED_BYTE, GL_TRUE, 0, (const void*)(size_t)(offset + _capacity * 16 + first * 4));
+		_gl->DrawElementsInstanced(GL_TRIANGLES, _lodIndexCount[l], GL_UNSIGNED_SHORT,
+			(const void*)(size_t)(_lodFirstIndex[l] * sizeof(unsigned short)), count);
+	}
+	FenceLastRegion();
+
+	_gl->VertexAttribDivisor(ATTRIB_POS_RADIUS, 0);
+	_gl->VertexAttribDivisor(ATTRIB_COLOR, 0);
+	_gl->DisableVertexAttribArray(ATTRIB_VERTEX);
+	_gl->DisableVertexAttribArray(ATTRIB_POS_RADIUS);
+	_gl->DisableVertexAttribArray(ATTRIB_COLOR);
+	_gl->BindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	_gl->BindBuffer(GL_ARRAY_BUFFER, 0);
+	_gl->UseProgram(0);
+}
+// Particles with zero radius are given a small size
+void SphereRenderer::DrawLegacy(const ViewCuller& visible)
+{
+	float currentColor[4];
+	glGetFloatv(GL_CURRENT_COLOR, currentColor);
+	for (int l = 0; l < LODS; l++)
+	{
+		for (int i = visible.lodStart[l]; i < visible.lodStart[l + 1]; i++)
+		{
+			const float* pr = &visible.posRadius[4 * i];
+			float r = pr[3] < 0.0001f ? 0.01f : pr[3];
+			glPushMatrix();
+			glColor4ubv(&visible.color[4 * i]);
+			glTranslatef(pr[0], pr[1], pr[2]);
+			glScalef(r, r, r);
+			glCallList(_sphereLists[l]);
+			glPopMatrix();
+		}
+	}
+	glColor4f(currentColor[0], currentColor[1], currentColor[2], 1);
+}
+void SphereRenderer::DrawImpostors(const ViewCuller& visible)
+{
+	int offset = Upload(visible);
+	GLint viewport[4];
+	GLfloat projection[16];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	glGetFloatv(GL_PROJECTION_MATRIX, projection);
+
+	_gl->UseProgram(_impostorProgram);
+	_gl->Uniform1f(_pointScaleLocation, 0.5f * viewport[3] * projection[5]);
+	glEnable(GL_VERTEX_PROGRAM_POINT_SIZE);
+	glEnable(GL_POINT_SPRITE);
+
+	_gl->BindBuffer(GL_ARRAY_BUFFER, _instanceVBO);
+	_gl->EnableVertexAttribArray(ATTRIB_POS_RADIUS);
+	_gl->VertexAttribPointer(ATTRIB_POS_RADIUS, 4, GL_FLOAT, GL_FALSE, 0, (const void*)(size_t)offset);
+	_gl->EnableVertexAttribArray(ATTRIB_COLOR);
+	_gl->VertexAttribPointer(ATTRIB_COLOR, 4, GL_UNSIGNED_BYTE, GL_TRUE, 0, (const void*)(size_t)(offset + _capacity * 16));
+	glDrawArrays(GL_POINTS, 0, visible.numVisible);
+	FenceLastRegion();
+
+	_gl->DisableVertexAttribArray(ATTRIB_POS_RADIUS);
+	_gl->DisableVertexAttribArray(ATTRIB_COLOR);
+	_gl->BindBuffer(GL_ARRAY_BUFFER, 0);
+	glDisable(GL_POINT_SPRITE);
+	glDisable(GL_VERTEX_PROGRAM_POINT_SIZE);
+	_gl->UseProgram(0);
+}
+// GL 1.1 only: smooth points straight from the culled arrays, sized for the first sphere
+// at the camera distance. Good enough to see the pile on a bare software renderer.
+void SphereRenderer::DrawPoints(const ViewCuller& visible)
+{
+	GLint viewport[4];
+	GLfloat projection[16], modelview[16];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	glGetFloatv(GL_PROJECTION_MATRIX, projection);
+	glGetFloatv(GL_MODELVIEW_MATRIX, modelview);
+	float distance = modelview[14] < -0.1f ? -modelview[14] : 0.1f;
+	float size = visible.posRadius[3] * viewport[3] * projection[5] / distance;
+
+	glPointSize(size < 1.0f ? 1.0f : size);
+	glEnable(GL_POINT_SMOOTH);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_COLOR_ARRAY);
+	glVertexPointer(3, GL_FLOAT, 4 * sizeof(float), &visible.posRadius[0]);
+	glColorPointer(4, GL_UNSIGNED_BYTE, 0, &visible.color[0]);
+	glDrawArrays(GL_POINTS, 0, visible.numVisible);
+	glDisableClientState(GL_COLOR_ARRAY);
+	glDisableClientState(GL_VERTEX_ARRAY);
+	glDisable(GL_POINT_SMOOTH);
+	glPointSize(1.0f);
+}
+void SphereRenderer::Draw(const ViewCuller& visible, DrawMode mode)
+{
+	if (visible.numVisible == 0) return;
+	if (mode == IMPOSTOR)
+	{
+		if (_impostorProgram) DrawImpostors(visible);
+		else DrawPoints(visible);
+	}
+	else if (_instanced) DrawInstanced(visible);
+	else DrawLegacy(visible);
+}
+SphereRenderer::~SphereRenderer()
+{
+}
+
+#endif _SPHERERENDERER_H_
@@ -0,0 +1,28 @@
+#ifndef _STATEHASH_H_
+#define _STATEHASH_H_
+#include <vector>
+#include "objects.h"
+using namespace std;
+
+// 64 bit FNV-1a over the exact bits of every sphere's position and velocity. Two runs have
+// the same hash only if they ended up in bit for bit the same state, which is what replays
+// and regression runs need to check.
+inline unsigned long long HashState(const vector<sphere>& spheres)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+	for (unsigned int i = 0; i < spheres.size(); i++)
+	{
+		const unsigned char* bytes[2] = { (const unsigned char*)spheres[i].p.getData(), (const unsigned char*)spheres[i].v.getData() };
+		for (int k = 0; k < 2; k++)
+		{
+			for (unsigned int b = 0; b < 3 * sizeof(double); b++)
+			{
+				hash ^= bytes[k][b];
+				hash *= 1099511628211ULL;
+			}
+		}
+	}
+	return hash;
+}
+
+#endif _STATEHASH_H_
@@ -0,0 +1,216 @@
+#ifndef _TASKSCHEDULER_H_
+#define _TASKSCHEDULER_H_
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <chrono>
+#include "Arena.h"
+using namespace std;
+
+// A set of tasks and the order they have to run in. Add() the tasks, then Precede(a, b) for
+// every b that may only start once a has finished. Tasks with nothing before them start first.
+class TaskGraph
+{
+public:
+	int Add(function<void()> fn)
+	{
+		_fns.push_back(fn);
+		_next.push_back(vector<int>());
+		_deps.push_back(0);
+		return (int)_fns.size() - 1;
+	}
+	void Precede(int before, int after)
+	{
+		_next[before].push_back(after);
+		_deps[after]++;
+	}
+	void Clear()
+	{
+		_fns.clear();
+		_next.clear();
+		_deps.clear();
+	}
+	int Size() { return (int)_fns.size(); }
+
+private:
+	friend class TaskScheduler;
+	vector< function<void()> > _fns;
+	vector< vector<int> > _next;
+	vector<int> _deps;
+};
+
+// Runs a TaskGraph on a fixed pool of threads. Every thread (the caller of Run() included)
+// owns a queue: it pushes the tasks it makes ready onto the bottom and pops from the bottom, so a
+// task's successor usually runs on the same thread while its data is still in cache. A thread
+// whose queue is empty steals from the top of another's. There are no barriers, a task
+// starts as soon as the last task before it finishes.
+class TaskScheduler
+{
+public:
+	//properties
+	int numThreads; // including the thread that calls Run()
+	//members
+	TaskScheduler(int threads = 0);
+	void Run(TaskGraph& graph);
+	double Busy(int thread) { return _busy[thread]; } // seconds in tasks since ClearBusy()
+	void ClearBusy();
+	~TaskScheduler();
+
+private:
+	// A run never pushes more tasks than the graph has, so a queue is a flat array sized
+	// to the graph: the owner works at the bottom, thieves take from the top
+	struct TaskQueue
+	{
+		mutex lock;
+		vector<int> tasks;
+		int top, bottom;
+	};
+	vector< unique_ptr<TaskQueue> > _queues;
+	vector<thread> _workers;
+	mutex _wakeLock;
+	condition_variable _wake;
+	TaskGraph* _graph;
+	unsigned int _run; // bumped per Run() so a worker joins each run once
+	bool _quit;
+	unique_ptr< atomic<int>[] > _pending;
+	int _pendingSize;
+	atomic<int> _remaining;
+	atomic<int> _active; // workers inside the current run
+	vector<double> _busy; // per thread, only written by that thread
+
+	void WorkerLoop(int id);
+	bool RunOne(int id);
+	void Push(int id, int task);
+};
+
+TaskScheduler::TaskScheduler(int threads)
+{
+	numThreads = threads > 0 ? threads : (int)thread::hardware_concurrency();
+	if (numThreads < 1) numThreads = 1;
+	_graph = NULL;
+	_run = 0;
+	_quit = false;
+	_pendingSize = 0;
+	_remaining = 0;
+	_active = 0;
+	_busy.assign(numThreads, 0.0);
+	for (int i = 0; i < numThreads; i++)
+		_queues.push_back(unique_ptr<TaskQueue>(new TaskQueue()));
+	for (int i = 1; i < numThreads; i++)
+		_workers.push_back(thread(&TaskScheduler::WorkerLoop, this, i));
+}
+void TaskScheduler::Push(int id, int task)
+{
+	TaskQueue& queue = *_queues[id];
+	lock_guard<mutex> lock(queue.lock);
+	queue.tasks[queue.bottom++] = task;
+}
+// Runs one task from our own queue, or failing that one stolen from another thread's
+bool TaskScheduler::RunOne(int id)
+{
+	int task = -1;
+	{
+		TaskQueue& own = *_queues[id];
+		lock_guard<mutex> lock(own.lock);
+		if (own.bottom > own.top)
+			task = own.tasks[--own.bottom];
+	}
+	for (int k = 1; task < 0 && k < numThreads; k++)
+	{
+		TaskQueue& victim = *_queues[(id + k) % numThreads];
+		lock_guard<mutex> lock(victim.lock);
+		if (victim.bottom > victim.top)
+			task = victim.tasks[victim.top++];
+	}
+	if (task < 0) return false;
+
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	_graph->_fns[task]();
+	_busy[id] += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	const vector<int>& next = _graph->_next[task];
+	for (unsigned int i = 0; i < next.size(); i++)
+		if (_pending[next[i]].fetch_sub(1) == 1)
+			Push(id, next[i]);
+	_remaining--;
+	return true;
+}
+void TaskScheduler::WorkerLoop(int id)
+{
+	AllocationScope counting; // workers only ever run step tasks
+	unsigned int seen = 0;
+	while (true)
+	{
+		{
+			unique_lock<mutex> lock(_wakeLock);
+			_wake.wait(lock, [&]{ return _quit || (_graph != NULL && _run != seen); });
+			if (_quit) return;
+			seen = _run;
+			_active++;
+		}
+		while (_remaining > 0)
+			if (!RunOne(id)) this_thread::yield();
+		_active--;
+	}
+}
+// Runs every task in the graph and returns once they have all finished
+void TaskScheduler::Run(TaskGraph& graph)
+{
+	int n = graph.Size();
+	if (n == 0) return;
+	if (n > _pendingSize)
+	{
+		_pending.reset(new atomic<int>[n]);
+		_pendingSize = n;
+	}
+	for (int i = 0; i < numThreads; i++)
+	{
+		TaskQueue& queue = *_queues[i];
+		if ((int)queue.tasks.size() < n) queue.tasks.resize(n);
+		queue.top = queue.bottom = 0;
+	}
+	_remaining = n;
+	int root = 0;
+	for (int t = 0; t < n; t++)
+	{
+		_pending[t] = graph._deps[t];
+		if (graph._deps[t] == 0) Push(root++ % numThreads, t);
+	}
+	{
+		lock_guard<mutex> lock(_wakeLock);
+		_graph = &graph;
+		_run++;
+	}
+	_wake.notify_all();
+
+	while (_remaining > 0)
+		if (!RunOne(0)) this_thread::yield();
+
+	// no worker may still be looking at this graph when the caller changes it
+	{
+		lock_guard<mutex> lock(_wakeLock);
+		_graph = NULL;
+	}
+	while (_active > 0) this_thread::yield();
+}
+// Between runs only
+void TaskScheduler::ClearBusy()
+{
+	for (int i = 0; i < numThreads; i++)
+		_busy[i] = 0.0;
+}
+TaskScheduler::~TaskScheduler()
+{
+	{
+		lock_guard<mutex> lock(_wakeLock);
+		_quit = true;
+	}
+	_wake.notify_all();
+	for (unsigned int i = 0; i < _workers.size(); i++)
+		_workers[i].join();
+}
+
+#endif _TASKSCHEDULER_H_
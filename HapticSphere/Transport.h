@@ -0,0 +1,257 @@
+#ifndef _TRANSPORT_H_
+#define _TRANSPORT_H_
+#include <vector>
+#include <atomic>
+#include <new>
+#include <string.h>
+#include <stdio.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#endif
+using namespace std;
+
+// Point-to-point messages between the processes of a domain decomposition, a stand-in for
+// a cluster interconnect. The transport is made by the parent before it forks, then every
+// process calls Attach() with its own rank. Messages between a pair arrive in the order they
+// were sent. Send() only blocks while the channel is full and Receive() until a whole message
+// is in, so two processes exchanging must not both send first (see DomainDecomposition).
+class Transport
+{
+public:
+	Transport(int participants) : _rank(-1), _size(participants) {}
+	virtual ~Transport() {}
+	virtual void Attach(int rank) { _rank = rank; }
+	void Watch(int pid) { _children.push_back(pid); } // a process the one that made this forked
+	int Rank() { return _rank; }
+	// Returns false if the other end has gone away
+	bool Send(int to, const vector<char>& msg)
+	{
+		unsigned int n = msg.size();
+		return Write(to, (const char*)&n, sizeof(n)) && (n == 0 || Write(to, &msg[0], n));
+	}
+	bool Receive(int from, vector<char>& msg)
+	{
+		unsigned int n;
+		if (!Read(from, (char*)&n, sizeof(n))) return false;
+		msg.resize(n);
+		return n == 0 || Read(from, &msg[0], n);
+	}
+
+protected:
+	int _rank, _size;
+	vector<int> _children;
+	virtual bool Write(int to, const char* data, size_t n) = 0;
+	virtual bool Read(int from, char* data, size_t n) = 0;
+};
+
+#ifndef _WIN32
+
+// One single-producer single-consumer byte ring per ordered pair of processes, all in one
+// shared anonymous mapping. Each side only ever advances its own counter.
+class SharedMemoryTransport : public Transport
+{
+public:
+	static const size_t RING_BYTES = 1 << 20;
+	SharedMemoryTransport(int participants);
+	bool Ok() { return _base != NULL; }
+	~SharedMemoryTransport();
+
+protected:
+	bool Write(int to, const char* data, size_t n);
+	bool Read(int from, char* data, size_t n);
+
+private:
+	struct Ring
+	{
+		atomic<size_t> head; // bytes written, producer only
+		char pad[56]; // keep the two counters off the same cache line
+		atomic<size_t> tail; // bytes read, consumer only
+	};
+	char* _base;
+	size_t _stride, _bytes;
+	pid_t _parent; // the process that made the mapping; the others give up if it dies
+	bool _lost; // and it gives up for good once one of its children has
+	Ring* RingFor(int from, int to) { return (Ring*)(_base + (from * _size + to) * _stride); }
+	bool Wait(int& spins);
+};
+
+SharedMemoryTransport::SharedMemoryTransport(int participants) : Transport(participants)
+{
+	_stride = 128 + RING_BYTES;
+	_bytes = _stride * participants * participants;
+	_parent = getpid();
+	_lost = false;
+	void* p = mmap(NULL, _bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	_base = p == MAP_FAILED ? NULL : (char*)p;
+	if (_base == NULL) { perror("mmap"); return; }
+	for (int from = 0; from < participants; from++)
+	{
+		for (int to = 0; to < participants; to++)
+		{
+			Ring* ring = new (RingFor(from, to)) Ring;
+			ring->head = 0;
+			ring->tail = 0;
+		}
+	}
+}
+// Spin a little, then back off to sleeping so an idle process doesn't burn a core. Nothing
+// tells the other end of a ring that this end has died, so while sleeping the children check on
+// the parent and the parent checks on the children it was told to watch.
+bool SharedMemoryTransport::Wait(int& spins)
+{
+	if (++spins < 1000) { sched_yield(); return true; }
+	if (_lost) return false;
+	if (getpid() != _parent)
+	{
+		if (getppid() != _parent) return false;
+	}
+	else
+	{
+		for (unsigned int i = 0; i < _children.size(); i++)
+		{
+			int status;
+			if (waitpid(_children[i], &status, WNOHANG) == _children[i]) _lost = true;
+		}
+		if (_lost) return false;
+	}
+	usleep(100);
+	return true;
+}
+bool SharedMemoryTransport::Write(int to, const char* data, size_t n)
+{
+	Ring* ring = RingFor(_rank, to);
+	char* buffer = (char*)ring + 128;
+	size_t head = ring->head.load(memory_order_relaxed);
+	int spins = 0;
+	while (n > 0)
+	{
+		size_t space = RING_BYTES - (head - ring->tail.load(memory_order_acquire));
+		if (space == 0) { if (!Wait(spins)) return false; continue; }
+		size_t at = head % RING_BYTES;
+		size_t chunk = n < space ? n : space;
+		if (chunk > RING_BYTES - at) chunk = RING_BYTES - at;
+		memcpy(buffer + at, data, chunk);
+		head += chunk;
+		data += chunk;
+		n -= chunk;
+		ring->head.store(head, memory_order_release);
+		spins = 0;
+	}
+	return true;
+}
+bool SharedMemoryTransport::Read(int from, char* data, size_t n)
+{
+	Ring* ring = RingFor(from, _rank);
+	const char* buffer = (const char*)ring + 128;
+	size_t tail = ring->tail.load(memory_order_relaxed);
+	int spins = 0;
+	while (n > 0)
+	{
+		size_t avail = ring->head.load(memory_order_acquire) - tail;
+		if (avail == 0) { if (!Wait(spins)) return false; continue; }
+		size_t at = tail % RING_BYTES;
+		size_t chunk = n < avail ? n : avail;
+		if (chunk > RING_BYTES - at) chunk = RING_BYTES - at;
+		memcpy(data, buffer + at, chunk);
+		tail += chunk;
+		data += chunk;
+		n -= chunk;
+		ring->tail.store(tail, memory_order_release);
+		spins = 0;
+	}
+	return true;
+}
+SharedMemoryTransport::~SharedMemoryTransport()
+{
+	if (_base != NULL) munmap(_base, _bytes);
+}
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL // a closed peer should fail the send, not kill us with SIGPIPE
+#else
+#define SEND_FLAGS 0
+#endif
+
+// A local stream socket per unordered pair of processes. After Attach() each process only
+// keeps its own ends open, so a process dying shows up as end of file on the other side.
+class SocketTransport : public Transport
+{
+public:
+	SocketTransport(int participants);
+	bool Ok() { return _ok; }
+	void Attach(int rank);
+	~SocketTransport();
+
+protected:
+	bool Write(int to, const char* data, size_t n);
+	bool Read(int from, char* data, size_t n);
+
+private:
+	bool _ok;
+	vector<int> _fds; // [a * size + b] is a's end of the a-b socket
+	int Fd(int from, int to) { return _fds[from * _size + to]; }
+};
+
+SocketTransport::SocketTransport(int participants) : Transport(participants)
+{
+	_ok = true;
+	_fds.assign(participants * participants, -1);
+	for (int a = 0; a < participants; a++)
+	{
+		for (int b = a + 1; b < participants; b++)
+		{
+			int pair[2];
+			if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) { perror("socketpair"); _ok = false; return; }
+			_fds[a * participants + b] = pair[0];
+			_fds[b * participants + a] = pair[1];
+		}
+	}
+}
+void SocketTransport::Attach(int rank)
+{
+	Transport::Attach(rank);
+	for (int a = 0; a < _size; a++)
+	{
+		if (a == rank) continue;
+		for (int b = 0; b < _size; b++)
+		{
+			if (_fds[a * _size + b] >= 0) close(_fds[a * _size + b]);
+			_fds[a * _size + b] = -1;
+		}
+	}
+}
+bool SocketTransport::Write(int to, const char* data, size_t n)
+{
+	while (n > 0)
+	{
+		ssize_t done = send(Fd(_rank, to), data, n, SEND_FLAGS);
+		if (done <= 0) return false;
+		data += done;
+		n -= done;
+	}
+	return true;
+}
+bool SocketTransport::Read(int from, char* data, size_t n)
+{
+	while (n > 0)
+	{
+		ssize_t done = read(Fd(_rank, from), data, n);
+		if (done <= 0) return false;
+		data += done;
+		n -= done;
+	}
+	return true;
+}
+SocketTransport::~SocketTransport()
+{
+	for (unsigned int i = 0; i < _fds.size(); i++)
+		if (_fds[i] >= 0) close(_fds[i]);
+}
+
+#endif
+
+#endif _TRANSPORT_H_
@@ -0,0 +1,154 @@
+#ifndef _VIEWCULLER_H_
+#define _VIEWCULLER_H_
+#include <vector>
+#include <math.h>
+#include <string.h>
+#include <GL/glut.h>
+#include <gmtl/gmtl.h>
+#include <gmtl/Frustum.h>
+#include <gmtl/Containment.h>
+#include "FrameBuffer.h"
+using namespace std;
+using namespace gmtl;
+
+// Works out which spheres of a frame are on screen and how finely to tessellate each one.
+// The frustum comes from whatever projection and modelview are current (so call Begin() after
+// BeginDraw). Whole bins of the frame are tested first: bins fully inside are taken as is,
+// bins fully outside are skipped, and only straddling bins test their spheres one by one.
+// Visible spheres are written out grouped by LOD, picked from their projected radius in pixels.
+class ViewCuller
+{
+public:
+	//properties
+	static const int LODS = 4;
+	int lodSlices[LODS]; // sphere slices/stacks per LOD, coarsest first
+	float lodPixels[LODS - 1]; // projected radius at which the next finer LOD kicks in
+	Frustumf frustum;
+	vector<float> posRadius; // visible spheres, grouped by LOD
+	vector<unsigned char> color;
+	int lodStart[LODS + 1];
+	int numVisible;
+	//members
+	ViewCuller();
+	void Begin();
+	bool IsVisible(const Vec3f& center, float radius);
+	void Cull(const FrameState& frame);
+	~ViewCuller();
+
+private:
+	enum { OUTSIDE, PARTIAL, INSIDE };
+	float _modelview[16];
+	float _pixelScale; // projected radius in pixels = radius * _pixelScale / eye depth
+	vector<int> _visible;
+	vector<unsigned char> _lod;
+
+	int Classify(const Vec3f& lo, const Vec3f& hi);
+	int LodFor(const float* pr);
+};
+
+ViewCuller::ViewCuller()
+{
+	lodSlices[0] = 6; lodSlices[1] = 8; lodSlices[2] = 12; lodSlices[3] = 20;
+	lodPixels[0] = 3; lodPixels[1] = 10; lodPixels[2] = 40;
+	numVisible = 0;
+	for (int i = 0; i <= LODS; i++) lodStart[i] = 0;
+	_pixelScale = 1;
+}
+void ViewCuller::Begin()
+{
+	float projection[16];
+	GLint viewport[4];
+	glGetFloatv(GL_PROJECTION_MATRIX, projection);
+	glGetFloatv(GL_MODELVIEW_MATRIX, _modelview);
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	Matrix44f p, mv;
+	p.set(projection);
+	mv.set(_modelview);
+	frustum.extractPlanes(mv, p);
+	// extracted planes are unnormalized, and the sphere tests need real distances
+	for (int i = 0; i < 6; i++)
+	{
+		float len = length(frustum.mPlanes[i].mNorm);
+		frustum.mPlanes[i].mNorm /= len;
+		frustum.mPlanes[i].mOffset /= len;
+	}
+	_pixelScale = 0.5f * viewport[3] * projection[5];
+}
+bool ViewCuller::IsVisible(const Vec3f& center, float radius)
+{
+	return isInVolume(frustum, Spheref(Point3f(center), radius));
+}
+int ViewCuller::Classify(const Vec3f& lo, const Vec3f& hi)
+{
+	int result = INSIDE;
+	for (int i = 0; i < 6; i++)
+	{
+		const Vec3f& n = frustum.mPlanes[i].mNorm;
+		// the corners nearest and furthest along the plane normal
+		Vec3f pos(n[0] >= 0 ? hi[0] : lo[0], n[1] >= 0 ? hi[1] : lo[1], n[2] >= 0 ? hi[2] : lo[2]);
+		Vec3f neg(n[0] >= 0 ? lo[0] : hi[0], n[1] >= 0 ? lo[1] : hi[1], n[2] >= 0 ? lo[2] : hi[2]);
+		if (dot(n, pos) + frustum.mPlanes[i].mOffset < 0) return OUTSIDE;
+		if (dot(n, neg) + frustum.mPlanes[i].mOffset < 0) result = PARTIAL;
+	}
+	return result;
+}
+int ViewCuller::LodFor(const float* pr)
+{
+	const float* m = _modelview;
+	float depth = -(m[2] * pr[0] + m[6] * pr[1] + m[10] * pr[2] + m[14]);
+	float pixels = depth > 0.001f ? pr[3] * _pixelScale / depth : 1e6f;
+	int lod = 0;
+	while (lod < LODS - 1 && pixels >= lodPixels[lod]) lod++;
+	return lod;
+}
+void ViewCuller::Cull(const FrameState& frame)
+{
+	_visible.clear();
+	int n = frame.binCells;
+	for (unsigned int a = 0; a < frame.bins.size(); a++){
+		int c = frame.bins[a];
+		int x = c % n, y = c / n % n, z = c / (n * n);
+		int state = PARTIAL;
+		// border bins also hold everything clamped in from outside, so never trust their bounds
+		if (x > 0 && y > 0 && z > 0 && x < n - 1 && y < n - 1 && z < n - 1)
+		{
+			float r = frame.maxRadius;
+			Vec3f lo(frame.binOrigin + x * frame.binWidth - r, frame.binOrigin + y * frame.binWidth - r, frame.binOrigin + z * frame.binWidth - r);
+			Vec3f hi(lo[0] + frame.binWidth + 2 * r, lo[1] + frame.binWidth + 2 * r, lo[2] + frame.binWidth + 2 * r);
+			state = Classify(lo, hi);
+		}
+		if (state == OUTSIDE) continue;
+		for (int i = frame.binStart[a]; i < frame.binStart[a + 1]; i++)
+		{
+			const float* pr = &frame.posRadius[4 * i];
+			if (state == INSIDE || IsVisible(Vec3f(pr[0], pr[1], pr[2]), pr[3]))
+				_visible.push_back(i);
+		}
+	}
+
+	// bucket by LOD: count, prefix sum, scatter
+	numVisible = _visible.size();
+	_lod.resize(numVisible);
+	for (int l = 0; l <= LODS; l++) lodStart[l] = 0;
+	for (int v = 0; v < numVisible; v++)
+	{
+		_lod[v] = LodFor(&frame.posRadius[4 * _visible[v]]);
+		lodStart[_lod[v] + 1]++;
+	}
+	for (int l = 0; l < LODS; l++) lodStart[l + 1] += lodStart[l];
+	int cursor[LODS];
+	for (int l = 0; l < LODS; l++) cursor[l] = lodStart[l];
+	posRadius.resize(4 * numVisible);
+	color.resize(4 * numVisible);
+	for (int v = 0; v < numVisible; v++)
+	{
+		int o = cursor[_lod[v]]++;
+		memcpy(&posRadius[4 * o], &frame.posRadius[4 * _visible[v]], 4 * sizeof(float));
+		memcpy(&color[4 * o], &frame.color[4 * _visible[v]], 4);
+	}
+}
+ViewCuller::~ViewCuller()
+{
+}
+
+#endif _VIEWCULLER_H_
@@ -0,0 +1,141 @@
+#ifndef _VIRTUALCOUPLING_H_
+#define _VIRTUALCOUPLING_H_
+#include <vector>
+#include <math.h>
+#include "objects.h"
+using namespace std;
+
+// A god object proxy. Rather than putting the proxy sphere wherever the device (the handle) is,
+// the handle pulls the proxy along through a damped spring, and the proxy's move each step is
+// swept against the spheres and walls around it: it stops where it would press in more than a
+// small allowance and slides on along whatever it hit. However fast the handle moves, the proxy
+// never goes deep into the pile, so the contact springs never spike, and the user feels the
+// coupling spring (which can be much softer than the contacts) instead of the contacts.
+// The coupling spring is integrated implicitly, so it is stable at any timestep.
+// What the handle feels from it is worked out on the servo thread (HapticServo::CouplingForce),
+// from the stiffness and Damping() published with each haptic patch.
+class VirtualCoupling
+{
+public:
+	//properties
+	bool enabled;
+	double stiffness; // of the coupling spring
+	double dampingRatio; // 1 is critical for the proxy's mass
+	double allowance; // how far the proxy may press into anything, as a fraction of its radius
+	int slides; // how many times a move can turn along what it hits
+	Vec3d handle, handleVelocity; // where the user has the device
+	int hits; // what the last move ran into
+	//members
+	VirtualCoupling();
+	void Attach(const sphere& proxy);
+	double Damping(const sphere& proxy) { return 2.0 * dampingRatio * sqrt(proxy.mass * stiffness); }
+	Vec3d Motion(const sphere& proxy, double deltat);
+	void Move(sphere& proxy, const Vec3d& motion, vector<sphere>& spheres, const vector<int>& near, plane walls[6], double deltat);
+	~VirtualCoupling();
+
+private:
+	double Sweep(const sphere& proxy, const Vec3d& from, const Vec3d& move, vector<sphere>& spheres, const vector<int>& near,
+		plane walls[6], Vec3d& normal);
+};
+
+VirtualCoupling::VirtualCoupling()
+{
+	enabled = false;
+	stiffness = 200.0;
+	dampingRatio = 1.0;
+	allowance = 0.1;
+	slides = 3;
+	handle.set(0.0, 0.0, 0.0);
+	handleVelocity.set(0.0, 0.0, 0.0);
+	hits = 0;
+}
+// Puts the handle on the proxy, at rest
+void VirtualCoupling::Attach(const sphere& proxy)
+{
+	handle = proxy.p;
+	handleVelocity.set(0.0, 0.0, 0.0);
+}
+// Where the spring would take the proxy this step if nothing were in the way. Backward Euler:
+//     m (v' - v) = dt (k (h - x - dt v') + c (vh - v'))
+Vec3d VirtualCoupling::Motion(const sphere& proxy, double deltat)
+{
+	double c = Damping(proxy);
+	Vec3d momentum = proxy.v * proxy.mass + ((handle - proxy.p) * stiffness + handleVelocity * c) * deltat;
+	Vec3d v = momentum / (proxy.mass + deltat * c + deltat * deltat * stiffness);
+	return v * deltat;
+}
+// Moves the proxy by motion as far as it can go, looking only at the spheres in near (indices,
+// which may include the proxy) and the walls. The proxy's velocity is set to the move it made,
+// so whatever stopped it takes that part of the velocity away.
+void VirtualCoupling::Move(sphere& proxy, const Vec3d& motion, vector<sphere>& spheres, const vector<int>& near, plane walls[6], double deltat)
+{
+	Vec3d start = proxy.p, at = proxy.p, move = motion;
+	hits = 0;
+	for (int pass = 0; pass <= slides; pass++)
+	{
+		Vec3d normal;
+		double t = Sweep(proxy, at, move, spheres, near, walls, normal);
+		at += move * t;
+		if (t >= 1.0) break;
+		hits++;
+		// carry on with what is left, less the part into what was hit
+		move *= 1.0 - t;
+		double into = dot(move, normal);
+		if (into < 0.0) move -= normal * into;
+		if (pass == slides || dot(move, move) == 0.0) break;
+	}
+	proxy.p = at;
+	proxy.v = (at - start) / deltat;
+}
+// How far along move (0 to 1) the proxy can go from from, and the normal of what stops it
+double VirtualCoupling::Sweep(const sphere& proxy, const Vec3d& from, const Vec3d& move, vector<sphere>& spheres,
+	const vector<int>& near, plane walls[6], Vec3d& normal)
+{
+	double first = 1.0;
+	double dd = dot(move, move);
+	if (dd == 0.0) return first;
+	double press = allowance * proxy.r;
+	double slack = 1e-9 * sqrt(dd); // moves along a surface it is already on don't count as into it
+	for (int w = 0; w < 6; w++)
+	{
+		if (walls[w].K == 0.0) continue;
+		double toward = dot(move, walls[w].N);
+		if (toward >= 0.0) continue;
+		double dist = dot(from - walls[w].p, walls[w].N) - proxy.r + press;
+		double t = dist <= 0.0 ? (toward < -slack ? 0.0 : 1.0) : dist / -toward;
+		if (t < first)
+		{
+			first = t;
+			normal = walls[w].N;
+		}
+	}
+	for (unsigned int k = 0; k < near.size(); k++)
+	{
+		const sphere& s = spheres[near[k]];
+		if (&s == &proxy) continue;
+		Vec3d w = from - s.p;
+		double wd = dot(w, move);
+		if (wd >= 0.0) continue; // moving away
+		double reach = proxy.r + s.r - press;
+		double ww = dot(w, w), t;
+		if (ww <= reach * reach) t = wd < -slack * sqrt(ww) ? 0.0 : 1.0;
+		else
+		{
+			double disc = wd * wd - dd * (ww - reach * reach);
+			if (disc < 0.0) continue; // passes by
+			t = (-wd - sqrt(disc)) / dd;
+		}
+		if (t < first)
+		{
+			first = t;
+			normal = w + move * t;
+			normal /= length(normal);
+		}
+	}
+	return first;
+}
+VirtualCoupling::~VirtualCoupling()
+{
+}
+
+#endif _VIRTUALCOUPLING_H_
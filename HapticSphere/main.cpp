@@ -8,6 +8,7 @@ Demo code for a simple sphere-physics world
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
+#include <ctype.h>
 #include "GL/glut.h"
 #include <gmtl/gmtl.h>
 #include "objects.h"
@@ -15,9 +16,60 @@ Demo code for a simple sphere-physics world
 #include <iostream>
 #include <vector>
 #include "Grid.h"
+#include "LooseOctree.h"
+#include "GridStats.h"
+#include "Spawner.h"
+#include "SphereRegistry.h"
+#include "FrameBuffer.h"
+#include "GLExt.h"
+#include "ViewCuller.h"
+#include "SphereRenderer.h"
+#include "GridRenderer.h"
+#include "TaskScheduler.h"
+#include "DomainDecomposition.h"
+#include "Arena.h"
+#include "StateHash.h"
+#include "ContactTable.h"
+#include "ImplicitSolver.h"
+#include "ProxyReaction.h"
+#include "ContactEvents.h"
+#include "ForceField.h"
+#include "VirtualCoupling.h"
+#include "InputScript.h"
+#include "SpatialQuery.h"
+#include "HapticServo.h"
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
 using namespace std;
 using namespace gmtl;
 
+// Every heap allocation goes through here so the step's can be counted (see Arena.h)
+#if defined(__GNUC__) && __GNUC__ >= 11
+// gcc inlines these delete's free() against memory from operator new and takes it for a mismatch
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void* operator new(size_t size)
+{
+	AllocationCounter::Note();
+	void* p = malloc(size ? size : 1);
+	if (p == NULL) throw bad_alloc();
+	return p;
+}
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+void operator delete(void* p, size_t) noexcept
+{
+	free(p);
+}
+#if defined(__GNUC__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+
 // The timestep of the simulation
 double deltat = 0.001;
 // Number of spheres in the sim, hit '+' for more
@@ -30,10 +82,15 @@ double air_friction = 0.1;
 // The collection of spheres
 // If you haven't seen stl vectors, look them up
 vector< sphere > spheres;
+// Stable handles onto spheres; all adds and removes go through here
+SphereRegistry _registry(spheres);
 
 // The six walls. Spheres and planes are defined in objects.h
 plane walls[6]; // The box is made up of 6 planes
 double wallRadius; // wall dimension
+double boxWallSpring = 1000.0;
+// With the box open the walls push nothing and the spheres are free to leave
+bool _openBox = false;
 
 // Hitting 's' adds energy to the scene with some scaling as defined below. 
 double shakemag = 100.0;
@@ -51,16 +108,117 @@ double rot1 = 0.0, rot2 = 0.0, rot3 = 0.0;
 int animate = 1;
 
 Grid* _grid;
+// The broadphase 'g' uses instead of the grid when run with -octree ('b' swaps them): it only
+// subdivides where the spheres are, for piles that leave most of the grid's cells empty
+LooseOctree _octree;
+bool _useOctree = false;
+Spawner _spawner;
+// Runs each step's task graph
+TaskScheduler _scheduler;
+TaskScheduler* _stepScheduler = &_scheduler; // swapped out by the determinism check
+TaskGraph _stepGraph;
+// What the step graph was built for; it is only rebuilt when one of these changes
+struct StepShape
+{
+	bool grid;
+	bool octree;
+	int reach;
+	bool capture;
+	int threads;
+	bool implicit;
+};
+StepShape _stepShape = { false, false, -1, false, 0, false };
+FrameState* _stepCapture = NULL; // where the graph's last task copies the step out to
+unsigned int _stepStamp = 0;
+// Scratch memory for the step's tasks, handed back all at once when the next step starts
+FrameArena _stepArena;
+atomic<long> _stepAllocations(0); // heap allocations the last step made
+// Contacts kept from step to step, for damping and friction ('k' goes back to plain springs).
+// Keyed by sphere index, so it is cleared whenever spheres are removed.
+ContactTable _contacts;
+// Cell occupancy, broadphase pairs and thread load as of the last step ('p', and the overlay)
+GridStats _gridStats;
+char _gridLine[200]; // taken from the frame, as the stats themselves belong to the sim thread
+// Set from the command line (-domains N) to simulate in N worker processes
+DomainDecomposition _domains;
 bool _drawGrid = false;
 bool _useGrid = false;
 bool _fixedSphereToggle = false;
 int frame = 0;
 int curtime = 0;
 int timebase = 0;
-char s[50];
+char s[256];
 bool _displayFPS = true;
 bool _useEuler = false;
+// Linearly implicit integration ('l'), for much bigger timesteps than the explicit integrators
+// can take with the contact springs. One process only; the domains keep integrating explicitly.
+bool _useImplicit = false;
+ImplicitSolver _solver;
+// The haptic servo ('v', or -servo Hz): a thread of its own reads the device and works out the
+// feedback force, and every step sphere 0 is put where the device is
+HapticServo _servo;
+HapticDevice* _device = NULL;
+SimulatedDevice* _hand = NULL; // when the device is the simulated one, for the arrow keys
+double _servoRate = 1000.0;
+const char* _deviceScript = NULL; // -device file: replay a scripted path instead
+const char* _deviceRecording = NULL; // -record file: save every servo tick when the servo stops
+vector<int> _nearProxy;
+// Sphere lookups for anything outside the step, through the grid when it is in use. Pointed at
+// the grid again after every step; any thread can query between steps.
+SpatialQuery _query;
+// Shift-click picks the sphere under the mouse, with a ray cast through the grid, and dragging
+// then moves it across the screen (held still while it is dragged). The view is kept from the
+// last draw to turn mouse positions into rays.
+GLdouble _viewModelview[16], _viewProjection[16];
+GLint _viewViewport[4];
+// Held by handle: removing spheres moves the last one into the freed place, and a dense
+// index kept across mouse events would then point at another sphere or past the end.
+bool _picking = false;
+SphereHandle _picked;
+bool _pickedWasFixed = false;
+double _pickDepth = 0.0; // along the mouse ray, which keeps the sphere at the same depth
+Vec3d _pickOffset;
+// Contact force and torque on the fixed spheres, worked out with everything else's forces
+ProxyReactions _reactions;
+// Contacts beginning, going on and ending, for whoever subscribes; 'n' tallies them on screen.
+// Only made in this process, not by the domains.
+ContactEvents _contactEvents;
+int _contactTally = -1; // the tally's subscription
+atomic<double> _peakImpulse(0.0); // since the last tally shown; taken and cleared by the display
+// Attractors, wells, vortices and wind on top of gravity (-fields file, 'w' switches them off
+// and on), worked out per sphere just before its contacts. Not sent to the domains.
+ForceFields _fields;
+vector<Vec3d> _fieldForce;
+// 'j': sphere 0 is pulled along by the device (or the arrow keys) through a spring instead of
+// being put where it is, and can't be pushed deep into anything
+VirtualCoupling _coupling;
+// Keys and proxy moves kept with the step they came before (-recordinput file) or played back
+// from such a file (-playinput file), and gmtl curves for the proxy to follow (-path file),
+// so interactive runs can be repeated exactly, and timed with -bench steps
+InputRecording _input;
+const char* _inputRecording = NULL;
+ProxyPath _path;
 bool _drawScene = true;
+bool _drawImpostors = false;
+// Sum contact forces in sphere index order, so the state doesn't depend on the grid layout
+// or the number of processes and matches the brute force pass exactly. Costs a sort per sphere.
+bool _deterministic = false;
+
+// Pipelined mode: physics runs on its own thread and hands finished frames to the display
+// through a triple buffer, so drawing frame N overlaps stepping frame N+1.
+// Anything that edits the scene from the GLUT thread takes _simMutex while the worker runs.
+TripleBuffer _frames;
+bool _pipelined = false;
+thread _simThread;
+atomic<bool> _simRunning(false);
+mutex _simMutex;
+atomic<unsigned int> _stepCount(0);
+unsigned int _stepBase = 0;
+
+GLExtensions _gl;
+ViewCuller _culler;
+SphereRenderer _sphereRenderer;
+GridRenderer _gridRenderer;
 // Called at beginning to define scene
 void
 InitViewerWindow()
@@ -174,14 +332,61 @@ EndDraw()
 	glutSwapBuffers();
 }
 
-// Define some keyboard controls
-void 
-KeyboardCB(unsigned char key, int x, int y) 
+void StartSimThread();
+void StopSimThread();
+
+// Builds the device 'v' drives sphere 0 with: the simulated hand, or the -device path, and
+// records it if -record was given
+void
+StartServo()
+{
+	delete _device;
+	_device = NULL;
+	_hand = NULL;
+	if (_deviceScript != NULL){
+		ScriptedDevice* script = new ScriptedDevice(spheres[0].p);
+		if (!script->Load(_deviceScript)){
+			cout << "Couldn't read a device path from " << _deviceScript << endl;
+			delete script;
+			return;
+		}
+		_device = script;
+	}
+	else _device = _hand = new SimulatedDevice(spheres[0].p);
+	if (_deviceRecording != NULL) _device = new DeviceRecorder(_device);
+	_fixedSphereToggle = true;
+	spheres[0].fixed = true;
+	_servo.Start(_device, _servoRate);
+}
+void
+StopServo()
 {
+	if (!_servo.Running()) return;
+	_servo.Stop();
+	DeviceRecorder* recorder = dynamic_cast<DeviceRecorder*>(_device);
+	if (recorder == NULL) return;
+	if (recorder->Save(_deviceRecording))
+		cout << "Recorded " << recorder->Count() << " servo ticks to " << _deviceRecording << endl;
+	else cout << "Couldn't write " << _deviceRecording << endl;
+	if (recorder->Dropped() > 0) cout << recorder->Dropped() << " ticks didn't fit" << endl;
+}
+
+void
+SaveInputRecording()
+{
+	if (_inputRecording == NULL) return;
+	if (_input.Save(_inputRecording)) cout << "Recorded " << _input.Count() << " input events to " << _inputRecording << endl;
+	else cout << "Couldn't write " << _inputRecording << endl;
+}
+
+// What a key does to the simulation, between steps (with the simulation lock held if pipelined)
+void
+ApplyKey(unsigned char key)
+{
+	bool renumbered = false;
 
 	switch(key) 
 	{
-	case 'q': exit(0);
 	case 's':
 		for ( unsigned int i = 0; i < spheres.size(); i++ )
 		{
@@ -204,28 +409,38 @@ KeyboardCB(unsigned char key, int x, int y)
 		break;
 
 	case '+':
-		for ( int i = 0; i < 5; i++ )
-		{
-			sphere s;
-			s.makeRandomSphere( wallRadius - 0.1); //, wall/4.0 * (rand() / (double)RAND_MAX) );
-			spheres.push_back( s );
-		}
-		
-		numspheres +=5;
+		// placed clear of the existing spheres so the next steps don't start with deep penetrations
+		if (_spawner.SpawnSpheres(spheres, 5, wallRadius - 0.1, 0.05, rand()) < 5)
+			cout << "Box is full" << endl;
+		_registry.RegisterAppended();
+		numspheres = spheres.size();
 		cout << "Num spheres: " << spheres.size() << endl;
 		break;
 
 	case '-':
-		numspheres -=5;		
-		spheres.resize( numspheres );
+		// remove 5 random free spheres, the fixed ones stay
+		for (int i = 0, tries = 0; i < 5 && tries < 100; tries++)
+		{
+			if (spheres.empty()) break;
+			int victim = rand() % spheres.size();
+			if (spheres[victim].fixed) continue;
+			_registry.Remove(_registry.HandleAt(victim));
+			renumbered = true;
+			i++;
+		}
+		if (renumbered){
+			_contacts.Clear();
+			_contactEvents.Clear();
+		}
+		numspheres = spheres.size();
 		cout << "Num spheres: " << spheres.size() << endl;
 		break;
 	case 'p':
 		cout << "Num spheres: " << spheres.size() << endl;
-		if (_useGrid){
-			_grid->PrintGridInfo();
-		}
-		else cout << "Not using grid. Press 'p' to use grid" << endl;
+		if (_contacts.model.enabled) cout << "Contacts: " << _contacts.NumContacts() << endl;
+		if (_useImplicit) cout << "Solver iterations: " << _solver.iterations << endl;
+		if (!_useGrid) cout << "Not using " << (_useOctree ? "octree" : "grid") << ". Press 'g' to use " << (_useOctree ? "octree" : "grid") << endl;
+		_gridStats.Print(cout);
 		break;
 	case 'd':
 		_drawGrid = !_drawGrid;
@@ -233,9 +448,14 @@ KeyboardCB(unsigned char key, int x, int y)
 		break;
 	case 'g':
 		_useGrid = !_useGrid;
-		std::cout << "Using grid: " << std::boolalpha << _useGrid << std::endl;
+		std::cout << "Using " << (_useOctree ? "octree" : "grid") << ": " << std::boolalpha << _useGrid << std::endl;
+		break;
+	case 'b':
+		_useOctree = !_useOctree;
+		std::cout << "Broadphase for 'g' is the " << (_useOctree ? "octree" : "grid") << std::endl;
 		break;
 	case 'f':
+			if (spheres.empty()) break;
 			_fixedSphereToggle = !_fixedSphereToggle;
 			spheres[0].fixed = true;
 			std::cout << "Fixed sphere 0: " << std::boolalpha << _fixedSphereToggle << std::endl;
@@ -243,24 +463,170 @@ KeyboardCB(unsigned char key, int x, int y)
 	case 'h':
 		_displayFPS = !_displayFPS;
 		break;
+	case 'v':
+		if (_servo.Running()) StopServo();
+		else if (_domains.Running()) cout << "The haptic servo needs the simulation in this process" << endl;
+		else if (!spheres.empty()) StartServo();
+		std::cout << "Haptic servo: " << std::boolalpha << _servo.Running() << std::endl;
+		break;
+	case 'j':
+		if (spheres.empty()) break;
+		_coupling.enabled = !_coupling.enabled;
+		if (_coupling.enabled){
+			_fixedSphereToggle = true;
+			spheres[0].fixed = true;
+			spheres[0].v.set(0.0, 0.0, 0.0);
+			_coupling.Attach(spheres[0]);
+		}
+		std::cout << "Virtual coupling: " << std::boolalpha << _coupling.enabled << std::endl;
+		break;
 	case 'e':
 		_useEuler = !_useEuler;
 		std::cout << "Euler integration: " << std::boolalpha << _useEuler << std::endl;
 		break;
+	case 'l':
+		_useImplicit = !_useImplicit;
+		std::cout << "Implicit integration: " << std::boolalpha << _useImplicit << std::endl;
+		break;
 	case 'r':
 		_drawScene = !_drawScene;
 		std::cout << "Draw scene: " << std::boolalpha << _drawScene << std::endl;
 		break;
+	case 'o':
+		_openBox = !_openBox;
+		for (int i = 0; i < 6; i++)
+			walls[i].K = _openBox ? 0.0 : boxWallSpring;
+		std::cout << "Open box: " << std::boolalpha << _openBox << std::endl;
+		break;
+	case 'c':
+		_deterministic = !_deterministic;
+		std::cout << "Deterministic contact order: " << std::boolalpha << _deterministic << std::endl;
+		break;
+	case 'k':
+		_contacts.model.enabled = !_contacts.model.enabled;
+		std::cout << "Contact damping and friction: " << std::boolalpha << _contacts.model.enabled << std::endl;
+		break;
+	case 'n':
+		if (_contactTally < 0)
+			_contactTally = _contactEvents.Subscribe([](const ContactEvent* events, int count, unsigned int){
+				double peak = 0.0;
+				for (int e = 0; e < count; e++)
+					if (events[e].impulse > peak) peak = events[e].impulse;
+				double shown = _peakImpulse;
+				while (peak > shown && !_peakImpulse.compare_exchange_weak(shown, peak));
+			});
+		else{
+			_contactEvents.Unsubscribe(_contactTally);
+			_contactTally = -1;
+		}
+		std::cout << "Contact events: " << std::boolalpha << (_contactTally >= 0) << std::endl;
+		break;
+	case 'w':
+		_fields.enabled = !_fields.enabled;
+		std::cout << "Force fields: " << std::boolalpha << _fields.enabled << " (" << _fields.fields.size() << " loaded)" << std::endl;
+		break;
+	case 'i':
+		_drawImpostors = !_drawImpostors;
+		std::cout << "Draw impostors: " << std::boolalpha << _drawImpostors << std::endl;
+		break;
 	default: animate = 1 - animate; // any other key, like spacebar, starts and stops physics update
 	}
+	if (_domains.Running()) _domains.Scatter(spheres, renumbered); // the domains hold the real state
+}
+
+// Define some keyboard controls
+void 
+KeyboardCB(unsigned char key, int x, int y) 
+{
+	if (key == 'q')
+	{
+		StopSimThread();
+		StopServo();
+		_domains.Stop();
+		SaveInputRecording();
+		exit(0);
+	}
+	if (key == 't')
+	{
+		if (_pipelined) StopSimThread();
+		else StartSimThread();
+		std::cout << "Pipelined physics: " << std::boolalpha << _pipelined << std::endl;
+		return;
+	}
+	unique_lock<mutex> lock(_simMutex, defer_lock);
+	if (_pipelined) lock.lock();
+	if (_inputRecording != NULL) _input.Record(_stepCount, glutGet(GLUT_ELAPSED_TIME) / 1000.0, InputRecording::KEY, key);
+	ApplyKey(key);
 
 	glutPostRedisplay();
 }
 
+// The ray from the near plane to the far plane under the mouse, t from 0 to 1
+Rayd
+MouseRay(int x, int y)
+{
+	GLdouble near[3], far[3];
+	double winY = _viewViewport[3] - y;
+	gluUnProject(x, winY, 0.0, _viewModelview, _viewProjection, _viewViewport, &near[0], &near[1], &near[2]);
+	gluUnProject(x, winY, 1.0, _viewModelview, _viewProjection, _viewViewport, &far[0], &far[1], &far[2]);
+	return Rayd(Point3d(near[0], near[1], near[2]), Vec3d(far[0] - near[0], far[1] - near[1], far[2] - near[2]));
+}
+
+// Picks the first sphere under the mouse, if there is one
+void
+PickSphere(int x, int y)
+{
+	unique_lock<mutex> lock(_simMutex, defer_lock);
+	if (_pipelined) lock.lock();
+	Rayd ray = MouseRay(x, y);
+	double t;
+	int i = _query.Raycast(ray, 1.0, t);
+	if (i < 0) return;
+	_picking = true;
+	_picked = _registry.HandleAt(i);
+	_pickDepth = t;
+	_pickOffset = spheres[i].p - (ray.getOrigin() + ray.getDir() * t);
+	_pickedWasFixed = spheres[i].fixed;
+	spheres[i].fixed = true;
+	spheres[i].v.set(0.0, 0.0, 0.0);
+	cout << "Picked sphere " << i << endl;
+}
+void
+DragSphere(int x, int y)
+{
+	unique_lock<mutex> lock(_simMutex, defer_lock);
+	if (_pipelined) lock.lock();
+	int i = _registry.DenseIndex(_picked);
+	if (i < 0) return;
+	Rayd ray = MouseRay(x, y);
+	spheres[i].p = ray.getOrigin() + ray.getDir() * _pickDepth + _pickOffset;
+	if (_domains.Running()) _domains.Scatter(spheres);
+}
+void
+DropSphere()
+{
+	unique_lock<mutex> lock(_simMutex, defer_lock);
+	if (_pipelined) lock.lock();
+	int i = _registry.DenseIndex(_picked);
+	if (i >= 0) spheres[i].fixed = _pickedWasFixed;
+	_picking = false;
+	if (_domains.Running()) _domains.Scatter(spheres);
+}
+
 // Allows the user to click drag to rotate the scene
 void
 MouseCB(int _b, int _s, int _x, int _y)
 {
+	if (_picking)
+	{
+		if (_s == GLUT_UP) DropSphere();
+		return;
+	}
+	if (_s == GLUT_DOWN && _b == GLUT_LEFT_BUTTON && (glutGetModifiers() & GLUT_ACTIVE_SHIFT))
+	{
+		PickSphere(_x, _y);
+		if (_picking) return;
+	}
 	if (_s == GLUT_UP)
 	{
 		dis += ddis;
@@ -289,6 +655,12 @@ MouseCB(int _b, int _s, int _x, int _y)
 void
 MotionCB(int _x, int _y)
 {
+	if (_picking)
+	{
+		DragSphere(_x, _y);
+		glutPostRedisplay();
+		return;
+	}
 	if (mode == 0)
 	{
 		ddis = dis * (_y - beginy)/200.0;
@@ -302,81 +674,501 @@ MotionCB(int _x, int _y)
 	glutPostRedisplay();
 }
 
-// The main loop
+// One physics step: forces then integration
+// Integrate forces
 void
-IdleCB() 
+Integrate(int first, int last)
+{
+	for (int i = first; i < last; i++){
+		if (_useEuler) spheres[i].Euler(deltat);
+		else spheres[i].EulerCromer(deltat);
+	}
+}
+
+// The part of slab z's spheres (by center) that chunk c of chunks covers
+void
+SlabChunk(int z, int c, int chunks, int& first, int& last)
+{
+	int begin = _grid->_slabStart[z], count = _grid->_slabStart[z + 1] - begin;
+	first = begin + count * c / chunks;
+	last = begin + count * (c + 1) / chunks;
+}
+
+// Sphere i's plain spring contacts with the spheres after it, for the contact events
+void
+ReportSpringContacts(int i, sphere* const* neighbors, int count)
+{
+	sphere& s = spheres[i];
+	int n = neighbors == NULL ? spheres.size() : count;
+	for (int k = 0; k < n; k++){
+		sphere& other = neighbors == NULL ? spheres[k] : *neighbors[k];
+		int j = &other - &spheres[0];
+		if (j <= i) continue;
+		double dist = s.distSphereSphere(other);
+		if (dist < 0.0) _contactEvents.Touch(i, j, -dist * 0.5 * (s.K + other.K) * deltat);
+	}
+}
+
+// All the forces on sphere i, given the spheres it might touch (NULL for every sphere).
+// Integrating implicitly, this is also where sphere i's row of the system is put together.
+// Returns how many spheres it touches.
+int
+ComputeSphereForces(int i, sphere* const* neighbors, int count)
+{
+	sphere& s = spheres[i];
+	const ContactModel& model = _contacts.model;
+	Vec3d torque(0.0, 0.0, 0.0);
+	Vec3d* proxyTorque = s.fixed ? &torque : NULL;
+	bool events = _contactEvents.Enabled();
+	int touching = 0;
+	if (!model.enabled){
+		if (neighbors == NULL) touching = s.computeForces(gravity, air_friction, walls, spheres);
+		else touching = s.computeForcesWithNeighbors(gravity, air_friction, walls, neighbors, count);
+		if (events) ReportSpringContacts(i, neighbors, count);
+	}
+	else if (neighbors == NULL){
+		s.computeExternalForces(gravity, air_friction, walls, model.damping);
+		for (int j = 0; j < (int)spheres.size(); j++){
+			if (j == i) continue;
+			double force = _contacts.Accumulate(s, i, spheres[j], j, deltat, proxyTorque);
+			if (force < 0.0) continue;
+			touching++;
+			if (events && j > i) _contactEvents.Touch(i, j, force * deltat);
+		}
+	}
+	else{
+		s.computeExternalForces(gravity, air_friction, walls, model.damping);
+		for (int k = 0; k < count; k++){
+			int j = neighbors[k] - &spheres[0];
+			double force = _contacts.Accumulate(s, i, *neighbors[k], j, deltat, proxyTorque);
+			if (force >= 0.0) touching++;
+			if (events && j > i && force >= 0.0) _contactEvents.Touch(i, j, force * deltat);
+			if (neighbors[k]->fixed) s.colliding = true;
+		}
+	}
+	// a fixed sphere's force never moves it, but it is what pushes back on whoever holds it.
+	// Plain springs act through the centers, so only the contact model gives it a torque.
+	if (s.fixed) _reactions.Set(i, s.f - gravity * s.mass + s.v * air_friction, torque);
+	if (_fields.Active()) s.f += _fieldForce[i];
+	if (_useImplicit)
+		_solver.AssembleRow(i, spheres, neighbors, count, walls, air_friction,
+			model.enabled ? model.damping : 0.0, model.enabled ? model.shearStiffness : 0.0, deltat);
+	return touching;
+}
+
+// Forces on a chunk of the spheres homed in slab z, from the cells each one overlaps
+void
+ComputeSlabForces(int z, int c, int chunks)
+{
+	int first, last;
+	SlabChunk(z, c, chunks, first, last);
+	vector<sphere*, ArenaAllocator<sphere*> > neighborSpheres((ArenaAllocator<sphere*>(&_stepArena)));
+	long long candidates = 0, touching = 0;
+	if (_fields.Active()) _fields.Apply(spheres, _grid->_slabSpheres.data(), first, last, z, _fieldForce.data());
+	for (int n = first; n < last; n++){
+		int i = _grid->_slabSpheres[n];
+		_grid->GatherNeighbors(i, spheres, neighborSpheres, _deterministic);
+		candidates += neighborSpheres.size();
+		touching += ComputeSphereForces(i, neighborSpheres.data(), neighborSpheres.size());
+	}
+	_gridStats.Count(z * chunks + c, candidates, touching);
+}
+
+// Forces on block b of the spheres in the octree's order, so each block's spheres are close together
+void
+ComputeOctreeForces(int b, int blocks)
+{
+	int n = spheres.size();
+	int first = n * b / blocks, last = n * (b + 1) / blocks;
+	const int* order = _octree.Order();
+	vector<sphere*, ArenaAllocator<sphere*> > neighborSpheres((ArenaAllocator<sphere*>(&_stepArena)));
+	long long candidates = 0, touching = 0;
+	if (_fields.Active()) _fields.Apply(spheres, order, first, last, -1, _fieldForce.data());
+	for (int k = first; k < last; k++){
+		int i = order[k];
+		_octree.GatherNeighbors(i, spheres, neighborSpheres, _deterministic);
+		candidates += neighborSpheres.size();
+		touching += ComputeSphereForces(i, neighborSpheres.data(), neighborSpheres.size());
+	}
+	_gridStats.Count(b, candidates, touching);
+}
+
+void
+IntegrateSlab(int z, int c, int chunks)
+{
+	int first, last;
+	SlabChunk(z, c, chunks, first, last);
+	for (int n = first; n < last; n++){
+		int i = _grid->_slabSpheres[n];
+		if (_useEuler) spheres[i].Euler(deltat);
+		else spheres[i].EulerCromer(deltat);
+	}
+}
+
+// With the grid on, each z slab has its own broadphase, contact and integrate tasks that only
+// wait for the nearby slabs they actually share spheres with, so one part of the box can be
+// integrating while another is still finding contacts. Tasks look up the sphere count when
+// they run, so the same graph serves however many spheres there are.
+// With the octree, the blocks work out their codes, the subtrees are sorted and linked each in a
+// task of their own, and then every force has to be in before anything moves, as without a grid.
+// Integrating implicitly the graph stops at the forces; the solver takes it from there.
+void
+BuildStepGraph(const StepShape& shape)
 {
-	// Need timing code here
+	_stepGraph.Clear();
+	int blocks = 2 * _stepScheduler->numThreads;
+	vector<int> integrate;
+	if (shape.octree){
+		_octree.Blocks(blocks);
+		_gridStats.Slots(blocks);
+		int root = _stepGraph.Add([]{ _octree.Root(); });
+		int offsets = _stepGraph.Add([]{ _octree.Offsets(); });
+		int scattered = _stepGraph.Add([]{});
+		int built = _stepGraph.Add([]{});
+		int forcesDone = _stepGraph.Add([]{});
+		for (int b = 0; b < blocks; b++){
+			_stepGraph.Precede(_stepGraph.Add([=]{ _octree.Bounds(spheres, b); }), root);
+			int codes = _stepGraph.Add([=]{ _octree.Codes(spheres, b); });
+			_stepGraph.Precede(root, codes);
+			_stepGraph.Precede(codes, offsets);
+			int scatter = _stepGraph.Add([=]{ _octree.Scatter(b); });
+			_stepGraph.Precede(offsets, scatter);
+			_stepGraph.Precede(scatter, scattered);
+		}
+		for (int k = 0; k <= LooseOctree::SUBTREES; k++){
+			int t = _stepGraph.Add([=]{ _octree.BuildSubtree(spheres, k); });
+			_stepGraph.Precede(scattered, t);
+			_stepGraph.Precede(t, built);
+		}
+		for (int b = 0; b < blocks; b++){
+			int t = _stepGraph.Add([=]{ ComputeOctreeForces(b, blocks); });
+			_stepGraph.Precede(built, t);
+			_stepGraph.Precede(t, forcesDone);
+			if (shape.implicit) continue;
+			t = _stepGraph.Add([=]{
+				int n = spheres.size();
+				Integrate(n * b / blocks, n * (b + 1) / blocks);
+			});
+			_stepGraph.Precede(forcesDone, t);
+			integrate.push_back(t);
+		}
+	}
+	else if (shape.grid){
+		int reach = shape.reach;
+		int slabs = Grid::N_CELLS;
+		int chunks = (blocks + slabs - 1) / slabs;
+		_gridStats.Slots(slabs * chunks);
 
+		int group = _stepGraph.Add([]{ _grid->GroupBySlab(); });
+		for (int b = 0; b < blocks; b++)
+			_stepGraph.Precede(_stepGraph.Add([=]{
+				int n = spheres.size();
+				_grid->ComputeRanges(spheres, n * b / blocks, n * (b + 1) / blocks);
+			}), group);
+		vector<int> fill(slabs), contacts(slabs * chunks);
+		for (int z = 0; z < slabs; z++){
+			fill[z] = _stepGraph.Add([=]{ _grid->FillSlab(z, reach); });
+			_stepGraph.Precede(group, fill[z]);
+		}
+		// contacts for slab z read the cells of slabs within reach
+		for (int z = 0; z < slabs; z++){
+			for (int c = 0; c < chunks; c++){
+				int t = contacts[z * chunks + c] = _stepGraph.Add([=]{ ComputeSlabForces(z, c, chunks); });
+				for (int f = max(0, z - reach); f <= min(slabs - 1, z + reach); f++)
+					_stepGraph.Precede(fill[f], t);
+			}
+		}
+		// ...and so see spheres homed up to twice that far away, which must not move before then
+		for (int z = 0; z < slabs && !shape.implicit; z++){
+			for (int c = 0; c < chunks; c++){
+				int t = _stepGraph.Add([=]{ IntegrateSlab(z, c, chunks); });
+				for (int f = max(0, z - 2 * reach); f <= min(slabs - 1, z + 2 * reach); f++)
+					for (int k = 0; k < chunks; k++)
+						_stepGraph.Precede(contacts[f * chunks + k], t);
+				integrate.push_back(t);
+			}
+		}
+	}
+	else{
+		// Do the physics simulation. Every sphere is checked against every other, so nothing
+		// can move until all the forces are in.
+		_gridStats.Slots(blocks);
+		int forcesDone = _stepGraph.Add([]{});
+		for (int b = 0; b < blocks; b++){
+			_stepGraph.Precede(_stepGraph.Add([=]{
+				int n = spheres.size();
+				long long touching = 0;
+				if (_fields.Active()) _fields.Apply(spheres, NULL, n * b / blocks, n * (b + 1) / blocks, -1, _fieldForce.data());
+				for (int i = n * b / blocks; i < n * (b + 1) / blocks; i++)
+					touching += ComputeSphereForces(i, NULL, 0);
+				_gridStats.Count(b, (long long)(n * (b + 1) / blocks - n * b / blocks) * (n - 1), touching);
+			}), forcesDone);
+			if (shape.implicit) continue;
+			int t = _stepGraph.Add([=]{
+				int n = spheres.size();
+				Integrate(n * b / blocks, n * (b + 1) / blocks);
+			});
+			_stepGraph.Precede(forcesDone, t);
+			integrate.push_back(t);
+		}
+	}
+	if (shape.capture){
+		int t = _stepGraph.Add([]{ _stepCapture->Capture(spheres, _stepStamp); });
+		for (unsigned int i = 0; i < integrate.size(); i++)
+			_stepGraph.Precede(integrate[i], t);
+	}
+}
+
+// Puts sphere 0 (or with the coupling on, the handle pulling it) at p, moving at v
+void
+MoveProxyTo(const Vec3d& p, const Vec3d& v)
+{
+	if (_coupling.enabled){
+		_coupling.handle = p;
+		_coupling.handleVelocity = v;
+		return;
+	}
+	spheres[0].fixed = true;
+	spheres[0].p = p;
+	spheres[0].v = v;
+}
+
+// Puts the proxy where the servo last read the device
+void
+FollowServo()
+{
+	ServoState state;
+	if (spheres.empty() || !_servo.Latest(state)) return;
+	MoveProxyTo(state.position, state.velocity);
+	if (_inputRecording != NULL) _input.RecordProxy(_stepCount, glutGet(GLUT_ELAPSED_TIME) / 1000.0, state.position, state.velocity);
+}
+
+void ApplyKey(unsigned char key);
+void ApplySpecialKey(int key);
+
+// Does what was recorded for before this step and moves the proxy along the path. The servo
+// isn't started again on playback ('v'): the proxy events are what it did.
+void
+PlayInput()
+{
+	InputRecording::Event e;
+	while (_input.Next(_stepCount, e)){
+		if (e.kind == InputRecording::KEY && e.key != 'v') ApplyKey(e.key);
+		else if (e.kind == InputRecording::SPECIAL) ApplySpecialKey(e.key);
+		else if (e.kind == InputRecording::PROXY && !spheres.empty()) MoveProxyTo(e.p, e.v);
+	}
+	Vec3d p, v;
+	if (_path.Count() > 0 && !spheres.empty() && _path.At(_stepCount, deltat, p, v)) MoveProxyTo(p, v);
+}
+
+// Moves sphere 0 after the handle for the next step, as far as it goes before it presses into
+// something. The grid is this step's, so the search is padded by a radius for what has moved since.
+void
+MoveProxy()
+{
+	if (spheres.empty()) return;
+	sphere& proxy = spheres[0];
+	Vec3d motion = _coupling.Motion(proxy, deltat);
+	double radius = 0.5 * length(motion) + 2.0 * proxy.r;
+	Vec3d center = proxy.p + motion * 0.5;
+	_query.Radius(center, radius, _nearProxy);
+	_coupling.Move(proxy, motion, spheres, _nearProxy, walls, deltat);
+}
+
+// Hands the servo what is around sphere 0 after this step: anything it could touch before the
+// next step, if it moves no more than its own radius
+void
+PublishHapticPatch(unsigned int step)
+{
+	if (spheres.empty()) return;
+	const sphere& proxy = spheres[0];
+	double radius = 2.0 * proxy.r;
+	_query.Radius(proxy.p, radius, _nearProxy);
+	HapticPatch& patch = _servo.Patch();
+	patch.spheres.clear();
+	for (unsigned int k = 0; k < _nearProxy.size(); k++){
+		if (_nearProxy[k] == 0) continue;
+		const sphere& s = spheres[_nearProxy[k]];
+		HapticPatch::Neighbor n = { s.p, s.v, s.r, s.K };
+		patch.spheres.push_back(n);
+	}
+	for (int w = 0; w < 6; w++) patch.walls[w] = walls[w];
+	patch.proxyRadius = proxy.r;
+	patch.proxyK = proxy.K;
+	patch.proxyAt = proxy.p;
+	patch.reactionForce = _reactions.Force(0);
+	patch.reactionTorque = _reactions.Torque(0);
+	patch.coupled = _coupling.enabled;
+	patch.couplingK = _coupling.stiffness;
+	patch.couplingC = _coupling.Damping(proxy);
+	patch.proxyVelocity = proxy.v;
+	patch.step = step;
+	_servo.PublishPatch();
+}
+
+// One simulation step. If capture is given the new state is copied into it at the end,
+// as the last task of the step.
+void
+StepSimulation(FrameState* capture)
+{
+	PlayInput();
 	// I wanted to let the user do more and more violent shaking. So the shaking decays
 	// over time, but also doubles in magnitude when the scene is shook.
 	shakemag = shakemag * 0.99; // Making a shake adds in a decaying velocity change - decay it here.
 	if ( shakemag < 10.0 )
 		shakemag = 10.0;
 
-	// You will want to build a grid here. Rebuild fresh each time as we assume all objects move. 
-	// Normally you might just want to update the moving objects
-	if (_useGrid){
-		_grid->ConstructGrid(spheres);
-		vector<sphere*> neighborSpheres;
-		//in each cell - get the sphere indices within - loop over the spheres among its neighbors
-		for (int z = 0; z < _grid->N_CELLS; z++){
-			for (int y = 0; y < _grid->N_CELLS; y++){
-				for (int x = 0; x < _grid->N_CELLS; x++){
-					int i = 0;
-					for (i = 0; i < _grid->_cells[x][y][z].size(); i++){
-						
-						neighborSpheres.push_back(&spheres[_grid->_cells[x][y][z][i]]);
-					}
-					for (i = 0; i < neighborSpheres.size(); i++){
-						neighborSpheres[i]->computeForcesWithNeighbors(gravity, air_friction, walls, neighborSpheres);
-					}
-					neighborSpheres.clear();
-				}
-			}
+	// The step is a graph of tasks rather than a fixed sequence of phases (see BuildStepGraph).
+	// The graph only changes shape when the settings do, so it is kept from step to step.
+	AllocationScope counting;
+	long allocations = AllocationCounter::Count();
+	_stepArena.Reset();
+	unsigned int step = _stepCount + 1;
+	if (_domains.Running()){
+		// the domain processes do the physics, this one only collects the result
+		_domains.Step(spheres, deltat, gravity, air_friction, _useEuler, walls, _contacts.model);
+		_query.Attach(NULL, spheres);
+		if (capture != NULL){
+			capture->Capture(spheres, step);
+			capture->contacts = capture->contactBegins = capture->contactEnds = 0;
+			capture->broadphase[0] = 0;
 		}
+		_stepCount++;
+		_stepAllocations = AllocationCounter::Count() - allocations;
+		return;
 	}
-	else{
-		// Do the physics simulation
+	StepShape shape = { _useGrid, _useGrid && _useOctree, 0, capture != NULL && !_useImplicit, _stepScheduler->numThreads, _useImplicit };
+	Grid* grid = _useGrid && !_useOctree ? _grid : NULL;
+	if (shape.octree) _octree.Resize(spheres.size());
+	else if (_useGrid){
+		// You will want to build a grid here. Rebuild fresh each time as we assume all objects move. 
+		double maxRadius = 0;
 		for (unsigned int i = 0; i < spheres.size(); i++)
+			if (spheres[i].r > maxRadius) maxRadius = spheres[i].r;
+		shape.reach = _grid->Reach(maxRadius);
+		_grid->_ranges.resize(spheres.size());
+	}
+	if (shape.grid != _stepShape.grid || shape.octree != _stepShape.octree || shape.reach != _stepShape.reach || shape.capture != _stepShape.capture ||
+		shape.threads != _stepShape.threads || shape.implicit != _stepShape.implicit){
+		BuildStepGraph(shape);
+		_stepShape = shape;
+	}
+	_stepCapture = capture;
+	_stepStamp = step;
+	if (_servo.Running()) FollowServo();
+	_contacts.BeginStep();
+	_reactions.Begin(spheres.size());
+	_contactEvents.Begin(spheres.size());
+	if (_fields.Active()){
+		_fieldForce.resize(spheres.size());
+		_fields.Prepare(grid);
+	}
+	if (_useImplicit) _solver.Begin(spheres.size());
+	_stepScheduler->Run(_stepGraph);
+	_reactions.Filter(deltat);
+	if (_contactEvents.Enabled()) _contactEvents.End(step);
+	if (capture != NULL){
+		capture->contacts = _contactEvents.NumContacts();
+		capture->contactBegins = _contactEvents.begins;
+		capture->contactEnds = _contactEvents.ends;
+	}
+	if (_useImplicit){
+		_solver.Solve(spheres, deltat, *_stepScheduler);
+		if (capture != NULL) capture->Capture(spheres, step);
+	}
+	_gridStats.Update(grid, shape.octree ? &_octree : NULL, *_stepScheduler, spheres.size());
+	if (capture != NULL) _gridStats.Summary(capture->broadphase, sizeof(capture->broadphase));
+	if (shape.octree) _query.AttachOctree(&_octree, spheres);
+	else _query.Attach(grid, spheres);
+	if (_coupling.enabled) MoveProxy();
+	if (_servo.Running()) PublishHapticPatch(step);
+	_stepCount++;
+	_stepAllocations = AllocationCounter::Count() - allocations;
+}
+
+void
+SimThreadLoop()
+{
+	while (_simRunning)
+	{
 		{
-			// This call passes in all the spheres which get checked for collision. Instead, you might
-			// want to maintain a separate vector for each sphere that gives its potential colliding pairs or a vector in each grid cell.
-			spheres[i].computeForces(gravity, air_friction, walls, spheres);
+			lock_guard<mutex> lock(_simMutex);
+			StepSimulation(&_frames.Back());
 		}
+		_frames.Publish();
+		this_thread::yield(); // give keyboard edits a chance at the lock
 	}
-	
-		// Now integrate forces
-	for (unsigned int i = 0; i < spheres.size(); i++){
-		if (_useEuler) spheres[i].Euler(deltat);
-		else spheres[i].EulerCromer(deltat);
+}
+
+void
+StartSimThread()
+{
+	if (_pipelined) return;
+	_pipelined = true;
+	_simRunning = true;
+	_simThread = thread(SimThreadLoop);
+}
+
+void
+StopSimThread()
+{
+	if (!_pipelined) return;
+	_simRunning = false;
+	_simThread.join();
+	_pipelined = false;
+}
+
+// The main loop
+void
+IdleCB() 
+{
+	if (!_pipelined)
+	{
+		StepSimulation(&_frames.Back());
+		_frames.Publish();
 	}
-	
 	glutPostRedisplay(); // Calls the registered display function - DisplayCB
 }
-void specialKeyCB(int key, int x, int y)
+void
+ApplySpecialKey(int key)
 {
+	Vec3d by(0.0, 0.0, 0.0);
 	switch (key)
 	{
 	case GLUT_KEY_UP:
-		if (_fixedSphereToggle)	spheres[0].p[1] += 0.05;
+		by[1] = 0.05;
 		break;
 	case GLUT_KEY_DOWN:
-		if (_fixedSphereToggle) spheres[0].p[1] -= 0.05f;
+		by[1] = -0.05;
 		break;
 	case GLUT_KEY_LEFT:
-		if (_fixedSphereToggle) spheres[0].p[0] -= 0.05;
+		by[0] = -0.05;
 		break;
 	case GLUT_KEY_RIGHT:
-		if (_fixedSphereToggle) spheres[0].p[0] += 0.05;
+		by[0] = 0.05;
 		break;
 	case GLUT_KEY_PAGE_DOWN:
-		if (_fixedSphereToggle) spheres[0].p[2] += 0.05;
+		by[2] = 0.05;
 		break;
 	case GLUT_KEY_END:
-		if (_fixedSphereToggle) spheres[0].p[2] -= 0.05;
+		by[2] = -0.05;
 		break;
 	}
+	// with the servo running the keys move the hand holding the device, not the sphere,
+	// and with the coupling on they move the handle that pulls it
+	if (_servo.Running()){
+		if (_hand != NULL) _hand->MoveTarget(by);
+	}
+	else if (_coupling.enabled && !_domains.Running()) _coupling.handle += by;
+	else if (_fixedSphereToggle) spheres[0].p += by;
+	if (_domains.Running() && _fixedSphereToggle) _domains.Scatter(spheres);
+}
+void specialKeyCB(int key, int x, int y)
+{
+	unique_lock<mutex> lock(_simMutex, defer_lock);
+	if (_pipelined) lock.lock();
+	if (_inputRecording != NULL) _input.Record(_stepCount, glutGet(GLUT_ELAPSED_TIME) / 1000.0, InputRecording::SPECIAL, key);
+	ApplySpecialKey(key);
 }
 void renderBitmapString(
 	float x,
@@ -397,7 +1189,16 @@ void DrawFPS()
 	curtime = glutGet(GLUT_ELAPSED_TIME);
 
 	if (curtime - timebase > 1000) {
-		sprintf(s, "FPS:%4.2f",	frame*1000.0 / (curtime - timebase));
+		unsigned int steps = _stepCount;
+		sprintf(s, "FPS:%4.2f SPS:%4.2f Visible:%d Allocs/step:%ld", frame*1000.0 / (curtime - timebase), (steps - _stepBase)*1000.0 / (curtime - timebase), _culler.numVisible, (long)_stepAllocations);
+		if (_contactTally >= 0){
+			const FrameState& f = _frames.Front();
+			sprintf(s + strlen(s), " Contacts:%d +%d -%d peak:%.2g", f.contacts, f.contactBegins, f.contactEnds, _peakImpulse.exchange(0.0));
+		}
+		if (_servo.Running())
+			sprintf(s + strlen(s), " Servo:%.0fHz jitter:%.0fus late:%.0fus%s", _servo.MeasuredRate(), _servo.Jitter(), _servo.WorstLate(), _servo.Realtime() ? " RT" : "");
+		strcpy(_gridLine, _frames.Front().broadphase);
+		_stepBase = steps;
 		timebase = curtime;
 		frame = 0;
 	}
@@ -414,6 +1215,7 @@ void DrawFPS()
 		glOrtho(-10, 10, -10, 10, 1, 20);
 		glTranslatef(-8,8, 0);
 		renderBitmapString(0, 0, GLUT_BITMAP_HELVETICA_18, s);
+		if (_useGrid) renderBitmapString(0, -0.8f, GLUT_BITMAP_HELVETICA_18, _gridLine);
 		glPopMatrix();
 		
 		glMatrixMode(GL_MODELVIEW);
@@ -428,32 +1230,261 @@ void
 DisplayCB()
 {
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	_frames.Acquire();
 	DrawFPS();
 	BeginDraw();
+	glGetDoublev(GL_MODELVIEW_MATRIX, _viewModelview);
+	glGetDoublev(GL_PROJECTION_MATRIX, _viewProjection);
+	glGetIntegerv(GL_VIEWPORT, _viewViewport);
 
 	if (_drawScene){
-		for (unsigned int i = 0; i < spheres.size(); i++)
-			spheres[i].draw();
+		_culler.Begin();
+		_culler.Cull(_frames.Front());
+		_sphereRenderer.Draw(_culler, _drawImpostors ? SphereRenderer::IMPOSTOR : SphereRenderer::MESH);
 
-		for (unsigned int i = 0; i < 6; i++)
-			walls[i].draw(wallRadius); // The plane width is not part of the class since planes are infinite
+		for (unsigned int i = 0; i < 6 && !_openBox; i++)
+		{
+			// a wall is a square of half-width wallRadius around walls[i].p
+			if (_culler.IsVisible(Vec3f(walls[i].p[0], walls[i].p[1], walls[i].p[2]), wallRadius * 1.415))
+				walls[i].draw(wallRadius); // The plane width is not part of the class since planes are infinite
+		}
 
-		if (_drawGrid) _grid->DrawGrid();
+		if (_drawGrid) _gridRenderer.Draw(_frames.Front());
 	}
 	EndDraw();
 }
 
-int main(int argc, char **argv)
+// What a run of the determinism check starts from, and goes back to after: the scene, and
+// everything a played back key can change
+struct CheckpointState
 {
-	glutInit(&argc, argv);
-	glutInitDisplayMode (GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
+	vector<sphere> spheres;
+	unsigned int stepCount;
+	double deltat, shakemag;
+	bool useGrid, useOctree, deterministic, useEuler, useImplicit, openBox, fixedSphere;
+	bool contactModel, fields, coupling;
+	double wallK[6];
+};
+
+void
+SaveCheckpoint(CheckpointState& state)
+{
+	state.spheres = spheres;
+	state.stepCount = _stepCount;
+	state.deltat = deltat;
+	state.shakemag = shakemag;
+	state.useGrid = _useGrid;
+	state.useOctree = _useOctree;
+	state.deterministic = _deterministic;
+	state.useEuler = _useEuler;
+	state.useImplicit = _useImplicit;
+	state.openBox = _openBox;
+	state.fixedSphere = _fixedSphereToggle;
+	state.contactModel = _contacts.model.enabled;
+	state.fields = _fields.enabled;
+	state.coupling = _coupling.enabled;
+	for (int i = 0; i < 6; i++) state.wallK[i] = walls[i].K;
+}
+
+// Also clears what the steps carry over from one to the next, and rewinds the playback
+void
+RestoreCheckpoint(const CheckpointState& state)
+{
+	spheres = state.spheres;
+	_registry.Reset();
+	numspheres = spheres.size();
+	_stepCount = state.stepCount;
+	deltat = state.deltat;
+	shakemag = state.shakemag;
+	_useGrid = state.useGrid;
+	_useOctree = state.useOctree;
+	_deterministic = state.deterministic;
+	_useEuler = state.useEuler;
+	_useImplicit = state.useImplicit;
+	_openBox = state.openBox;
+	_fixedSphereToggle = state.fixedSphere;
+	_contacts.model.enabled = state.contactModel;
+	_fields.enabled = state.fields;
+	_coupling.enabled = state.coupling;
+	for (int i = 0; i < 6; i++) walls[i].K = state.wallK[i];
+	_contacts.Clear();
+	_reactions.Clear();
+	_contactEvents.Clear();
+	_input.Rewind();
+	srand(_input.seed); // for what the played back keys do at random
+}
+
+// Steps the current scene in deterministic mode on 1, 4 and 32 threads, with no broadphase,
+// the grid and the octree, and compares the state hashes: all nine should be the same.
+// Each run starts from the same step and plays back the same input. Leaves the scene as it
+// found it.
+bool
+CheckDeterminism(int steps)
+{
+	CheckpointState start;
+	SaveCheckpoint(start);
+	const char* names[3] = { "brute force", "grid", "octree" };
+	int threadCounts[3] = { 1, 4, 32 };
+	unsigned long long hashes[9];
+	for (int run = 0; run < 9; run++)
+	{
+		int broadphase = run / 3, t = run % 3;
+		RestoreCheckpoint(start);
+		_deterministic = true;
+		_useGrid = broadphase > 0;
+		_useOctree = broadphase == 2;
+		TaskScheduler scheduler(threadCounts[t]);
+		_stepScheduler = &scheduler;
+		_stepShape.threads = 0; // the graph was built for the last scheduler
+		for (int i = 0; i < steps; i++)
+			StepSimulation(NULL);
+		hashes[run] = HashState(spheres);
+		cout << names[broadphase] << ", " << threadCounts[t] << " threads, " << steps << " steps: state hash " << hex << hashes[run] << dec << endl;
+	}
+	_stepScheduler = &_scheduler;
+	_stepShape.threads = 0;
+	RestoreCheckpoint(start);
+	bool same = true;
+	for (int run = 1; run < 9; run++)
+		same = same && hashes[run] == hashes[0];
+	cout << (same ? "Identical across thread counts and broadphases" : "MISMATCH across thread counts or broadphases") << endl;
+	return same;
+}
 
+// Runs steps steps with no display, playing back -playinput and -path if given, and reports
+// how fast it went and the state it ended in (the hash matches between runs that did the same)
+void
+RunBenchmark(int steps)
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	for (int i = 0; i < steps; i++)
+		StepSimulation(NULL);
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	cout << steps << " steps of " << spheres.size() << " spheres in " << seconds << "s: " << steps / seconds << " steps/s, "
+		<< _stepAllocations << " allocations in the last step" << endl;
+	cout << "State hash " << hex << HashState(spheres) << dec << endl;
+	_gridStats.Print(cout);
+}
+
+int main(int argc, char **argv)
+{
 	cout << "Basic Instructions" << endl;
 	cout << "'+' Adds 5 balls '-' Removes 5 balls" << endl;
 	cout << "> doubles time step < halves time step" << endl;
 	cout << "'s' adds a small, decaying velocity kick to balls. Hit rapidly to build up." << endl;
-	cout << "Mouse left-drag rotates scene right-drag zooms" << endl;
+	cout << "Mouse left-drag rotates scene right-drag zooms, shift-left-drag picks up a sphere and moves it" << endl;
+	cout << "'i' draws spheres as one-point impostors (for very large counts)" << endl;
+	cout << "'n' tallies contacts beginning and ending each step, and the hardest impulse" << endl;
+	cout << "'b' swaps the broadphase 'g' turns on between the uniform grid and a loose octree" << endl;
+	cout << "'o' opens the box so spheres can fly off (and 'o' again closes it)" << endl;
+	cout << "'l' integrates implicitly, so '>' can take the time step far higher" << endl;
+	cout << "'k' switches contact damping and friction off (plain springs) and on" << endl;
+	cout << "'c' sums contacts in a fixed order, for runs that have to reproduce exactly" << endl;
+	cout << "'v' drives sphere 0 from a (simulated) haptic device on its own servo thread; arrows move the hand" << endl;
+	cout << "'j' pulls sphere 0 along through a spring (a virtual coupling) so it stops at what it touches" << endl;
+	cout << "'t' runs physics on its own thread, overlapped with drawing" << endl;
+	cout << "Command line: [spheres] [-domains N] [-transport shm|socket] to split the box over N processes" << endl;
+	cout << "              [-deterministic] [-checkdeterminism steps] to check runs match across thread counts" << endl;
+	cout << "              [-servo Hz] haptic servo rate (default 1000)" << endl;
+	cout << "              [-device file] drive 'v' from a path of \"t x y z\" lines [-record file] save what the device did" << endl;
+	cout << "              [-recordinput file] [-playinput file] keys and proxy moves, step for step" << endl;
+	cout << "              [-path file] move sphere 0 along curves [-bench steps] time a run without drawing" << endl;
+	cout << "              [-fields file] attractors, wells, vortices and wind, 'w' switches them off and on" << endl;
+	cout << "              [-grid] start with the broadphase on ('g') [-octree] make it a loose octree ('b' swaps back)" << endl;
 
+	// Make a sphere, numspheres is a global. Increment for more or hit '+' in running program
+	// A starting count can also be given on the command line. The arguments are read before
+	// GLUT sees them, so -bench and -checkdeterminism can run without a display; anything
+	// that isn't one of ours (-display, -geometry...) is left for glutInit.
+	int domains = 0;
+	int checkSteps = 0;
+	int benchSteps = 0;
+	const char* playback = NULL;
+	const char* path = NULL;
+	const char* transport = "shm";
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-domains") == 0 && i + 1 < argc) domains = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-transport") == 0 && i + 1 < argc) transport = argv[++i];
+		else if (strcmp(argv[i], "-deterministic") == 0) _deterministic = true;
+		else if (strcmp(argv[i], "-checkdeterminism") == 0 && i + 1 < argc) checkSteps = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-servo") == 0 && i + 1 < argc) _servoRate = atof(argv[++i]);
+		else if (strcmp(argv[i], "-device") == 0 && i + 1 < argc) _deviceScript = argv[++i];
+		else if (strcmp(argv[i], "-record") == 0 && i + 1 < argc) _deviceRecording = argv[++i];
+		else if (strcmp(argv[i], "-recordinput") == 0 && i + 1 < argc) _inputRecording = argv[++i];
+		else if (strcmp(argv[i], "-playinput") == 0 && i + 1 < argc) playback = argv[++i];
+		else if (strcmp(argv[i], "-path") == 0 && i + 1 < argc) path = argv[++i];
+		else if (strcmp(argv[i], "-bench") == 0 && i + 1 < argc) benchSteps = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-octree") == 0) _useOctree = true;
+		else if (strcmp(argv[i], "-grid") == 0) _useGrid = true;
+		else if (strcmp(argv[i], "-fields") == 0 && i + 1 < argc){
+			if (!_fields.Load(argv[++i])) cout << "Couldn't read force fields from " << argv[i] << endl;
+		}
+		else if ((strcmp(argv[i], "-display") == 0 || strcmp(argv[i], "-geometry") == 0) && i + 1 < argc) i++; // GLUT's
+		else if (isdigit((unsigned char)argv[i][0])) numspheres = atoi(argv[i]);
+	}
+	// a recording starts from the same scene it was made from
+	if (playback != NULL){
+		if (_input.Load(playback)){
+			numspheres = _input.spheres;
+			deltat = _input.deltat;
+			srand(_input.seed);
+			cout << "Playing back " << _input.Count() << " input events from " << playback << endl;
+		}
+		else cout << "Couldn't read " << playback << endl;
+	}
+	else if (_inputRecording != NULL){
+		_input.spheres = numspheres;
+		_input.deltat = deltat;
+		srand(_input.seed);
+	}
+	if (path != NULL && !_path.Load(path)) cout << "Couldn't read a proxy path from " << path << endl;
+	wallRadius = 1.0;
+	_registry.Reserve(numspheres);
+	numspheres = _spawner.SpawnSpheres(spheres, numspheres, wallRadius - 0.1, 0.05, rand());
+	_registry.RegisterAppended();
+	cout << "Num spheres: " << spheres.size() << endl;
+	_grid = new Grid(wallRadius);
+	_query.Attach(NULL, spheres);
+	_frames.SetBinning(_grid->wallLeft, _grid->_cellWidthX, _grid->N_CELLS);
+	// Build the 6 walls of the environment, walls is a global variable
+	walls[0] = plane(Vec3d(0.0, 1.0, 0.0), Vec3d(0.0, -wallRadius, 0.0), boxWallSpring);
+	walls[1] = plane(Vec3d(1.0, 0.0, 0.0), Vec3d(-wallRadius, 0.0, 0.0), boxWallSpring);
+	walls[2] = plane(Vec3d(-1.0, 0.0, 0.0), Vec3d(wallRadius, 0.0, 0.0), boxWallSpring);
+	walls[3] = plane(Vec3d(0.0, 0.0, 1.0), Vec3d(0.0, 0.0, -wallRadius), boxWallSpring);
+	walls[4] = plane(Vec3d(0.0, 0.0, -1.0), Vec3d(0.0, 0.0, wallRadius), boxWallSpring);
+	walls[5] = plane(Vec3d(0.0, -1.0, 0.0), Vec3d(0.0, wallRadius, 0.0), boxWallSpring);
+	// the check runs every configuration in this process, so it goes before the domains start
+	if (checkSteps > 0)
+		exit(CheckDeterminism(checkSteps) ? 0 : 1);
+#ifndef _WIN32
+	if (domains > 1)
+	{
+		// one process per domain plus this one
+		Transport* link = NULL;
+		if (strcmp(transport, "socket") == 0)
+		{
+			SocketTransport* sockets = new SocketTransport(domains + 1);
+			if (sockets->Ok()) link = sockets;
+		}
+		else
+		{
+			SharedMemoryTransport* shm = new SharedMemoryTransport(domains + 1);
+			if (shm->Ok()) link = shm;
+		}
+		if (link != NULL && _domains.Start(spheres, walls, wallRadius, domains, link))
+			cout << "Simulating in " << _domains.numDomains << " processes over " << transport << endl;
+	}
+#endif
+	if (benchSteps > 0){
+		RunBenchmark(benchSteps);
+		SaveInputRecording();
+		_domains.Stop();
+		exit(0);
+	}
+
+	glutInit(&argc, argv);
+	glutInitDisplayMode (GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
 	// create the window
 	glutInitWindowPosition(300, 0);
 	glutInitWindowSize( 700, 700 );
@@ -461,6 +1492,9 @@ int main(int argc, char **argv)
 
 	// set OpenGL graphics state -- material props, perspective, etc.
 	InitViewerWindow();
+	_gl.Load();
+	_sphereRenderer.Init(&_gl, _culler);
+	_gridRenderer.Init(&_gl);
 
 	// set the callbacks
 	glutDisplayFunc(DisplayCB);
@@ -469,24 +1503,7 @@ int main(int argc, char **argv)
 	glutMotionFunc(MotionCB);  
 	glutKeyboardFunc(KeyboardCB);
 	glutSpecialFunc(specialKeyCB);
-	// Make a sphere, numspheres is a global. Increment for more or hit '+' in running program
-	wallRadius = 1.0;
-	for ( int i = 0; i < numspheres; i++ )
-	{
-		sphere s;
-		s.makeRandomSphere( wallRadius - 0.1 );
-		spheres.push_back( s );
-	}
-	_grid = new Grid(wallRadius);
-	double boxWallSpring = 1000.0;
-	// Build the 6 walls of the environment, walls is a global variable
-	walls[0] = plane(Vec3d(0.0, 1.0, 0.0), Vec3d(0.0, -wallRadius, 0.0), boxWallSpring);
-	walls[1] = plane(Vec3d(1.0, 0.0, 0.0), Vec3d(-wallRadius, 0.0, 0.0), boxWallSpring);
-	walls[2] = plane(Vec3d(-1.0, 0.0, 0.0), Vec3d(wallRadius, 0.0, 0.0), boxWallSpring);
-	walls[3] = plane(Vec3d(0.0, 0.0, 1.0), Vec3d(0.0, 0.0, -wallRadius), boxWallSpring);
-	walls[4] = plane(Vec3d(0.0, 0.0, -1.0), Vec3d(0.0, 0.0, wallRadius), boxWallSpring);
-	walls[5] = plane(Vec3d(0.0, -1.0, 0.0), Vec3d(0.0, wallRadius, 0.0), boxWallSpring);
-	
+
 	glutMainLoop();
 }
 
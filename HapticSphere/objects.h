@@ -150,20 +150,26 @@ public:
 	    return length(separation) - r - s.r;
 	}
 
-	// Compute forces for penetrating into a wall.
-	void accumulatePlaneContact( const plane & wall )
+	// Compute forces for penetrating into a wall. With a damping ratio the wall also soaks up
+	// the speed going into it, but never pulls the sphere back in.
+	void accumulatePlaneContact( const plane & wall, double dampingRatio = 0.0 )
 	{
 		double dist = distSpherePlane(wall);
 
 		if ( dist <  0.0 )
 		{
 			double fMag = -dist * wall.K; // force is -Kx
+			if ( dampingRatio > 0.0 )
+			{
+				fMag -= 2.0 * dampingRatio * sqrt(mass * wall.K) * dot(v, wall.N);
+				if ( fMag < 0.0 ) fMag = 0.0;
+			}
 			f += wall.N * fMag; // force is in the wall normal direction - add it to the existing force
 		}
 	}
 
     // add to current force the penalty of colliding with another sphere.
-	void accumulateSphereContact( const sphere & s )
+	bool accumulateSphereContact( const sphere & s )
 	{
 		double dist = distSphereSphere(s);
 
@@ -178,10 +184,12 @@ public:
 			N *= -force; // Scale the direction by the magnitude
 			f += N; // We are accumulating forces so add it into the existing forces found
 		}
+		return dist < 0.0;
 	}
 
 	// Compute all the forces between a sphere and the walls and other spheres and gravity and drag.
-	void computeForces(Vec3d gravity, double dragConstant, plane walls[6], std::vector< sphere > & spheres)
+	// Returns how many spheres it touches.
+	int computeForces(Vec3d gravity, double dragConstant, plane walls[6], std::vector< sphere > & spheres)
 	{
 		clearForce();
 		accumulateGravity( gravity );
@@ -193,30 +201,44 @@ public:
 
 		// This needs to be toggled to use a list of spheres for the grid
 
+		int touching = 0;
 		for ( unsigned int j = 0; j < spheres.size(); j++ )
 			if ( this != &spheres[j] ) // Don't collide with yourself
-				accumulateSphereContact( spheres[j] );
+				touching += accumulateSphereContact( spheres[j] );
+		return touching;
 	}
-	// Compute all the forces between a sphere and the walls and other spheres and gravity and drag.
-	void computeForcesWithNeighbors(Vec3d gravity, double dragConstant, plane walls[6], std::vector< sphere* > & spheres)
+	// Everything but the other spheres: gravity, drag and the walls. Starts the force over.
+	void computeExternalForces(Vec3d gravity, double dragConstant, plane walls[6], double wallDamping = 0.0)
 	{
 		clearForce();
 		accumulateGravity(gravity);
 		accumulateDrag(dragConstant);
 		// Now check for collisions with the box walls
 		for (int j = 0; j < 6; j++)
-			accumulatePlaneContact(walls[j]);
+			accumulatePlaneContact(walls[j], wallDamping);
+	}
+	// Compute all the forces between a sphere and the walls and other spheres and gravity and drag.
+	int computeForcesWithNeighbors(Vec3d gravity, double dragConstant, plane walls[6], std::vector< sphere* > & spheres)
+	{
+		return computeForcesWithNeighbors(gravity, dragConstant, walls, spheres.empty() ? NULL : &spheres[0], spheres.size());
+	}
+	// The same, for a neighbor list held in any kind of array
+	int computeForcesWithNeighbors(Vec3d gravity, double dragConstant, plane walls[6], sphere* const* spheres, int count)
+	{
+		computeExternalForces(gravity, dragConstant, walls);
 		//Check for collisions with external spheres in the environment
 
 		// This needs to be toggled to use a list of spheres for the grid
 
-		for (unsigned int j = 0; j < spheres.size(); j++){
+		int touching = 0;
+		for (int j = 0; j < count; j++){
 			if (this != spheres[j]) // Don't collide with yourself
-				accumulateSphereContact(*spheres[j]);
-			if (this->fixed){
-				spheres[j]->colliding = true;
+				touching += accumulateSphereContact(*spheres[j]);
+			if (spheres[j]->fixed){ // only ever writes this sphere, so spheres can run in parallel
+				colliding = true;
 			}
 		}
+		return touching;
 	}
 	// Perform Euler-Cromer integration using the accumulated force stored in the sphere.
 	void EulerCromer( double deltat)
@@ -236,25 +258,6 @@ public:
 		
 		}
 	}
-
-    // Draw the particle as a small sphere using glutSolidSphere. Particles with zero radius are given a small size.
-    void draw()
-	{
-	    glPushMatrix();
-		float currentColor[4];
-		glGetFloatv(GL_CURRENT_COLOR, currentColor);
-		if (colliding) glColor4f(_collisionColor[0], _collisionColor[1], _collisionColor[2], 1);
-		if (fixed) glColor4f(_fixedColor[0], _fixedColor[1], _fixedColor[2], 1);
-		
-	    glTranslated(p[0],p[1],p[2]);
-		if ( r < 0.0001)
-		    glutSolidSphere( 0.01, 5, 5 );
-		else
-			glutSolidSphere( r, 12, 12 );
-		glColor4f(currentColor[0], currentColor[1], currentColor[2], 1);
-	    glPopMatrix();
-		colliding = false;
-	}
 };
 
 #endif _OBJECTS_H_
\ No newline at end of file